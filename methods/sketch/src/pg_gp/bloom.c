@@ -0,0 +1,422 @@
+/*!
+ * \file bloom.c
+ *
+ * \brief Blocked Bloom filter implementation
+ */
+/*!
+ * \implementation
+ * A Bloom filter answers whether a value may be in a set: never "no" for a
+ * value that is, and "yes" for a value that is not with a small false
+ * positive probability.  This one is a blocked Bloom filter (Putze, Sanders
+ * and Singler, "Cache-, Hash- and Space-Efficient Bloom Filters", 2007):
+ * the bits are split into blocks of 512 bits, one cache line, and each
+ * value sets its k bits within a single block.  The first half of the
+ * 128-bit hash of the value picks the block and the second half seeds the
+ * choice of the bits.  A lookup thus reads one cache line.
+ *
+ * Blocking costs some accuracy, since blocks fill unevenly, so the filter
+ * is sized for the requested false positive probability by the blocked
+ * estimate rather than the classic one.  Filters of the same size merge
+ * by OR'ing their bits, which gives the filter of the union of their sets.
+ *
+ * The filter is stored as a bytea in the same layout as the transition
+ * value.  It records the type of the values, since values of different
+ * types hash differently even when they compare equal.  Variable-length
+ * values are hashed by their contents, whether they come from a table or
+ * from an expression.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+
+#include <math.h>
+
+#define BLOOM_MAGIC           0x464d4c42 /* "BLMF" */
+#define BLOOM_VERSION         1
+/*! bits in a block: one 64-byte cache line */
+#define BLOOM_BLOCK_BITS      512
+#define BLOOM_BLOCK_WORDS     (BLOOM_BLOCK_BITS/64)
+#define BLOOM_MAX_HASHES      16
+#define BLOOM_DEFAULT_FPP     0.01
+#define BLOOM_MAX_BLOCKS      ((MaxAllocSize - VARHDRSZ - sizeof(bloomfilter)) \
+                               / (BLOOM_BLOCK_WORDS*sizeof(uint64)))
+
+/*!
+ * \internal
+ * \brief a blocked Bloom filter, as transition value and as stored value
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;     /*! BLOOM_MAGIC */
+    uint8  version;   /*! BLOOM_VERSION */
+    uint8  nhashes;   /*! number of bits set per value */
+    uint8  hashkind;  /*! SKETCH_HASH_* function used for the filter */
+    uint8  unused;
+    uint32 nblocks;   /*! number of blocks of BLOOM_BLOCK_BITS bits */
+    Oid    typOid;    /*! Oid of the type of the values */
+    uint64 bits[0];   /*! the nblocks blocks */
+} bloomfilter;
+
+#define BLOOM_FILTER(b)      ((bloomfilter *)VARDATA(b))
+#define BLOOM_INITIALIZED(b) (VARSIZE(b) > VARHDRSZ)
+#define BLOOM_SZ(nblocks)    (VARHDRSZ + sizeof(bloomfilter) + \
+                              (size_t)(nblocks)*BLOOM_BLOCK_WORDS*sizeof(uint64))
+
+/*!
+ * \internal
+ * \brief properties of the input type, cached in fn_extra by __bloom_trans
+ * \endinternal
+ */
+typedef struct {
+    Oid   typOid;
+    int16 typLen;
+    bool  typByVal;
+} bloomtypcache;
+
+/*!
+ * \internal
+ * \brief state cached in fn_extra by bloom_contains: the probe type, and
+ * the last filter detoasted, under the toasted datum it came from
+ * \endinternal
+ */
+typedef struct {
+    bloomtypcache typ;
+    struct varlena *raw;     /*! copy of the toasted filter datum, or NULL */
+    bytea *         filter;  /*! its detoasted filter */
+} bloomprobecache;
+
+Datum __bloom_trans(PG_FUNCTION_ARGS);
+Datum __bloom_merge(PG_FUNCTION_ARGS);
+Datum __bloom_final(PG_FUNCTION_ARGS);
+Datum bloom_contains(PG_FUNCTION_ARGS);
+bytea *bloom_new(int64, double, Oid, int);
+void   bloom_insert_hash(bloomfilter *, const uint64 *);
+bool   bloom_test_hash(const bloomfilter *, const uint64 *);
+bytea *bloom_merge_c(bytea *, bytea *);
+
+static double       bloom_blocked_fpp(double, int);
+static bloomfilter *bloom_check(bytea *);
+static void         bloom_lookup_type(FunctionCallInfo, bloomtypcache *);
+
+/*!
+ * the false positive probability of a blocked Bloom filter with the given
+ * number of values per block and bits set per value.  The number of values
+ * that land in a block is Poisson distributed, and a block holding i values
+ * has the false positive probability of a classic filter of its size.
+ */
+static double bloom_blocked_fpp(double load, int nhashes)
+{
+    double fpp = 0;
+    double poisson = exp(-load);     /* probability of i values in a block */
+    int    i, last = (int)(load + 10*sqrt(load) + 20);
+
+    for (i = 0; i <= last; i++) {
+        double empty = pow(1 - 1.0/BLOOM_BLOCK_BITS, (double)nhashes*i);
+
+        fpp += poisson*pow(1 - empty, nhashes);
+        poisson *= load/(i + 1);
+    }
+    return fpp;
+}
+
+/*!
+ * allocate an empty Bloom filter
+ * \param capacity the number of distinct values the filter is sized for
+ * \param fpp the false positive probability wanted at that many values
+ * \param typOid the type of the values
+ * \param hashkind the SKETCH_HASH_* function to hash values with
+ */
+bytea *bloom_new(int64 capacity, double fpp, Oid typOid, int hashkind)
+{
+    double       bits, load;
+    int          nhashes;
+    uint64       nblocks;
+    bytea *      blob;
+    bloomfilter *f;
+
+    if (capacity < 1)
+        elog(ERROR, "Bloom filter capacity must be positive");
+    if (!(fpp > 0 && fpp < 1))
+        elog(ERROR, "Bloom filter false positive probability must be between 0 and 1");
+
+    /*
+     * start from the bits per value of a classic filter, and add blocks
+     * until the blocked filter is as accurate
+     */
+    bits = -log(fpp)/(M_LN2*M_LN2);
+    for (;;) {
+        nhashes = Max(1, Min(BLOOM_MAX_HASHES, (int)(bits*M_LN2 + 0.5)));
+        load = BLOOM_BLOCK_BITS/bits;
+        if (bloom_blocked_fpp(load, nhashes) <= fpp
+            || bits*capacity > (double)BLOOM_MAX_BLOCKS*BLOOM_BLOCK_BITS)
+            break;
+        bits *= 1.05;
+    }
+    nblocks = (uint64)ceil(capacity/load);
+    if (nblocks > BLOOM_MAX_BLOCKS)
+        elog(ERROR, "Bloom filter too large");
+
+    blob = (bytea *)palloc0(BLOOM_SZ(nblocks));
+    SET_VARSIZE(blob, BLOOM_SZ(nblocks));
+    f = BLOOM_FILTER(blob);
+    f->magic = BLOOM_MAGIC;
+    f->version = BLOOM_VERSION;
+    f->nhashes = nhashes;
+    f->hashkind = hashkind;
+    f->nblocks = nblocks;
+    f->typOid = typOid;
+    return blob;
+}
+
+/*!
+ * step x through a 64-bit linear congruential generator seeded with the
+ * hash, and take its top bits as the next bit of the block.  Plain double
+ * hashing would set bits in arithmetic progressions, which overlap too
+ * often within a block this small.
+ */
+#define BLOOM_NEXT_BIT(x) \
+    ((uint32)(((x) = (x)*UINT64CONST(6364136223846793005) \
+                     + UINT64CONST(1442695040888963407)) >> 55))
+
+/*! the block of a filter that a hash maps to */
+static inline uint64 *bloom_block(const bloomfilter *f, const uint64 *hash)
+{
+    /* multiply-shift maps the low 32 bits onto [0, nblocks) evenly */
+    uint64 block = ((hash[0] & 0xffffffff)*(uint64)f->nblocks) >> 32;
+
+    return (uint64 *)f->bits + block*BLOOM_BLOCK_WORDS;
+}
+
+/*!
+ * set the bits of a value in a filter
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
+ */
+void bloom_insert_hash(bloomfilter *f, const uint64 *hash)
+{
+    uint64 *block = bloom_block(f, hash);
+    uint64  x = hash[1];
+    int     i;
+
+    for (i = 0; i < f->nhashes; i++) {
+        uint32 bit = BLOOM_NEXT_BIT(x);
+
+        block[bit/64] |= (uint64)1 << (bit % 64);
+    }
+}
+
+/*!
+ * whether the bits of a value are all set in a filter
+ * \param hash the SKETCH_HASHLEN-byte hash of the value
+ */
+bool bloom_test_hash(const bloomfilter *f, const uint64 *hash)
+{
+    uint64 *block = bloom_block(f, hash);
+    uint64  x = hash[1];
+    int     i;
+
+    for (i = 0; i < f->nhashes; i++) {
+        uint32 bit = BLOOM_NEXT_BIT(x);
+
+        if (!(block[bit/64] & ((uint64)1 << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * OR the bits of filter blob2 into filter blob1, which must be of the same
+ * size and type
+ * \returns blob1
+ */
+bytea *bloom_merge_c(bytea *blob1, bytea *blob2)
+{
+    bloomfilter *f1 = BLOOM_FILTER(blob1);
+    bloomfilter *f2 = BLOOM_FILTER(blob2);
+    size_t       i, nwords = (size_t)f1->nblocks*BLOOM_BLOCK_WORDS;
+
+    if (f1->nblocks != f2->nblocks || f1->nhashes != f2->nhashes)
+        elog(ERROR, "cannot merge Bloom filters of different sizes");
+    if (f1->hashkind != f2->hashkind)
+        elog(ERROR,
+             "cannot merge Bloom filters built with different hash functions");
+    if (f1->typOid != f2->typOid)
+        elog(ERROR, "cannot merge Bloom filters of different types");
+
+    for (i = 0; i < nwords; i++)
+        f1->bits[i] |= f2->bits[i];
+    return blob1;
+}
+
+/*!
+ * check that a bytea holds a filter from bloom_filter, and return it
+ */
+static bloomfilter *bloom_check(bytea *blob)
+{
+    bloomfilter *f = BLOOM_FILTER(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(bloomfilter)
+        || f->magic != BLOOM_MAGIC || f->version != BLOOM_VERSION)
+        elog(ERROR, "not a Bloom filter");
+    if (f->nhashes < 1 || f->nhashes > BLOOM_MAX_HASHES
+        || f->nblocks < 1 || VARSIZE(blob) != BLOOM_SZ(f->nblocks))
+        elog(ERROR, "corrupt Bloom filter");
+    return f;
+}
+
+/*! look up the type of argument 1 of the call */
+static void bloom_lookup_type(FunctionCallInfo fcinfo, bloomtypcache *typ)
+{
+    typ->typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    if (!OidIsValid(typ->typOid))
+        elog(ERROR, "could not determine data type of input");
+    get_typlenbyval(typ->typOid, &typ->typLen, &typ->typByVal);
+}
+
+PG_FUNCTION_INFO_V1(__bloom_trans);
+
+/*!
+ * UDA transition function for bloom_filter.  The arguments are the value,
+ * the number of distinct values to size the filter for, and optionally
+ * the false positive probability wanted.
+ */
+Datum __bloom_trans(PG_FUNCTION_ARGS)
+{
+    bytea *        blob = PG_GETARG_BYTEA_P(0);
+    bloomtypcache *typ = (bloomtypcache *)fcinfo->flinfo->fn_extra;
+    uint64         hash[SKETCH_HASHLEN/sizeof(uint64)];
+    bloomfilter *  f;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (typ == NULL) {
+        /* look up the input type once per query */
+        typ = (bloomtypcache *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                  sizeof(bloomtypcache));
+        bloom_lookup_type(fcinfo, typ);
+        fcinfo->flinfo->fn_extra = typ;
+    }
+    if (!BLOOM_INITIALIZED(blob))
+        blob = bloom_new(PG_GETARG_INT64(2),
+                         (PG_NARGS() > 3) ? PG_GETARG_FLOAT8(3)
+                         : BLOOM_DEFAULT_FPP,
+                         typ->typOid, SKETCH_HASH_DEFAULT);
+    f = BLOOM_FILTER(blob);
+
+    sketch_hash_value(PG_GETARG_DATUM(1), typ->typLen, typ->typByVal,
+                      f->hashkind, (uint8 *)hash);
+    bloom_insert_hash(f, hash);
+    PG_RETURN_BYTEA_P(blob);
+}
+
+PG_FUNCTION_INFO_V1(__bloom_merge);
+
+/*!
+ * Greenplum "prefunc" to combine filters from multiple machines.
+ * Also the transition function of bloom_filter_merge, over stored filters.
+ */
+Datum __bloom_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (!BLOOM_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    bloom_check(blob2);
+    if (!BLOOM_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+    bloom_check(blob1);
+
+    /* merge into blob1 in place, unless it might not be ours to modify */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          ))) {
+        bytea *copy = (bytea *)palloc(VARSIZE(blob1));
+
+        memcpy(copy, blob1, VARSIZE(blob1));
+        blob1 = copy;
+    }
+    PG_RETURN_BYTEA_P(bloom_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__bloom_final);
+
+/*! UDA final function for bloom_filter: the filter, or NULL if no rows */
+Datum __bloom_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (!BLOOM_INITIALIZED(blob))
+        PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(blob);
+}
+
+PG_FUNCTION_INFO_V1(bloom_contains);
+
+/*!
+ * UDF for whether a value may be in the set of a Bloom filter.  It is meant
+ * to be called for every row of a large table with the same filter, so the
+ * filter is detoasted once and kept in fn_extra, along with the type of the
+ * values.
+ */
+Datum bloom_contains(PG_FUNCTION_ARGS)
+{
+    struct varlena * raw = (struct varlena *)PG_GETARG_POINTER(0);
+    bloomprobecache *cache = (bloomprobecache *)fcinfo->flinfo->fn_extra;
+    uint64           hash[SKETCH_HASHLEN/sizeof(uint64)];
+    bytea *          blob;
+    bloomfilter *    f;
+
+    if (cache == NULL) {
+        cache = (bloomprobecache *)
+            MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+                                   sizeof(bloomprobecache));
+        bloom_lookup_type(fcinfo, &cache->typ);
+        fcinfo->flinfo->fn_extra = cache;
+    }
+
+    if (!VARATT_IS_EXTENDED(raw))
+        blob = (bytea *)raw;
+    else if (cache->raw != NULL && VARSIZE_ANY(cache->raw) == VARSIZE_ANY(raw)
+             && memcmp(cache->raw, raw, VARSIZE_ANY(raw)) == 0)
+        blob = cache->filter;
+    else {
+        /* a new toasted filter: detoast it into fn_mcxt and remember it */
+        MemoryContext oldcontext =
+            MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+        if (cache->raw != NULL) {
+            pfree(cache->raw);
+            pfree(cache->filter);
+            cache->raw = NULL;
+        }
+        cache->filter = (bytea *)PG_DETOAST_DATUM_COPY(PointerGetDatum(raw));
+        cache->raw = (struct varlena *)palloc(VARSIZE_ANY(raw));
+        memcpy(cache->raw, raw, VARSIZE_ANY(raw));
+        MemoryContextSwitchTo(oldcontext);
+        blob = cache->filter;
+    }
+
+    f = bloom_check(blob);
+    if (f->typOid != cache->typ.typOid)
+        elog(ERROR, "Bloom filter of type %s probed with a value of type %s",
+             format_type_be(f->typOid), format_type_be(cache->typ.typOid));
+    sketch_hash_value(PG_GETARG_DATUM(1), cache->typ.typLen,
+                      cache->typ.typByVal, f->hashkind, (uint8 *)hash);
+    PG_RETURN_BOOL(bloom_test_hash(f, hash));
+}
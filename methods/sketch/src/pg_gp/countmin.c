@@ -21,6 +21,13 @@
  * dyadic ranges ({[14-15] as 7 in range 2, [16-31] as 1 in range 16, [32-47] as 2 in range 16, [48-48] as 48 in range 1}).
  * Dyadic ranges are similarly useful for histogramming, order stats, etc.
  *
+ * Most of the dyadic ranges of a column are usually degenerate: once x/(2^i)
+ * is the same for every row (e.g. 0 for non-negative values below 2^i), so is
+ * every coarser range.  We only allocate counters for a range once two rows
+ * differ in it, and otherwise just remember the one value and the row count.
+ * The depth and width of the sketch can also be chosen per aggregate, and
+ * sketches that only need point counts can skip the dyadic ranges.
+ *
  * The results of the estimators below generally have guarantees of the form
  * "the answer is within \epsilon of the true answer with probability 1-\delta."
  */
@@ -31,6 +38,7 @@
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
 #include "utils/numeric.h"
+#include "lib/stringinfo.h"
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
@@ -38,17 +46,25 @@
 #include "countmin.h"
 
 #include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static bytea *cm_increment(bytea *, uint32, uint32 *, uint64);
+static bytea *cm_materialize(bytea *, uint32);
+static bytea *cm_promote(bytea *);
+static bool   cm_add_counters32(uint32 *, const uint32 *, size_t);
+static bytea *cm_add_counters(bytea *, cmsketch *);
 
 PG_FUNCTION_INFO_V1(__cmsketch_int8_trans);
 
 /*
  * This is the UDF interface.  It does sanity checks and preps values
- * for the interesting logic in countmin_dyadic_trans_c
+ * for the interesting logic in cmsketch_insert
  */
 Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = NULL;
-    cmtransval *transval;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -67,15 +83,54 @@ Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS)
     /* get the provided element, being careful in case it's NULL */
     if (!PG_ARGISNULL(1)) {
         transblob = cmsketch_check_transval(fcinfo, true);
-        transval = (cmtransval *)(VARDATA(transblob));
 
-        /* the following line modifies the contents of transval, and hence transblob */
-        countmin_dyadic_trans_c(transval, PG_GETARG_DATUM(1));
+        /* the following line modifies the contents of transblob, or replaces it */
+        transblob = cmsketch_insert(transblob, PG_GETARG_INT64(1));
         PG_RETURN_DATUM(PointerGetDatum(transblob));
     }
     else PG_RETURN_DATUM(PointerGetDatum(PG_GETARG_BYTEA_P(0)));
 }
 
+PG_FUNCTION_INFO_V1(__cmsketch_int8_sized_trans);
+
+/*
+ * Transition function for sketches of a chosen depth and width.  The last
+ * argument says whether the dyadic ranges should be kept, which range counts,
+ * centiles and histograms need; without them only point counts are possible.
+ */
+Datum __cmsketch_int8_sized_trans(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        int depth = PG_GETARG_INT32(2);
+        int width = PG_GETARG_INT32(3);
+
+        if (depth < 1 || depth > CM_MAX_DEPTH)
+            elog(ERROR, "cmsketch depth must be between 1 and %d",
+                 CM_MAX_DEPTH);
+        if (width < 1 || width > CM_MAX_WIDTH)
+            elog(ERROR, "cmsketch width must be between 1 and %d",
+                 CM_MAX_WIDTH);
+        transblob = cmsketch_init_transval(
+            get_fn_expr_argtype(fcinfo->flinfo, 1), depth, width,
+            PG_GETARG_BOOL(4) ? RANGES : 1);
+        ((cmtransval *)VARDATA(transblob))->nargs = 0;
+    }
+
+    transblob = cmsketch_insert(transblob, PG_GETARG_INT64(1));
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
 /*!
  * check if the transblob is not initialized, and do so if not
  * \param transblob a cmsketch transval packed in a bytea
@@ -84,15 +139,17 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
 {
     bytea *     transblob = PG_GETARG_BYTEA_P(0);
     cmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
 
     /*
      * an uninitialized transval should be a datum smaller than sizeof(cmtransval).
      * if this one is small, initialize it now, else return it.
      */
     if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        Oid element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
         /* XXX would be nice to pfree the existing transblob, but pfree complains. */
-        transblob = cmsketch_init_transval(element_type);
+        transblob = cmsketch_init_transval(element_type, DEPTH, NUMCOUNTERS,
+                                           RANGES);
         transval = (cmtransval *)VARDATA(transblob);
 
         if (initargs) {
@@ -118,65 +175,201 @@ bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool initargs)
     return(transblob);
 }
 
-bytea *cmsketch_init_transval(Oid typOid)
+/*!
+ * allocate an empty sketch, with no counters yet
+ * \param typOid the type being sketched; must be int8
+ * \param depth the number of rows (hash functions) per level
+ * \param width the number of counters per row
+ * \param nlevels RANGES to support range queries, 1 for point counts only
+ */
+bytea *cmsketch_init_transval(Oid typOid, int depth, int width, int nlevels)
 {
     bool        typIsVarlena;
     cmtransval *transval;
+    cmsketch *  sketch;
 
     /* allocate and zero out a transval via palloc0 */
     bytea *     transblob = (bytea *)palloc0(CM_TRANSVAL_SZ);
     SET_VARSIZE(transblob, CM_TRANSVAL_SZ);
 
+    if (typOid != INT8OID)
+        elog(ERROR, "cmsketch can only compute ranges for int64");
+
     transval = (cmtransval *)VARDATA(transblob);
     transval->typOid = typOid;
     getTypeOutputInfo(transval->typOid,
                       &(transval->outFuncOid),
                       &typIsVarlena);
+    /* cache the type properties so that rows are hashed without lookups */
+    get_typlenbyval(transval->typOid, &(transval->typLen),
+                    &(transval->typByVal));
+
+    sketch = &transval->sketch;
+    sketch->magic = CM_SKETCH_MAGIC;
+    sketch->version = CM_SKETCH_VERSION;
+    sketch->hashkind = SKETCH_HASH_DEFAULT;
+    sketch->depth = depth;
+    sketch->width = width;
+    sketch->counterbytes = sizeof(uint32);
+    sketch->nlevels = nlevels;
+    sketch->materialized = 0;
+    sketch->total = 0;
     return(transblob);
 }
 
 /*!
- * perform multiple sketch insertions, one for each dyadic range (from 0 up to RANGES-1).
- * * \param transval the cmsketch transval
- * * \param inputi the value to be inserted
+ * the counter column of an int8 value in each row of a sketch, taken from
+ * successive 16-bit runs of its hash
+ * \param sketch the sketch
+ * \param val the value (already shifted to the level in question)
+ * \param cols an array of sketch->depth columns to fill in
  */
-void countmin_dyadic_trans_c(cmtransval *transval, Datum input)
+void cm_columns(cmsketch *sketch, int64 val, uint32 *cols)
 {
-    uint32 j;
-    
-    if (transval->typOid != INT8OID)
-        elog(ERROR, "cmsketch can only compute ranges for int64");
+    uint16 hash[SKETCH_HASHLEN/sizeof(uint16)];
+    uint32 i;
 
-    for (j = 0; j < RANGES; j++) {
-        countmin_trans_c(transval->sketches[j], input, 
-                         transval->outFuncOid, transval->typOid);
-        /* now divide by 2 for the next dyadic range */
-        input = Int64GetDatum(DatumGetInt64(input) >> 1);
+    sketch_hash_bytes(&val, sizeof(int64), sketch->hashkind, (uint8 *)hash);
+    for (i = 0; i < sketch->depth; i++)
+        cols[i] = hash[i] % sketch->width;
+}
+
+/*!
+ * add n to the counters of one level of the sketch in a transblob, widening
+ * the counters first if one of them would overflow
+ * \param transblob a cmsketch transval packed in a bytea
+ * \param level the (materialized) level
+ * \param cols the column in each row, as computed by cm_columns
+ * \param n the amount to add
+ * \returns the transblob, which may have been reallocated
+ */
+static bytea *cm_increment(bytea *transblob, uint32 level, uint32 *cols,
+                           uint64 n)
+{
+    cmsketch *sketch = CM_TRANSVAL_SKETCH(transblob);
+    uint32    i;
+
+    if (sketch->counterbytes == sizeof(uint32)) {
+        uint32 *counters = (uint32 *)CM_LEVEL(sketch, level);
+
+        for (i = 0; i < sketch->depth; i++)
+            if (counters[i*sketch->width + cols[i]] + n > CM_MAX_COUNTER32) {
+                transblob = cm_promote(transblob);
+                return cm_increment(transblob, level, cols, n);
+            }
+        for (i = 0; i < sketch->depth; i++)
+            counters[i*sketch->width + cols[i]] += n;
+    }
+    else {
+        uint64 *counters = (uint64 *)CM_LEVEL(sketch, level);
+
+        for (i = 0; i < sketch->depth; i++) {
+            if (counters[i*sketch->width + cols[i]] + n > (uint64)INT64_MAX)
+                elog(ERROR, "maximum count exceeded in sketch");
+            counters[i*sketch->width + cols[i]] += n;
+        }
     }
+    return transblob;
 }
 
 /*!
- * Main loop of Cormode and Muthukrishnan's sketching algorithm, for setting counters in
- * sketches at a single "dyadic range". For each call, we want to use DEPTH independent
- * hash functions.  We do this by using a single md5 hash function, and taking
- * successive 16-bit runs of the result as independent hash outputs.
- * \param sketch the current countmin sketch
- * \param dat the datum to be inserted
- * \param outFuncOid Oid of the PostgreSQL function to convert dat to a string
- * \param typOid Oid of the Postgres type for dat
+ * give counters to the levels of a sketch below upto.  Every row so far had
+ * the shared value at those levels, so its counters start out with the row
+ * count there.
+ * \param transblob a cmsketch transval packed in a bytea
+ * \param upto the number of levels that should have counters
+ * \returns a new transblob
  */
-Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
+static bytea *cm_materialize(bytea *transblob, uint32 upto)
 {
-    bytea *nhash;
+    cmsketch *sketch = CM_TRANSVAL_SKETCH(transblob);
+    uint32    from = sketch->materialized;
+    uint32    cols[CM_MAX_DEPTH];
+    int64     shared = sketch->shared;
+    size_t    sz = VARSIZE(transblob) + (upto - from)*CM_LEVEL_SZ(sketch);
+    bytea *   newblob;
+    uint32    j;
 
-    nhash = sketch_md5_bytea(dat, typOid);
+    if (upto <= from)
+        return transblob;
 
-    /*
-     * iterate through all sketches, incrementing the counters indicated by the hash
-     * we don't care about return value here, so 3rd (initialization) argument is arbitrary.
-     */
-    (void)hash_counters_iterate(nhash, sketch, 0, &increment_counter);
-    return(PointerGetDatum(nhash));
+    /* can't use repalloc, so copy into a zeroed blob with room for the levels */
+    newblob = (bytea *)palloc0(sz);
+    memcpy(newblob, transblob, VARSIZE(transblob));
+    SET_VARSIZE(newblob, sz);
+    sketch = CM_TRANSVAL_SKETCH(newblob);
+    sketch->materialized = upto;
+    sketch->shared = (upto < sketch->nlevels) ? shared >> (upto - from) : 0;
+
+    for (j = from; j < upto && sketch->total > 0; j++) {
+        cm_columns(sketch, shared >> (j - from), cols);
+        newblob = cm_increment(newblob, j, cols, sketch->total);
+        sketch = CM_TRANSVAL_SKETCH(newblob);
+    }
+    return newblob;
+}
+
+/*!
+ * switch a sketch from 32-bit to 64-bit counters
+ * \param transblob a cmsketch transval packed in a bytea
+ * \returns a new transblob
+ */
+static bytea *cm_promote(bytea *transblob)
+{
+    cmsketch *sketch = CM_TRANSVAL_SKETCH(transblob);
+    size_t    n = (size_t)sketch->materialized*sketch->depth*sketch->width;
+    size_t    hdrsz = VARSIZE(transblob) - n*sizeof(uint32);
+    bytea *   newblob = (bytea *)palloc(hdrsz + n*sizeof(uint64));
+    uint32 *  from = (uint32 *)sketch->counters;
+    uint64 *  to;
+    size_t    i;
+
+    memcpy(newblob, transblob, hdrsz);
+    SET_VARSIZE(newblob, hdrsz + n*sizeof(uint64));
+    sketch = CM_TRANSVAL_SKETCH(newblob);
+    sketch->counterbytes = sizeof(uint64);
+    to = (uint64 *)sketch->counters;
+    for (i = 0; i < n; i++)
+        to[i] = from[i];
+    return newblob;
+}
+
+/*!
+ * insert a value into every level of the sketch, from 0 up to nlevels-1.
+ * Levels where the value differs from the shared value get counters first.
+ * \param transblob a cmsketch transval packed in a bytea
+ * \param val the value to be inserted
+ * \returns the transblob, which may have been reallocated
+ */
+bytea *cmsketch_insert(bytea *transblob, int64 val)
+{
+    cmsketch *sketch = CM_TRANSVAL_SKETCH(transblob);
+    uint32    cols[CM_MAX_DEPTH];
+    uint32    j, m = sketch->materialized;
+
+    if (m < sketch->nlevels) {
+        if (sketch->total == 0)
+            sketch->shared = val >> m;
+        /*
+         * val agrees with the shared value from some level on;
+         * the levels below that one need counters
+         */
+        for (j = m;
+             j < sketch->nlevels && (val >> j) != (sketch->shared >> (j - m));
+             j++) ;
+        if (j > m) {
+            transblob = cm_materialize(transblob, j);
+            sketch = CM_TRANSVAL_SKETCH(transblob);
+        }
+    }
+
+    for (j = 0; j < sketch->materialized; j++) {
+        cm_columns(sketch, val >> j, cols);
+        transblob = cm_increment(transblob, j, cols, 1);
+        sketch = CM_TRANSVAL_SKETCH(transblob);
+    }
+    sketch->total++;
+    return transblob;
 }
 
 /*
@@ -184,18 +377,23 @@ Datum countmin_trans_c(countmin sketch, Datum dat, Oid outFuncOid, Oid typOid)
  */
 
 /*!
- * return the array of sketch counters as a bytea
+ * return the sketch as a bytea, in its serialized form
  */
 PG_FUNCTION_INFO_V1(__cmsketch_final);
 Datum __cmsketch_final(PG_FUNCTION_ARGS)
 {
-    bytea *     blob = PG_GETARG_BYTEA_P(0);
-    cmtransval *sketch = (cmtransval *)VARDATA(blob);
-    int         len = RANGES*sizeof(countmin) + VARHDRSZ;
-    bytea *out = palloc0(len);    
-    
-    memcpy((uint8 *)VARDATA(out), sketch->sketches, len - VARHDRSZ);
-    SET_VARSIZE(out, len);
+    bytea *   blob = PG_GETARG_BYTEA_P(0);
+    cmsketch *sketch;
+    bytea *   out;
+
+    /* nothing was aggregated: emit an empty sketch */
+    if (!CM_TRANSVAL_INITIALIZED(blob))
+        blob = cmsketch_init_transval(INT8OID, DEPTH, NUMCOUNTERS, RANGES);
+    sketch = CM_TRANSVAL_SKETCH(blob);
+
+    out = palloc(CM_SKETCH_SZ(sketch) + VARHDRSZ);
+    memcpy((uint8 *)VARDATA(out), sketch, CM_SKETCH_SZ(sketch));
+    SET_VARSIZE(out, CM_SKETCH_SZ(sketch) + VARHDRSZ);
     
     PG_RETURN_BYTEA_P(out);
 }
@@ -208,51 +406,207 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
 {
     bytea *     counterblob1 = PG_GETARG_BYTEA_P(0);
     bytea *     counterblob2 = PG_GETARG_BYTEA_P(1);
-    cmtransval *transval1 = (cmtransval *)VARDATA(counterblob1);
-    cmtransval *transval2 = (cmtransval *)VARDATA(counterblob2);
     cmtransval *newtrans;
-    countmin *  sketches2 = (countmin *)
-                            ((cmtransval *)(VARDATA(counterblob2)))->sketches;
-    bytea *     newblob;
-    countmin *  newsketches;
-    uint32      i, j, k;
-    int         sz;
+    cmtransval *transval2;
+    int         i;
 
     /* make sure they're initialized! */
-    if (!CM_TRANSVAL_INITIALIZED(counterblob1)
-        && !CM_TRANSVAL_INITIALIZED(counterblob2))
-        /* if both are empty can return one of them */
+    if (!CM_TRANSVAL_INITIALIZED(counterblob2))
         PG_RETURN_DATUM(PointerGetDatum(counterblob1));
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob1)) {
-        counterblob1 = cmsketch_init_transval(transval2->typOid);
-        transval1 = (cmtransval *)VARDATA(counterblob1);
-    }
-    else if (!CM_TRANSVAL_INITIALIZED(counterblob2)) {
-        counterblob2 = cmsketch_init_transval(transval1->typOid);
-        transval2 = (cmtransval *)VARDATA(counterblob2);
-    }
+    if (!CM_TRANSVAL_INITIALIZED(counterblob1))
+        PG_RETURN_DATUM(PointerGetDatum(counterblob2));
 
-    sz = VARSIZE(counterblob1);
-    /* allocate a new transval as a copy of counterblob1 */
-    newblob = (bytea *)palloc(sz);
-    memcpy(newblob, counterblob1, sz);
-    newtrans = (cmtransval *)(VARDATA(newblob));
-    newsketches = (countmin *)(newtrans)->sketches;
+    /* merge into counterblob1 in place, unless it might not be ours to modify */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          ))) {
+        bytea *copy = (bytea *)palloc(VARSIZE(counterblob1));
 
-    /* add in values from counterblob2 */
-    for (i = 0; i < RANGES; i++)
-        for (j = 0; j < DEPTH; j++)
-            for (k = 0; k < NUMCOUNTERS; k++)
-                newsketches[i][j][k] += sketches2[i][j][k];
+        memcpy(copy, counterblob1, VARSIZE(counterblob1));
+        counterblob1 = copy;
+    }
 
+    counterblob1 = cmsketch_merge_c(counterblob1,
+                                    CM_TRANSVAL_SKETCH(counterblob2));
+    newtrans = (cmtransval *)VARDATA(counterblob1);
+    transval2 = (cmtransval *)VARDATA(counterblob2);
     if (newtrans->nargs == -1) {
         /* transfer in the args from the other input */
         newtrans->nargs = transval2->nargs;
-        for (i = 0; (int)i < transval2->nargs; i++)
+        for (i = 0; i < transval2->nargs; i++)
             newtrans->args[i] = transval2->args[i];
     }
 
-    PG_RETURN_DATUM(PointerGetDatum(newblob));
+    PG_RETURN_DATUM(PointerGetDatum(counterblob1));
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_merge_trans);
+
+/*!
+ * transition function of cmsketch_merge: adds a stored sketch, in the base64
+ * text produced by the cmsketch aggregate, into the transval.  The first
+ * sketch sets the shape of the result.
+ */
+Datum __cmsketch_merge_trans(PG_FUNCTION_ARGS)
+{
+    bytea *   transblob = PG_GETARG_BYTEA_P(0);
+    cmsketch *sketch;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    sketch = cmsketch_decode(PG_GETARG_TEXT_P(1));
+    if (!CM_TRANSVAL_INITIALIZED(transblob)) {
+        transblob = cmsketch_init_transval(INT8OID, sketch->depth,
+                                           sketch->width, sketch->nlevels);
+        ((cmtransval *)VARDATA(transblob))->nargs = 0;
+        CM_TRANSVAL_SKETCH(transblob)->hashkind = sketch->hashkind;
+    }
+
+    transblob = cmsketch_merge_c(transblob, sketch);
+    pfree(sketch);
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
+
+/*!
+ * add the sketch s2 into the one in transblob1.  Levels that have
+ * counters in either sketch, or where their shared values differ, get
+ * counters in the result.
+ * \param transblob1 a cmsketch transval packed in a bytea; modified in place
+ * \param s2 another sketch of the same shape
+ * \returns transblob1, which may have been reallocated
+ */
+bytea *cmsketch_merge_c(bytea *transblob1, cmsketch *s2)
+{
+    cmsketch *s1 = CM_TRANSVAL_SKETCH(transblob1);
+    uint32    cols[CM_MAX_DEPTH];
+    uint32    m1 = s1->materialized, m2 = s2->materialized, m, j;
+    int64     total1 = s1->total;
+
+    if (s1->hashkind != s2->hashkind)
+        elog(ERROR,
+             "cannot merge CountMin sketches built with different hash functions");
+    if (s1->depth != s2->depth || s1->width != s2->width
+        || s1->nlevels != s2->nlevels)
+        elog(ERROR, "cannot merge CountMin sketches of different shapes");
+    if (s2->total == 0)
+        return transblob1;
+
+    /* find the first level where the shared values of both sketches agree */
+    m = Max(m1, m2);
+    if (total1 > 0)
+        while (m < s1->nlevels
+               && (s1->shared >> (m - m1)) != (s2->shared >> (m - m2)))
+            m++;
+    transblob1 = cm_materialize(transblob1, m);
+    s1 = CM_TRANSVAL_SKETCH(transblob1);
+    if (total1 == 0 && m < s1->nlevels)
+        s1->shared = s2->shared >> (m - m2);
+
+    /* the levels of s2 without counters held the shared value in every row */
+    for (j = m2; j < m; j++) {
+        cm_columns(s1, s2->shared >> (j - m2), cols);
+        transblob1 = cm_increment(transblob1, j, cols, s2->total);
+        s1 = CM_TRANSVAL_SKETCH(transblob1);
+    }
+
+    /* and the levels with counters are added up counter by counter */
+    transblob1 = cm_add_counters(transblob1, s2);
+    s1 = CM_TRANSVAL_SKETCH(transblob1);
+    s1->total += s2->total;
+    return transblob1;
+}
+
+/*!
+ * add n 32-bit counters of b into a, four at a time where SSE2 is available
+ * \returns true if a sum overflowed, in which case a is left unchanged
+ */
+static bool cm_add_counters32(uint32 *a, const uint32 *b, size_t n)
+{
+    size_t i = 0;
+    uint32 overflow = 0;
+#ifdef __SSE2__
+    /* SSE2 has no unsigned compare, so flip the sign bits and compare signed */
+    __m128i bias = _mm_set1_epi32((int)0x80000000);
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i sum = _mm_add_epi32(x, y);
+
+        acc = _mm_or_si128(acc,
+                           _mm_cmpgt_epi32(_mm_xor_si128(x, bias),
+                                           _mm_xor_si128(sum, bias)));
+        _mm_storeu_si128((__m128i *)(a + i), sum);
+    }
+    overflow = _mm_movemask_epi8(acc);
+#endif
+    for (; i < n; i++) {
+        uint32 sum = a[i] + b[i];
+
+        overflow |= (sum < a[i]);
+        a[i] = sum;
+    }
+    if (overflow) {
+        /* sums wrap around, so subtracting undoes them exactly */
+        for (i = 0; i < n; i++)
+            a[i] -= b[i];
+        return true;
+    }
+    return false;
+}
+
+/*!
+ * add the counters of the sketch src into the sketch in transblob, which
+ * has counters for at least as many levels
+ * \returns the transblob, which may have been reallocated
+ */
+static bytea *cm_add_counters(bytea *transblob, cmsketch *src)
+{
+    cmsketch *dst = CM_TRANSVAL_SKETCH(transblob);
+    size_t    n = (size_t)src->materialized*src->depth*src->width;
+    uint64 *  to;
+    size_t    i;
+
+    if (dst->counterbytes == sizeof(uint32)) {
+        if (src->counterbytes == sizeof(uint32)
+            && !cm_add_counters32((uint32 *)dst->counters,
+                                  (uint32 *)src->counters, n))
+            return transblob;
+        /* the sums need 64 bits */
+        transblob = cm_promote(transblob);
+        dst = CM_TRANSVAL_SKETCH(transblob);
+    }
+
+    to = (uint64 *)dst->counters;
+    if (src->counterbytes == sizeof(uint32)) {
+        uint32 *from = (uint32 *)src->counters;
+
+        for (i = 0; i < n; i++)
+            to[i] += from[i];
+    }
+    else {
+        uint64 *from = (uint64 *)src->counters;
+        uint64  overflow = 0;
+
+        for (i = 0; i < n; i++) {
+            to[i] += from[i];
+            overflow |= to[i];
+        }
+        if (overflow > (uint64)INT64_MAX)
+            elog(ERROR, "maximum count exceeded in sketch");
+    }
+    return transblob;
 }
 
 
@@ -262,129 +616,455 @@ Datum __cmsketch_merge(PG_FUNCTION_ARGS)
  */
 
 /*!
- * get the approximate count of objects with value arg
- * \param sketch a countmin sketch
- * \param arg the Datum we want to find the count of
- * \param funcOid the Postgres function that converts arg to a string
+ * \internal
+ * \brief a sketch decoded from the base64 text of a cmsketch aggregate
+ *
+ * Kept in fn_extra, so that a query that calls a scalar function many times
+ * on the same sketch only decodes it once.
+ * \endinternal
+ */
+typedef struct {
+    text *    b64;    /*! the text the sketch was decoded from */
+    cmsketch *sketch; /*! the decoded sketch */
+} cmsketch_cache;
+
+/*! size of the version 1 header: magic, version and hashkind */
+#define CM_V1_HEADER_SZ (sizeof(uint32) + 2*sizeof(uint16))
+
+/*! flipping the sign bit maps int64 order onto uint64 order */
+#define CM_SIGN_BIT ((uint64)1 << (INT64BITS - 1))
+
+/*!
+ * copy a serialized sketch into an aligned cmsketch.  Version 1 sketches and
+ * sketches from before versioning have all 64 levels of DEPTH x NUMCOUNTERS
+ * 64-bit counters, and are given a version 2 header here.
+ * \param blob the output of __cmsketch_final
  */
-int64 cmsketch_count_c(countmin sketch, Datum arg, Oid funcOid, Oid typOid)
+static cmsketch *cmsketch_from_bytea(bytea *blob)
 {
-    bytea *nhash;
+    size_t    len = VARSIZE(blob) - VARHDRSZ;
+    char *    data = VARDATA(blob);
+    size_t    legacy_sz = RANGES*sizeof(countmin);
+    cmsketch  hdr;
+    cmsketch *sketch;
+    uint32    magic = 0;
+    uint16    version = 0;
+
+    memset(&hdr, 0, sizeof(cmsketch));
+    hdr.magic = CM_SKETCH_MAGIC;
+    hdr.version = CM_SKETCH_VERSION;
+    hdr.depth = DEPTH;
+    hdr.width = NUMCOUNTERS;
+    hdr.counterbytes = sizeof(int64);
+    hdr.nlevels = hdr.materialized = RANGES;
+
+    if (len >= CM_V1_HEADER_SZ) {
+        memcpy(&magic, data, sizeof(uint32));
+        memcpy(&version, data + sizeof(uint32), sizeof(uint16));
+    }
+    if (len == legacy_sz && magic != CM_SKETCH_MAGIC) {
+        /* bare counters, hashed with md5 */
+        hdr.hashkind = SKETCH_HASH_MD5;
+    }
+    else if (magic == CM_SKETCH_MAGIC && version == 1
+             && len == CM_V1_HEADER_SZ + legacy_sz) {
+        memcpy(&hdr.hashkind, data + sizeof(uint32) + sizeof(uint16),
+               sizeof(uint16));
+        data += CM_V1_HEADER_SZ;
+    }
+    else if (magic == CM_SKETCH_MAGIC && version == CM_SKETCH_VERSION
+             && len >= sizeof(cmsketch)) {
+        sketch = (cmsketch *)palloc(len);
+        memcpy(sketch, data, len);
+        if (sketch->depth < 1 || sketch->depth > CM_MAX_DEPTH
+            || sketch->width < 1 || sketch->width > CM_MAX_WIDTH
+            || (sketch->counterbytes != sizeof(uint32)
+                && sketch->counterbytes != sizeof(uint64))
+            || sketch->nlevels < 1 || sketch->nlevels > RANGES
+            || sketch->materialized > sketch->nlevels
+            || CM_SKETCH_SZ(sketch) != len)
+            elog(ERROR, "corrupt cmsketch");
+        return sketch;
+    }
+    else
+        elog(ERROR, "unrecognized cmsketch format");
 
-    /* get the md5 hash of the argument. */
-    nhash = sketch_md5_bytea(arg, typOid);
-    return(cmsketch_count_md5_datum(sketch, nhash, funcOid));
+    if (hdr.hashkind > SKETCH_HASH_MURMUR3)
+        elog(ERROR, "unknown hash function %d in cmsketch", hdr.hashkind);
+    sketch = (cmsketch *)palloc(sizeof(cmsketch) + legacy_sz);
+    memcpy(sketch, &hdr, sizeof(cmsketch));
+    memcpy(sketch->counters, data, legacy_sz);
+    return sketch;
 }
 
-int64 cmsketch_count_md5_datum(countmin sketch, bytea *md5_bytea, Oid funcOid)
+/*!
+ * decode the base64 text of a sketch, as produced by the cmsketch aggregate
+ * \returns a palloc'd sketch
+ */
+cmsketch *cmsketch_decode(text *b64)
 {
-    /* iterate through the sketches, finding the min counter associated with this hash */
-    return(hash_counters_iterate(md5_bytea, sketch, INT64_MAX,
-                                          &min_counter));
+    bytea *   blob;
+    cmsketch *sketch;
+
+    blob = DatumGetByteaP(DirectFunctionCall2(binary_decode,
+                                              PointerGetDatum(b64),
+                                              CStringGetTextDatum("base64")));
+    sketch = cmsketch_from_bytea(blob);
+    pfree(blob);
+    return sketch;
 }
 
+/*!
+ * get the sketch passed as base64 text in argument argno of a scalar UDF
+ * \param argno the argument holding the output of the cmsketch aggregate
+ */
+cmsketch *cmsketch_getarg(PG_FUNCTION_ARGS, int argno)
+{
+    text *          b64 = PG_GETARG_TEXT_P(argno);
+    cmsketch_cache *cache = (cmsketch_cache *)fcinfo->flinfo->fn_extra;
+    MemoryContext   oldcontext;
 
-/****** SUPPORT ROUTINES *******/
-PG_FUNCTION_INFO_V1(cmsketch_dump);
+    if (cache != NULL && VARSIZE(cache->b64) == VARSIZE(b64)
+        && memcmp(cache->b64, b64, VARSIZE(b64)) == 0)
+        return cache->sketch;
+
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    if (cache == NULL) {
+        cache = (cmsketch_cache *)palloc(sizeof(cmsketch_cache));
+        fcinfo->flinfo->fn_extra = cache;
+    }
+    else {
+        pfree(cache->b64);
+        pfree(cache->sketch);
+    }
+    cache->b64 = (text *)palloc(VARSIZE(b64));
+    memcpy(cache->b64, b64, VARSIZE(b64));
+    cache->sketch = cmsketch_decode(b64);
+    MemoryContextSwitchTo(oldcontext);
+    return cache->sketch;
+}
 
 /*!
- * dump sketch contents
+ * get the approximate count of values x with x >> level == val
+ * \param sketch a completed sketch
+ * \param level the dyadic level to look at; 0 for plain counts
+ * \param val the value at that level
  */
-Datum cmsketch_dump(PG_FUNCTION_ARGS)
+int64 cmsketch_level_count(cmsketch *sketch, uint32 level, int64 val)
 {
-    bytea *   transblob = (bytea *)PG_GETARG_BYTEA_P(0);
-    countmin *sketches;
-    char *    newblob = (char *)palloc(10240);
-    uint32    i, j, k, c;
+    uint32 cols[CM_MAX_DEPTH];
+    int64  cnt, min = INT64_MAX;
+    uint32 i;
 
-    sketches = ((cmtransval *)VARDATA(transblob))->sketches;
-    for (i=0, c=0; i < RANGES; i++)
-        for (j=0; j < DEPTH; j++)
-            for(k=0; k < NUMCOUNTERS; k++) {
-                if (sketches[i][j][k] != 0)
-                    c += sprintf(&newblob[c], "[(%d,%d,%d):" INT64_FORMAT
-                                 "], ", i, j, k, sketches[i][j][k]);
-                if (c > 10000) break;
-            }
-    newblob[c] = '\0';
-    PG_RETURN_NULL();
+    if (level >= sketch->nlevels)
+        elog(ERROR, "range queries need a cmsketch built with ranges");
+    if (level >= sketch->materialized)
+        /* every row had the same value at this level */
+        return (val == sketch->shared >> (level - sketch->materialized))
+               ? sketch->total : 0;
+
+    cm_columns(sketch, val, cols);
+    for (i = 0; i < sketch->depth; i++) {
+        size_t off = (size_t)i*sketch->width + cols[i];
+
+        cnt = (sketch->counterbytes == sizeof(uint32))
+              ? ((uint32 *)CM_LEVEL(sketch, level))[off]
+              : ((int64 *)CM_LEVEL(sketch, level))[off];
+        if (cnt < min)
+            min = cnt;
+    }
+    return min;
+}
+
+/*!
+ * convert an arbitrary range [bot-top] into a rangelist of dyadic ranges.
+ * E.g. convert 14-48 into [[14-15], [16-31], [32-47], [48-48]]
+ * We walk up from bot, each time taking the largest dyadic range that starts
+ * there and ends by top.  The arithmetic is done on values with their sign
+ * bit flipped, which keeps the order and the dyadic ranges of int64 but
+ * can't overflow.
+ * \param bot the bottom of the range (inclusive)
+ * \param top the top of the range (inclusive)
+ * \param r the list of ranges to be returned
+ */
+void find_ranges(int64 bot, int64 top, rangelist *r)
+{
+    uint64 lo = (uint64)bot ^ CM_SIGN_BIT;
+    uint64 hi = (uint64)top ^ CM_SIGN_BIT;
+    uint32 j;
+
+    r->emptyoffset = 0;
+    while (lo <= hi) {
+        for (j = 0;
+             j < INT64BITS - 1 && (lo & (((uint64)2 << j) - 1)) == 0
+             && hi - lo >= ((uint64)2 << j) - 1;
+             j++) ;
+        r->spans[r->emptyoffset][0] = (int64)(lo ^ CM_SIGN_BIT);
+        r->spans[r->emptyoffset][1] =
+            (int64)((lo + (((uint64)1 << j) - 1)) ^ CM_SIGN_BIT);
+        ADVANCE_OFFSET(*r);
+        if (hi - lo == ((uint64)1 << j) - 1)
+            break;
+        lo += (uint64)1 << j;
+    }
 }
 
+/*!
+ * the dyadic level of a range from find_ranges, i.e. log2 of its width
+ */
+static uint32 range_level(int64 bot, int64 top)
+{
+    uint64 bits = (uint64)bot ^ (uint64)top;
+    uint32 level = 0;
+
+    for (; bits != 0; bits >>= 1)
+        level++;
+    return level;
+}
 
 /*!
- * for each row of the sketch, use the 16 bits starting at 2^i mod NUMCOUNTERS,
- * and invoke the lambda on those 16 bits (which may destructively modify counters).
- * \param hashval the MD5 hashed value that we take 16 bits at a time
- * \param sketch the cmsketch
- * \param initial the initialized return value
- * \param lambdaptr the function to invoke on each 16 bits
+ * get the approximate count of values in [bot, top] by summing the counts of
+ * its dyadic ranges
+ * \param sketch a completed sketch with ranges
+ * \param bot the bottom of the range (inclusive)
+ * \param top the top of the range (inclusive)
  */
-int64 hash_counters_iterate(bytea *hashval,
-                            countmin sketch, /* width is DEPTH*NUMCOUNTERS */
-                            int64 initial,
-                            int64 (*lambdaptr)(uint32,
-                                               uint32,
-                                               countmin,
-                                               int64))
+int64 cmsketch_rangecount_c(cmsketch *sketch, int64 bot, int64 top)
 {
-    uint32         i, col;
-    char          *c;
-    unsigned short twobytes;
-    int64          retval = initial;
+    rangelist r;
+    int64     cnt = 0;
+    uint32    i, level;
 
-    /*
-     * XXX WARNING: are there problems with unaligned access here?
-     * XXX I was using memmove rather than casting, which was inefficient,
-     * XXX but I was hoping memmove would deal with unaligned access in a portable way.
-     * XXX However the deref of 2 bytes seems to work OK.
-     */
-    for (i = 0, c = (char *)VARDATA(hashval); 
-         i < DEPTH; 
-         i++, c += 2) {
-        twobytes = *(unsigned short *)c;
-        col = twobytes % NUMCOUNTERS;
-        retval = (*lambdaptr)(i, col, sketch, retval);
+    find_ranges(bot, top, &r);
+    for (i = 0; i < r.emptyoffset; i++) {
+        level = range_level(r.spans[i][0], r.spans[i][1]);
+        cnt += cmsketch_level_count(sketch, level, r.spans[i][0] >> level);
     }
-    return retval;
+    return cnt;
 }
 
 /*!
- * destructive increment lambda for hash_counters_iterate.
- * transval and return val not of particular interest here.
- * \param i which row to update
- * \param col which column to update
- * \param sketch the sketch
- * \param transval we don't need transval here, but its part of the
- * lambda interface for hash_counters_iterate
+ * find the approximate value below which a fraction of the rows lie.
+ * Rather than binary searching with a range count per probe, we walk down
+ * the dyadic levels once: at each level we step over the left half of the
+ * current range if it holds too few rows.
+ * \param sketch a completed sketch with ranges
+ * \param frac the fraction of rows, e.g. 0.5 for the median
+ * \param total the number of rows in the sketched column
+ * \returns the smallest value v with an approximate count of at least
+ * frac*total rows in [min, v]
+ */
+int64 cmsketch_centile_c(cmsketch *sketch, double frac, int64 total)
+{
+    double target = total*frac;
+    double below = 0;
+    uint64 lo = 0;
+    int64  cnt;
+    int    j;
+
+    for (j = INT64BITS - 1; j >= 0; j--) {
+        cnt = cmsketch_level_count(sketch, j, (int64)(lo ^ CM_SIGN_BIT) >> j);
+        if (below + cnt < target) {
+            below += cnt;
+            lo += (uint64)1 << j;
+        }
+    }
+    return (int64)(lo ^ CM_SIGN_BIT);
+}
+
+/*!
+ * append a histogram bucket [lo, hi, count] to a StringInfo, in the format
+ * of a Python list of lists
  */
+static void append_bucket(StringInfo buf, int64 lo, int64 hi, int64 cnt)
+{
+    appendStringInfo(buf, "%s[" INT64_FORMAT ", " INT64_FORMAT ", "
+                     INT64_FORMAT "]", (buf->len > 1) ? ", " : "", lo, hi, cnt);
+}
 
-int64 increment_counter(uint32 i,
-                        uint32 col,
-                        countmin sketch,
-                        int64 transval)
+PG_FUNCTION_INFO_V1(cmsketch_count);
+/*!
+ * UDF to get the approximate count of a value from a sketch
+ */
+Datum cmsketch_count(PG_FUNCTION_ARGS)
 {
-    int64 oldval = sketch[i][col];
-    if (sketch[i][col] == (INT64_MAX))
-        elog(ERROR, "maximum count exceeded in sketch");
-    sketch[i][col] = oldval + 1;
+    cmsketch *sketch = cmsketch_getarg(fcinfo, 0);
 
-    /* return the incremented value, though unlikely anyone cares. */
-    return oldval+1;
+    PG_RETURN_INT64(cmsketch_level_count(sketch, 0, PG_GETARG_INT64(1)));
 }
 
+PG_FUNCTION_INFO_V1(cmsketch_count_array);
 /*!
- * running minimum lambda for hash_counters_iterate
- * \param i which row to examine
- * \param col which column to examine
- * \param sketch the sketch
- * \param transval smallest counter so far
- * lambda interface for hash_counters_iterate
+ * UDF to get the approximate counts of an array of values from a sketch,
+ * decoding the sketch only once.  NULL values get NULL counts.
+ */
+Datum cmsketch_count_array(PG_FUNCTION_ARGS)
+{
+    cmsketch * sketch = cmsketch_getarg(fcinfo, 0);
+    ArrayType *vals = PG_GETARG_ARRAYTYPE_P(1);
+    Datum *    elems;
+    bool *     nulls;
+    int        n, i;
+
+    if (ARR_ELEMTYPE(vals) != INT8OID)
+        elog(ERROR, "cmsketch_count expects an array of int8");
+    deconstruct_array(vals, INT8OID, sizeof(int64), true, 'd',
+                      &elems, &nulls, &n);
+    for (i = 0; i < n; i++)
+        if (!nulls[i])
+            elems[i] = Int64GetDatum(
+                cmsketch_level_count(sketch, 0, DatumGetInt64(elems[i])));
+
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, ARR_NDIM(vals),
+                                             ARR_DIMS(vals), ARR_LBOUND(vals),
+                                             INT8OID, sizeof(int64), true,
+                                             'd'));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_rangecount);
+/*!
+ * UDF to get the approximate count of values in [bot, top] from a sketch
+ */
+Datum cmsketch_rangecount(PG_FUNCTION_ARGS)
+{
+    cmsketch *sketch = cmsketch_getarg(fcinfo, 0);
+
+    PG_RETURN_INT64(cmsketch_rangecount_c(sketch, PG_GETARG_INT64(1),
+                                          PG_GETARG_INT64(2)));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_centile);
+/*!
+ * UDF to get an approximate centile from a sketch, given the row count
+ */
+Datum cmsketch_centile(PG_FUNCTION_ARGS)
+{
+    cmsketch *sketch = cmsketch_getarg(fcinfo, 0);
+    int64     centile = PG_GETARG_INT64(1);
+
+    if (centile <= 0 || centile >= 100)
+        elog(ERROR, "centiles must be between 1-99 inclusive, got "
+             INT64_FORMAT, centile);
+    PG_RETURN_INT64(cmsketch_centile_c(sketch, centile/100.0,
+                                       PG_GETARG_INT64(2)));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_median);
+/*!
+ * UDF to get an approximate median from a sketch, given the row count
+ */
+Datum cmsketch_median(PG_FUNCTION_ARGS)
+{
+    cmsketch *sketch = cmsketch_getarg(fcinfo, 0);
+
+    PG_RETURN_INT64(cmsketch_centile_c(sketch, 0.5, PG_GETARG_INT64(1)));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_width_histogram);
+/*!
+ * UDF for an equi-width histogram of [min, max] from a sketch
+ */
+Datum cmsketch_width_histogram(PG_FUNCTION_ARGS)
+{
+    cmsketch *     sketch = cmsketch_getarg(fcinfo, 0);
+    int64          min = PG_GETARG_INT64(1);
+    int64          max = PG_GETARG_INT64(2);
+    int32          buckets = PG_GETARG_INT32(3);
+    int64          step, binlo, binhi;
+    StringInfoData buf;
+    int32          i;
+
+    if (buckets < 1)
+        elog(ERROR, "a histogram needs at least one bucket");
+    step = (int64)(((double)max - (double)min + 1)/buckets);
+    if (step < 1)
+        step = 1;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '[');
+    for (i = 0; i < buckets; i++) {
+        binlo = min + i*step;
+        if (binlo > max)
+            break;
+        binhi = (i == buckets - 1) ? max : binlo + step - 1;
+        append_bucket(&buf, binlo, binhi,
+                      cmsketch_rangecount_c(sketch, binlo, binhi));
+    }
+    appendStringInfoChar(&buf, ']');
+    PG_RETURN_TEXT_P(cstring_to_text(buf.data));
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_depth_histogram);
+/*!
+ * UDF for an equi-depth histogram from a sketch: the buckets end at evenly
+ * spaced centiles, skipping any that coincide
+ */
+Datum cmsketch_depth_histogram(PG_FUNCTION_ARGS)
+{
+    cmsketch *     sketch = cmsketch_getarg(fcinfo, 0);
+    int32          buckets = PG_GETARG_INT32(1);
+    int64          total, binlo = INT64_MIN, binhi;
+    int32          step, i;
+    StringInfoData buf;
+    bool           first = true;
+
+    if (buckets < 1)
+        elog(ERROR, "a histogram needs at least one bucket");
+    step = 100/buckets;
+    if (step < 1)
+        step = 1;
+    total = cmsketch_rangecount_c(sketch, INT64_MIN, INT64_MAX);
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '[');
+    for (i = 0; i < buckets; i++) {
+        if (i < buckets - 1) {
+            binhi = cmsketch_centile_c(sketch, (i + 1)*step/100.0, total);
+            /* next centile is no higher than the previous one; skip */
+            if (!first && binhi < binlo)
+                continue;
+        }
+        else
+            binhi = INT64_MAX;
+        append_bucket(&buf, binlo, binhi,
+                      cmsketch_rangecount_c(sketch, binlo, binhi));
+        first = false;
+        if (binhi == INT64_MAX)
+            break;
+        binlo = binhi + 1;
+    }
+    appendStringInfoChar(&buf, ']');
+    PG_RETURN_TEXT_P(cstring_to_text(buf.data));
+}
+
+
+/****** SUPPORT ROUTINES *******/
+PG_FUNCTION_INFO_V1(cmsketch_dump);
+
+/*!
+ * dump sketch contents
  */
-int64 min_counter(uint32 i,
-                  uint32 col,
-                  countmin sketch,
-                  int64 transval)
+Datum cmsketch_dump(PG_FUNCTION_ARGS)
 {
-    int64 thisval = sketch[i][col];
-    return (thisval < transval) ? thisval : transval;
+    bytea *   transblob = (bytea *)PG_GETARG_BYTEA_P(0);
+    cmsketch *sketch = CM_TRANSVAL_SKETCH(transblob);
+    char *    newblob = (char *)palloc(10240);
+    uint32    i, j, k, c;
+    int64     cnt;
+
+    for (i=0, c=0; i < sketch->materialized && c <= 10000; i++)
+        for (j=0; j < sketch->depth; j++)
+            for(k=0; k < sketch->width; k++) {
+                size_t off = (size_t)j*sketch->width + k;
+
+                cnt = (sketch->counterbytes == sizeof(uint32))
+                      ? ((uint32 *)CM_LEVEL(sketch, i))[off]
+                      : ((int64 *)CM_LEVEL(sketch, i))[off];
+                if (cnt != 0)
+                    c += sprintf(&newblob[c], "[(%d,%d,%d):" INT64_FORMAT
+                                 "], ", i, j, k, cnt);
+                if (c > 10000) break;
+            }
+    newblob[c] = '\0';
+    PG_RETURN_NULL();
 }
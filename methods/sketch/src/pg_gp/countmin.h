@@ -12,6 +12,10 @@
 /* #define NUMCOUNTERS 65535 */
 #define NUMCOUNTERS 1024  /* another magic tuning value: modulus of hash functions */
 
+/* each row of a sketch takes its column from 16 bits of a 128-bit hash */
+#define CM_MAX_DEPTH 8
+#define CM_MAX_WIDTH 65536
+
 #ifdef INT64_IS_BUSTED
 #define MAX_INT64 (INT64CONST(0x7FFFFFFF))
 #define MAX_UINT64 (UINT64CONST(0xFFFFFFFF))
@@ -20,6 +24,8 @@
 #define MAX_UINT64 (UINT64CONST(0xFFFFFFFFFFFFFFFF))
 #endif /* INT64_IS_BUSTED */
 
+#define CM_MAX_COUNTER32 ((uint64)0xFFFFFFFF)
+
 #define MID_INT64 (0)
 #define MIN_INT64 (~MAX_INT64)
 #define MID_UINT64 (MAX_UINT64 >> 1)
@@ -37,11 +43,54 @@ typedef uint64 countmin[DEPTH][NUMCOUNTERS];
 
 #define MAXARGS 3
 
+/*!
+ * \internal
+ * \brief a CountMin sketch over the dyadic ranges of int8 values
+ *
+ * Level j of the sketch counts the values x >> j, in depth rows of width
+ * counters each.  A level only gets counters once two rows differ there:
+ * rows that agree at level j also agree at every level above it.  So levels
+ * 0 to materialized-1 have counter blocks, and at each level
+ * j >= materialized every row had the value shared >> (j - materialized).
+ * Counters are 32 bits wide until one of them would overflow, at which
+ * point the whole sketch switches to 64-bit counters.
+ *
+ * The struct is also the serialized form produced by __cmsketch_final.
+ * Version 1 of that form was a header of magic, version and hashkind
+ * followed by RANGES levels of DEPTH x NUMCOUNTERS 64-bit counters.
+ * Sketches from before versioning were those counters alone, hashed
+ * with md5.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;        /*! CM_SKETCH_MAGIC */
+    uint16 version;      /*! CM_SKETCH_VERSION */
+    uint16 hashkind;     /*! SKETCH_HASH_* function used for the counters */
+    uint16 depth;        /*! rows (hash functions) per level */
+    uint16 counterbytes; /*! size of a counter: 4, or 8 after an overflow */
+    uint32 width;        /*! counters per row */
+    uint32 nlevels;      /*! RANGES, or 1 for a sketch of point counts only */
+    uint32 materialized; /*! number of levels that have counters */
+    int64  shared;       /*! value of every row at level materialized */
+    int64  total;        /*! number of rows counted */
+    char   counters[0];  /*! materialized levels of depth*width counters */
+} cmsketch;
+
+#define CM_SKETCH_MAGIC   0x4b534d43 /* "CMSK" */
+#define CM_SKETCH_VERSION 2
+
+/*! bytes of counters in one level of a sketch */
+#define CM_LEVEL_SZ(s) ((size_t)(s)->depth*(s)->width*(s)->counterbytes)
+/*! the counters of level j of a sketch */
+#define CM_LEVEL(s, j) ((s)->counters + (size_t)(j)*CM_LEVEL_SZ(s))
+/*! total size of a sketch */
+#define CM_SKETCH_SZ(s) (sizeof(cmsketch) + (s)->materialized*CM_LEVEL_SZ(s))
+
 /*!
  * \internal
  * \brief the transition value struct for CM sketches
  *
- * Holds the sketch counters
+ * Holds the sketch
  * and a cache of handy metadata that we'll reuse across calls
  * \endinternal
  */
@@ -50,14 +99,19 @@ typedef struct {
     int nargs;            /*! number of args being carried for finalizer */
     Oid typOid;     /*! oid of the data type we are sketching */
     Oid outFuncOid; /*! oid of the OutFunc for that data type */
-    countmin sketches[RANGES];
+    int16 typLen;   /*! length of the data type */
+    bool typByVal;  /*! whether the type is passed by value */
+    cmsketch sketch; /*! the sketch; variable-length, so it must come last */
 } cmtransval;
 
-/*! base size of a cmtransval */
+/*! size of a cmtransval with no counters */
 #define CM_TRANSVAL_SZ (VARHDRSZ + sizeof(cmtransval))
 
 #define CM_TRANSVAL_INITIALIZED(t) (VARSIZE(t) >= CM_TRANSVAL_SZ)
 
+/*! the sketch inside a cmtransval packed in a bytea */
+#define CM_TRANSVAL_SKETCH(t) (&((cmtransval *)VARDATA(t))->sketch)
+
 
 /*!
  * \internal
@@ -87,12 +141,19 @@ typedef struct {
 
 /*!
  * \internal
- * \brief offset/count pairs for MFV sketches
+ * \brief a counter slot of an MFV sketch
+ *
+ * Counts are Space-Saving counts: upper bounds on the frequency of the
+ * value, which overestimate it by at most err.
  * \endinternal
  */
 typedef struct {
     unsigned offset;  /*! memory offset to the value */
-    uint64 cnt;   /*! counter */
+    unsigned len;     /*! length of the value in bytes */
+    uint64 cnt;       /*! counter */
+    uint64 err;       /*! maximum overestimate in cnt */
+    uint32 hash;      /*! 32 bits of the hash of the value, for the index */
+    uint32 heappos;   /*! position of this slot in the min-heap */
 } offsetcnt;
 
 
@@ -100,90 +161,221 @@ typedef struct {
  * \internal
  * \brief the transition value struct for MFV sketches.
  *
- * Holds a single
- * countmin sketch (no dyadic ranges) and an array of Most Frequent Values.
+ * A Space-Saving summary (Metwally et al.) of nslots counters, of which
+ * the max_mfvs largest are reported.
  * We are flexible with the number of mfvs, as well as the type.
- * Hence at the end of this struct is an array mfv[max_mfvs] of offsetcnt entries,
- * followed by an array of Postgres text objects with the output formats of
- * the mfvs.
+ * Hence at the end of this struct is an array mfvs[nslots] of offsetcnt
+ * entries, followed by a min-heap of slot numbers ordered by count, a hash
+ * index from values to slots (open addressing, -1 for an empty entry),
+ * and then the values themselves.
  * Each mfv entry contains an offset from the top of the structure where
- * we can find a Postgres text object holding the output format of a
- * frequent value.
+ * we can find its value, stored as the bytes of the Datum.
+ * The output of the mfvsketch aggregate is a transval too, with no spare
+ * room or garbage among its values.
  * \endinternal
  */
 typedef struct {
-    unsigned max_mfvs;    /*! number of frequent values */
+    uint32 magic;         /*! MFV_MAGIC */
+    uint32 version;       /*! MFV_VERSION */
+    unsigned max_mfvs;    /*! number of frequent values to report */
+    unsigned nslots;      /*! number of values counted */
     unsigned next_mfv;    /*! index of next mfv to insert into */
     unsigned next_offset; /*! next memory offset to insert into */
+    unsigned garbage;     /*! bytes of values no longer in use */
+    unsigned indexsize;   /*! entries in the hash index, a power of 2 */
     Oid typOid;           /*! Oid of the type being counted */
     int typLen;           /*! Length of the data type */
     bool typByVal;        /*! Whether type is by value or by reference */
     Oid outFuncOid;       /*! Oid of the outfunc for this type */
-    countmin sketch;      /*! a single countmin sketch */
+    int hashkind;         /*! SKETCH_HASH_* function used for the index */
     /*!
      * type-independent collection of Most Frequent Values
-     * Holds an array of (counter,offset) pairs, which by
-     * convention is followed by the values themselves as text Datums,
-     * accessible via the offsets
+     * Holds an array of counter slots, which by
+     * convention is followed by the heap, the index and the values
      */
     offsetcnt mfvs[0];
 } mfvtransval;
 
-/*! base size of an MFV transval */
-#define MFV_TRANSVAL_SZ(i) (VARHDRSZ + sizeof(mfvtransval) + i*sizeof(offsetcnt))
+#define MFV_MAGIC   0x5356464d /* "MFVS" */
+#define MFV_VERSION 1
 
-/*! free space remaining for text values */
+/* counters kept per reported value, and bounds on their number */
+#define MFV_SLOTS_PER_MFV 4
+#define MFV_MIN_SLOTS 64
+#define MFV_MAX_MFVS 100000
+
+/*! base size of an MFV transval, maxaligned so that values can be too */
+#define MFV_TRANSVAL_SZ(nslots, indexsize) \
+    MAXALIGN(VARHDRSZ + sizeof(mfvtransval) \
+             + (nslots)*(sizeof(offsetcnt) + sizeof(uint32)) \
+             + (indexsize)*sizeof(int32))
+
+#define MFV_TRANSVAL_INITIALIZED(t) (VARSIZE(t) > VARHDRSZ)
+
+/*! the min-heap of an mfvtransval */
+#define MFV_HEAP(tv) ((uint32 *)&(tv)->mfvs[(tv)->nslots])
+/*! the hash index of an mfvtransval */
+#define MFV_INDEX(tv) ((int32 *)(MFV_HEAP(tv) + (tv)->nslots))
+/*! memory offset of the first value of an mfvtransval */
+#define MFV_VALUES_START(tv) \
+    (MFV_TRANSVAL_SZ((tv)->nslots, (tv)->indexsize) - VARHDRSZ)
+
+/*!
+ * the length of the bytes stored for a value; cstrings keep their
+ * terminating null so that the output function can read them back
+ */
+#define MFV_DATUM_LEN(d, tv) \
+    (ExtractDatumLen((d), (tv)->typLen, (tv)->typByVal) + ((tv)->typLen == -2))
+
+/*! free space remaining for values */
 #define MFV_TRANSVAL_CAPACITY(transblob) (VARSIZE(transblob) - VARHDRSZ - \
                                           ((mfvtransval *)VARDATA(transblob))-> \
                                           next_offset)
                                           
+/*!
+ * \internal
+ * \brief one time bucket of a sliding-window CountMin sketch
+ * \endinternal
+ */
+typedef struct {
+    int64    epoch;  /*! number of the time bucket counted, or WINDOW_EMPTY */
+    cmsketch sketch; /*! its counts, in a single level of counters */
+} cmwbucket;
+
+/*!
+ * \internal
+ * \brief a sliding-window CountMin sketch of point counts
+ *
+ * A ring of nbuckets time buckets, each holding a CountMin sketch of the
+ * rows of one bucket width of time; bucket number e is kept in slot
+ * e mod nbuckets.  All the buckets have the same shape, and counters of
+ * counterbytes each.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;        /*! CM_WINDOW_MAGIC */
+    uint16 version;      /*! CM_WINDOW_VERSION */
+    uint16 nbuckets;     /*! number of time buckets in the window */
+    int64  width;        /*! width of a time bucket, in microseconds */
+    int64  latest;       /*! newest time bucket counted, or WINDOW_EMPTY */
+    uint32 bucketsz;     /*! bytes in each bucket, maxaligned */
+    uint16 depth;        /*! rows of each bucket sketch */
+    uint16 counterbytes; /*! size of a counter: 4, or 8 after an overflow */
+    uint32 sketchwidth;  /*! counters per row of each bucket sketch */
+    uint16 hashkind;     /*! SKETCH_HASH_* function used for the counters */
+    uint16 unused;
+    char   buckets[0];   /*! the nbuckets buckets */
+} cmwindow;
+
+#define CM_WINDOW_MAGIC   0x57534d43 /* "CMSW" */
+#define CM_WINDOW_VERSION 1
+
+/*! epoch of a time bucket that has counted nothing */
+#define WINDOW_EMPTY MIN_INT64
+/*! bound on the number of time buckets in a window */
+#define WINDOW_MAX_BUCKETS 10000
+
+/*! bytes in a bucket of a sliding-window CountMin sketch */
+#define CM_WINDOW_BUCKET_SZ(depth, width, counterbytes) \
+    MAXALIGN(offsetof(cmwbucket, sketch) + sizeof(cmsketch) \
+             + (size_t)(depth)*(width)*(counterbytes))
+/*! slot i of a sliding-window CountMin sketch */
+#define CM_WINDOW_BUCKET(w, i) \
+    ((cmwbucket *)((w)->buckets + (size_t)(i)*(w)->bucketsz))
+
+/*!
+ * \internal
+ * \brief a time bucket slot of a sliding-window MFV sketch
+ * \endinternal
+ */
+typedef struct {
+    int64  epoch;  /*! number of the time bucket counted, or WINDOW_EMPTY */
+    uint32 offset; /*! offset of its MFV sketch from the start of the
+                       window's bytea, or 0 if it has none */
+    uint32 room;   /*! bytes set aside for the sketch, maxaligned */
+} mfvwslot;
+
+/*!
+ * \internal
+ * \brief a sliding-window MFV sketch
+ *
+ * A ring of nbuckets time buckets like the sliding-window CountMin sketch,
+ * each with an MFV sketch of its own rows.  The slots are followed by the
+ * MFV sketches, each a whole bytea, maxaligned, in the room set aside for
+ * its slot.  While the window is being built there may be free space
+ * between and after them.
+ * \endinternal
+ */
+typedef struct {
+    uint32   magic;     /*! MFV_WINDOW_MAGIC */
+    uint16   version;   /*! MFV_WINDOW_VERSION */
+    uint16   nbuckets;  /*! number of time buckets in the window */
+    int64    width;     /*! width of a time bucket, in microseconds */
+    int64    latest;    /*! newest time bucket counted, or WINDOW_EMPTY */
+    unsigned max_mfvs;  /*! number of frequent values of each bucket sketch */
+    Oid      typOid;    /*! Oid of the type being counted */
+    mfvwslot slots[0];  /*! the nbuckets slots */
+} mfvwindow;
+
+#define MFV_WINDOW_MAGIC   0x5756464d /* "MFVW" */
+#define MFV_WINDOW_VERSION 1
+
+/*! offset of the first MFV sketch in a sliding-window MFV sketch */
+#define MFV_WINDOW_SZ(nbuckets) \
+    MAXALIGN(VARHDRSZ + sizeof(mfvwindow) + (nbuckets)*sizeof(mfvwslot))
+/*! the MFV sketch in slot i of a sliding-window MFV sketch in a bytea */
+#define MFV_WINDOW_BUCKET(blob, i) \
+    ((bytea *)((char *)(blob) \
+               + ((mfvwindow *)VARDATA(blob))->slots[i].offset))
+
 /* countmin aggregate protos */
-Datum  countmin_trans_c(countmin, Datum, Oid, Oid);
 bytea *cmsketch_check_transval(PG_FUNCTION_ARGS, bool);
-bytea *cmsketch_init_transval(Oid);
-void   countmin_dyadic_trans_c(cmtransval *, Datum);
+bytea *cmsketch_init_transval(Oid, int, int, int);
+bytea *cmsketch_insert(bytea *, int64);
+bytea *cmsketch_merge_c(bytea *, cmsketch *);
 
 /* countmin scalar function protos */
-int64  cmsketch_count_c(countmin, Datum, Oid, Oid);
-int64  cmsketch_count_md5_datum(countmin, bytea *, Oid);
-
-/* hash_counters_iterate and its lambdas */
-int64  hash_counters_iterate(bytea *, countmin, int64, int64 (*lambdaptr)(
-                                 uint32,
-                                 uint32,
-                                 countmin,
-                                 int64));
-
-int64  increment_counter(uint32, uint32, countmin, int64);
-int64  min_counter(uint32, uint32, countmin, int64);
+cmsketch *cmsketch_decode(text *);
+cmsketch *cmsketch_getarg(PG_FUNCTION_ARGS, int);
+void   cm_columns(cmsketch *, int64, uint32 *);
+int64  cmsketch_level_count(cmsketch *, uint32, int64);
+void   find_ranges(int64, int64, rangelist *);
+int64  cmsketch_rangecount_c(cmsketch *, int64, int64);
+int64  cmsketch_centile_c(cmsketch *, double, int64);
 
 /* MFV protos */
-bytea *mfv_transval_append(bytea *, Datum);
-int    mfv_find(bytea *, Datum);
-bytea *mfv_transval_replace(bytea *, Datum, int);
-bytea *mfv_transval_insert_at(bytea *, Datum, uint32);
-void *mfv_transval_getval(bytea *, uint32);
+uint32 mfv_hash(Datum, mfvtransval *);
+int    mfv_find(bytea *, const void *, size_t, uint32);
+bytea *mfv_transval_insert(bytea *, const void *, size_t, uint32, uint64,
+                           uint64);
+bytea *mfv_transval_replace(bytea *, uint32, const void *, size_t, uint32);
+bytea *mfv_transval_add(bytea *, const void *, size_t, uint32, uint64);
+void  *mfv_transval_getval(bytea *, uint32);
 bytea *mfv_init_transval(int, Oid);
 bytea *mfvsketch_merge_c(bytea *, bytea *);
-void   mfv_copy_datum(bytea *, int, Datum);
+bytea *mfv_compacted(bytea *);
+mfvtransval *mfv_check(bytea *);
 int cnt_cmp_desc(const void *i, const void *j);
 
 
 /* UDF protos */
 Datum __cmsketch_int8_trans(PG_FUNCTION_ARGS);
-Datum cmsketch_width_histogram(PG_FUNCTION_ARGS);
-Datum cmsketch_dhistogram(PG_FUNCTION_ARGS);
+Datum __cmsketch_int8_sized_trans(PG_FUNCTION_ARGS);
 Datum __cmsketch_final(PG_FUNCTION_ARGS);
 Datum __cmsketch_merge(PG_FUNCTION_ARGS);
+Datum __cmsketch_merge_trans(PG_FUNCTION_ARGS);
 Datum cmsketch_dump(PG_FUNCTION_ARGS);
-Datum __cmsketch_count_final(PG_FUNCTION_ARGS);
-Datum __cmsketch_rangecount_final(PG_FUNCTION_ARGS);
-Datum __cmsketch_centile_final(PG_FUNCTION_ARGS);
-Datum __cmsketch_median_final(PG_FUNCTION_ARGS);
-Datum __cmsketch_dhist_final(PG_FUNCTION_ARGS);
+Datum cmsketch_count(PG_FUNCTION_ARGS);
+Datum cmsketch_count_array(PG_FUNCTION_ARGS);
+Datum cmsketch_rangecount(PG_FUNCTION_ARGS);
+Datum cmsketch_centile(PG_FUNCTION_ARGS);
+Datum cmsketch_median(PG_FUNCTION_ARGS);
+Datum cmsketch_width_histogram(PG_FUNCTION_ARGS);
+Datum cmsketch_depth_histogram(PG_FUNCTION_ARGS);
 Datum __mfvsketch_trans(PG_FUNCTION_ARGS);
 Datum __mfvsketch_final(PG_FUNCTION_ARGS);
 Datum __mfvsketch_merge(PG_FUNCTION_ARGS);
+Datum __mfvsketch_sketch_final(PG_FUNCTION_ARGS);
 
 #endif /* _COUNTMIN_H_ */
 
@@ -17,7 +17,7 @@
  *
  * The FM sketch technique works poorly with small inputs, so we
  * explicitly count the first 12K distinct values in a main-memory
- * data structure before switching over to sketching.
+ * hash set of their 64-bit hashes before switching over to sketching.
  *
  * See the paper mentioned below
  * for detailed explanation, formulae, and pseudocode.
@@ -34,7 +34,6 @@
 #include "nodes/execnodes.h"
 #include "fmgr.h"
 #include "sketch_support.h"
-#include "sortasort.h"
 #include <ctype.h>
 
 #ifndef NO_PG_MODULE_MAGIC
@@ -51,14 +50,27 @@ PG_MODULE_MAGIC;
 #define MINVALS 1024*12
 
 /*!
- * initial size for a sortasort: we'll guess at 8 bytes per datum.
- * sortasort will grow dynamically if we guessed too low
+ * a key is the bitmap index of a value in its low FM_INDEX_BITS bits, and
+ * the last FM_KEY_BITS bits of its hash above them
  */
-#define SORTASORT_INITIAL_STORAGE  sizeof(sortasort) + MINVALS*sizeof(uint32) + \
-    8*MINVALS
+#define FM_INDEX_BITS 8
+#define FM_KEY_BITS   (64 - FM_INDEX_BITS)
+#define FM_EMPTY_KEY  0
+
+/*!
+ * a hash set starts with room for a few keys and doubles when 3/4 full, up
+ * to the smallest size that holds MINVALS keys
+ */
+#define FM_SET_INITIAL 16
+#define FM_SET_MAX     ((MINVALS)/3*4)
+#define FM_SET_SZ(capacity) (VARHDRSZ + sizeof(fmtransval) + sizeof(fmset) \
+                             + (capacity)*sizeof(uint64))
 
 typedef enum {SMALL, BIG} fmstatus;
 
+#define FM_MAGIC   0x4b534d46 /* "FMSK" */
+#define FM_VERSION 2          /* 1 kept SMALL values in a sortasort */
+
 /*!
  * \internal
  * \brief transition value struct for FM sketches
@@ -66,44 +78,66 @@ typedef enum {SMALL, BIG} fmstatus;
  * because FM sketches work poorly on small numbers of values,
  * our transval can be in one of two modes.
  * for "SMALL" numbers of values (<=MINVALS), the storage array
- * is a "sortasort" data structure containing an array of input values.
+ * is an fmset of the keys of the values seen.
  * for "BIG" datasets (>MINVAL), it is an array of FM sketch bitmaps.
+ * The output of the fmsketch aggregate is a transval too.
  * \endinternal
  */
 typedef struct {
+    uint32   magic;      /*! FM_MAGIC */
+    uint32   version;    /*! FM_VERSION */
     fmstatus status;
     Oid      typOid;
     Oid      funcOid;
     int16    typLen;
     bool     typByVal;   
+    int      hashkind;   /*! SKETCH_HASH_* function used for the keys */
     char storage[0];
 } fmtransval;
 
+/*!
+ * \internal
+ * \brief storage of a SMALL transval: an open addressing hash set of keys
+ * \endinternal
+ */
+typedef struct {
+    uint32 capacity;     /*! number of slots, a power of two */
+    uint32 count;        /*! number of keys in the set */
+    uint64 keys[0];      /*! FM_EMPTY_KEY in unused slots */
+} fmset;
+
 Datum __fmsketch_trans_c(bytea *, Datum);
 Datum __fmsketch_count_distinct_c(bytea *);
 Datum __fmsketch_trans(PG_FUNCTION_ARGS);
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS);
 Datum __fmsketch_merge(PG_FUNCTION_ARGS);
-void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out);
-bytea *fmsketch_sortasort_insert(bytea *, Datum, size_t);
+Datum __fmsketch_final(PG_FUNCTION_ARGS);
+Datum big_or(PG_FUNCTION_ARGS);
 bytea *fm_new(fmtransval *);
+bytea *fm_new_small(fmtransval *);
+bytea *fmsketch_insert(bytea *, Datum);
+bytea *fm_insert_key(bytea *, uint64);
+
+static fmtransval *fm_check(bytea *);
+static uint64 fm_key(fmtransval *, Datum);
+static void   fm_set_key(bytea *, uint64);
+static uint32 fm_set_slot(fmset *, uint64);
+static bytea *fm_set_grow(bytea *);
+static bytea *fm_add_keys(bytea *, fmtransval *);
+static void   fm_bitmap_or(bytea *, bytea *);
 
 PG_FUNCTION_INFO_V1(__fmsketch_trans);
 
-/*! UDA transition function for the fmsketch aggregate. */
+/*! UDA transition function for the fmsketch and fmsketch_dcount aggregates. */
 Datum __fmsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *     transblob = (bytea *)PG_GETARG_BYTEA_P(0);
-    fmtransval *transval;
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    Oid         element_type;
     Oid         funcOid;
     bool        typIsVarlena;
     Datum       retval;
     Datum       inval;
 
-    if (!OidIsValid(element_type))
-        elog(ERROR, "could not determine data type of input");
-
     /*
      * This is Postgres boilerplate for UDFs that modify the data in their own context.
      * Such UDFs can only be correctly called in an agg context since regular scalar
@@ -125,93 +159,107 @@ Datum __fmsketch_trans(PG_FUNCTION_ARGS)
         inval = PG_GETARG_DATUM(1);
 
         /*
-         * if this is the first call, initialize transval to hold a sortasort
+         * if this is the first call, initialize transval to hold an empty set
          * on the first call, we should have the empty string (if the agg was declared properly!)
          */
         if (VARSIZE(transblob) <= VARHDRSZ) {
-            size_t blobsz = VARHDRSZ + sizeof(fmtransval) +
-                            SORTASORT_INITIAL_STORAGE;
+            fmtransval template;
 
-            transblob = (bytea *)palloc0(blobsz);
-            SET_VARSIZE(transblob, blobsz);
-            transval = (fmtransval *)VARDATA(transblob);
+            /*
+             * look up the input type once; later rows use the properties
+             * cached in the transval
+             */
+            element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+            if (!OidIsValid(element_type))
+                elog(ERROR, "could not determine data type of input");
 
-            transval->typOid = element_type;
+            memset(&template, 0, sizeof(fmtransval));
+            template.typOid = element_type;
             /* figure out the outfunc for this type */
             getTypeOutputInfo(element_type, &funcOid, &typIsVarlena);
-            get_typlenbyval(element_type, &(transval->typLen), &(transval->typByVal));
-            transval->status = SMALL;
-            sortasort_init((sortasort *)transval->storage,
-                           MINVALS,
-                           SORTASORT_INITIAL_STORAGE, 
-                           transval->typLen,
-                           transval->typByVal);
-        }
-        else {
-            /* extract the existing transval from the transblob */
-            transval = (fmtransval *)VARDATA(transblob);
+            template.funcOid = funcOid;
+            get_typlenbyval(element_type, &(template.typLen), &(template.typByVal));
+            template.hashkind = SKETCH_HASH_DEFAULT;
+            transblob = fm_new_small(&template);
         }
 
-        /*
-         * if we've seen < MINVALS distinct values, place datum into the sortasort
-         * XXXX Would be cleaner to try the sortasort insert and if it fails, then continue.
-         */
-        if (transval->status == SMALL
-            && ((sortasort *)(transval->storage))->num_vals <
-            MINVALS) {
-            int len = ExtractDatumLen(inval, transval->typLen, transval->typByVal);
-            
-            retval =
-                PointerGetDatum(fmsketch_sortasort_insert(
-                                    transblob,
-                                    inval, len));
-            PG_RETURN_DATUM(retval);
-        }
+        retval = PointerGetDatum(fmsketch_insert(transblob, inval));
+        PG_RETURN_DATUM(retval);
+    }
+    else PG_RETURN_NULL();
+}
 
-        /*
-         * if we've seen exactly MINVALS distinct values, create FM bitmaps
-         * and load the contents of the sortasort into the FM sketch
-         */
-        else if (transval->status == SMALL
-                 && ((sortasort *)(transval->storage))->num_vals ==
-                 MINVALS) {
-            int        i;
-            sortasort  *s = (sortasort *)(transval->storage);
-            bytea      *newblob = fm_new(transval);
-            
-            transval = (fmtransval *)VARDATA(newblob);
-            
-            /*
-             * "catch up" on the past as if we were doing FM from the beginning:
-             * apply the FM sketching algorithm to each value previously stored in the sortasort
-             */
-            for (i = 0; i < MINVALS; i++)
-                __fmsketch_trans_c(newblob, 
-                                   PointerExtractDatum(SORTASORT_GETVAL(s,i), s->typByVal));
+/*!
+ * add a value to an FM transval.
+ * \param transblob the transition value packed into a bytea
+ * \param inval the value to add
+ * \returns the transblob, which may have been reallocated
+ */
+bytea *fmsketch_insert(bytea *transblob, Datum inval)
+{
+    return fm_insert_key(transblob,
+                         fm_key((fmtransval *)VARDATA(transblob), inval));
+}
 
-            /*
-             * XXXX would like to pfree the old transblob, but the memory allocator doesn't like it
-             * XXXX Meanwhile we know that this memory "leak" is of fixed size and will get
-             * XXXX deallocated "soon" when the memory context is destroyed.
-             */
-            /* drop through to insert the current datum in "BIG" mode */
-            transblob = newblob;
+/*!
+ * add the key of a value to an FM transval.
+ * If we've seen < MINVALS distinct values, the key goes into the hash set.
+ * Once a new key arrives after MINVALS distinct ones, we create FM bitmaps
+ * and load the keys in the set into the FM sketch, and from then on
+ * keys are sketched.
+ * \param transblob the transition value packed into a bytea
+ * \param key the key to add
+ * \returns the transblob, which may have been reallocated
+ */
+bytea *fm_insert_key(bytea *transblob, uint64 key)
+{
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+
+    if (transval->status == SMALL) {
+        fmset *set = (fmset *)transval->storage;
+        uint32 slot = fm_set_slot(set, key);
+
+        if (set->keys[slot] == key)
+            return transblob;
+        if (set->count < MINVALS) {
+            if (4*(set->count + 1) > 3*set->capacity) {
+                transblob = fm_set_grow(transblob);
+                set = (fmset *)((fmtransval *)VARDATA(transblob))->storage;
+                slot = fm_set_slot(set, key);
+            }
+            set->keys[slot] = key;
+            set->count++;
+            return transblob;
         }
 
         /*
-         * if we're here we've seen >=MINVALS distinct values and are in BIG mode.
-         * Just for sanity, let's check.
+         * "catch up" on the past as if we were doing FM from the beginning:
+         * apply the FM sketching algorithm to each key in the set, then
+         * drop through to insert the current key in "BIG" mode
          */
-        if (transval->status != BIG)
-            elog(
-                ERROR,
-                "FM sketch failed internal sanity check");
-
-        /* Apply FM algorithm to this datum */
-        retval = __fmsketch_trans_c(transblob, inval);
-        PG_RETURN_DATUM(retval);
+        transblob = fm_add_keys(fm_new(transval), transval);
+        transval = (fmtransval *)VARDATA(transblob);
     }
-    else PG_RETURN_NULL();
+
+    fm_set_key((bytea *)transval->storage, key);
+    return transblob;
+}
+
+/*!
+ * add each key held in the set of a SMALL transval to another transval
+ * \param transblob the transval to add to, packed into a bytea
+ * \param src a transval in SMALL mode
+ * \returns the transblob, which may have been reallocated
+ */
+static bytea *fm_add_keys(bytea *transblob, fmtransval *src)
+{
+    fmset * set = (fmset *)(src->storage);
+    uint32  i;
+
+    for (i = 0; i < set->capacity; i++)
+        if (set->keys[i] != FM_EMPTY_KEY)
+            transblob = fm_insert_key(transblob, set->keys[i]);
+    return transblob;
 }
 
 /*!
@@ -233,6 +281,8 @@ bytea *fm_new(fmtransval *template)
         memcpy(transval, template, sizeof(fmtransval));    
 
     /* set status to BIG, possibly overwriting what was in template */
+    transval->magic = FM_MAGIC;
+    transval->version = FM_VERSION;
     transval->status = BIG;
 
     SET_VARSIZE((bytea *)transval->storage, FMSKETCH_SZ);
@@ -240,79 +290,220 @@ bytea *fm_new(fmtransval *template)
 }
 
 /*!
- * Main logic of Flajolet and Martin's sketching algorithm.
- * For each call, we get an md5 hash of the value passed in.
- * First we use the hash as a random number to choose one of
- * the NMAP bitmaps at random to update.
- * Then we find the position "rmost" of the rightmost 1 bit in the hashed value.
- * We then turn on the "rmost"-th bit FROM THE LEFT in the chosen bitmap.
- * \param transblob the transition value packed into a bytea
- * \param input a textual representation of the value to hash
+ * generate a bytea holding a transval in SMALL mode, with an empty
+ * hash set
+ * \param template a transval whose type and hash function we copy in
  */
-Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
+bytea *fm_new_small(fmtransval *template)
+{
+    bytea *     newblob = (bytea *)palloc0(FM_SET_SZ(FM_SET_INITIAL));
+    fmtransval *transval;
+
+    SET_VARSIZE(newblob, FM_SET_SZ(FM_SET_INITIAL));
+    transval = (fmtransval *)VARDATA(newblob);
+    memcpy(transval, template, sizeof(fmtransval));
+    transval->magic = FM_MAGIC;
+    transval->version = FM_VERSION;
+    transval->status = SMALL;
+    ((fmset *)transval->storage)->capacity = FM_SET_INITIAL;
+    return(newblob);
+}
+
+/*!
+ * the slot of the set that holds key, or the empty slot where it belongs.
+ * The bits of the key above the bitmap index are uniform, so they choose
+ * the first slot to probe.
+ */
+static uint32 fm_set_slot(fmset *set, uint64 key)
+{
+    uint32 mask = set->capacity - 1;
+    uint32 i = (uint32)(key >> FM_INDEX_BITS) & mask;
+
+    while (set->keys[i] != FM_EMPTY_KEY && set->keys[i] != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*!
+ * copy a SMALL transval into one whose set has twice the slots
+ * \returns a new blob
+ */
+static bytea *fm_set_grow(bytea *transblob)
+{
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+    fmset *     set = (fmset *)transval->storage;
+    uint32      capacity = 2*set->capacity;
+    bytea *     newblob = (bytea *)palloc0(FM_SET_SZ(capacity));
+    fmset *     newset;
+    uint32      i;
+
+    /* can't use repalloc, so copy into a larger blob */
+    SET_VARSIZE(newblob, FM_SET_SZ(capacity));
+    memcpy(VARDATA(newblob), transval, sizeof(fmtransval));
+    newset = (fmset *)((fmtransval *)VARDATA(newblob))->storage;
+    newset->capacity = capacity;
+    newset->count = set->count;
+    for (i = 0; i < set->capacity; i++)
+        if (set->keys[i] != FM_EMPTY_KEY)
+            newset->keys[fm_set_slot(newset, set->keys[i])] = set->keys[i];
+    return newblob;
+}
+
+/*!
+ * check that a bytea holds a transval or the output of the fmsketch
+ * aggregate, and return the transval
+ */
+static fmtransval *fm_check(bytea *transblob)
+{
+    fmtransval *transval = (fmtransval *)VARDATA(transblob);
+    fmset *     set = (fmset *)(transval->storage);
+    size_t      sz = VARHDRSZ + sizeof(fmtransval);
+    uint32      i, n = 0;
+
+    /* BIG sketches are laid out as in version 1 */
+    if (VARSIZE(transblob) < sz || transval->magic != FM_MAGIC
+        || (transval->version != FM_VERSION
+            && !(transval->version == 1 && transval->status == BIG)))
+        elog(ERROR, "not an FM sketch");
+    if (transval->status == BIG) {
+        if (VARSIZE(transblob) != sz + FMSKETCH_SZ
+            || VARSIZE((bytea *)transval->storage) != FMSKETCH_SZ)
+            elog(ERROR, "corrupt FM sketch");
+        return transval;
+    }
+    if (transval->status != SMALL
+        || VARSIZE(transblob) < sz + sizeof(fmset)
+        || set->capacity < FM_SET_INITIAL || set->capacity > FM_SET_MAX
+        || (set->capacity & (set->capacity - 1))
+        || 4*set->count > 3*set->capacity
+        || VARSIZE(transblob) != FM_SET_SZ(set->capacity))
+        elog(ERROR, "corrupt FM sketch");
+    for (i = 0; i < set->capacity; i++)
+        n += (set->keys[i] != FM_EMPTY_KEY);
+    if (n != set->count)
+        elog(ERROR, "corrupt FM sketch");
+    return transval;
+}
+
+/*!
+ * the key of a value: the bitmap index that the FM algorithm chooses for
+ * it, and the bits of its hash that choose the bit to turn on.  This is all
+ * the sketch needs of the value, so SMALL transvals keep keys, not values.
+ * \param transval the transval, for the type and hash function
+ * \param indat the value
+ */
+static uint64 fm_key(fmtransval *transval, Datum indat)
 {
-    fmtransval * transval = (fmtransval *) VARDATA(transblob);
-    bytea *      bitmaps = (bytea *)transval->storage;
-    uint64       index;
-    uint8 *      c;
-    int          rmost;
-    Datum        result;
-    // char        *hex;
-    bytea       *hashed;
-
-    hashed = sketch_md5_bytea(indat, transval->typOid);
-    c = (uint8 *)VARDATA(hashed);
-    // hex = text_to_cstring((bytea *)DatumGetPointer(DirectFunctionCall2(binary_encode, PointerGetDatum(hashed),
-    //                       CStringGetTextDatum("hex"))));
-    // elog(NOTICE, "md5(%s), len %d: %s", text_to_cstring((bytea *)PointerGetDatum(indat)),
-    //      VARSIZE((bytea *)PointerGetDatum(indat)), hex);
+    uint64 hashed[SKETCH_HASHLEN/sizeof(uint64)];
+    uint8 *c = (uint8 *)hashed;
+    uint64 key = 0;
+    int    i;
+
+    sketch_hash_value(indat, transval->typLen, transval->typByVal,
+                      transval->hashkind, c);
+
+    /* the rightmost bits of the hash, in the order rightmost_one reads them */
+    for (i = SKETCH_HASHLEN - FM_KEY_BITS/CHAR_BIT; i < SKETCH_HASHLEN; i++)
+        key = (key << CHAR_BIT) | c[i];
+    key = (key << FM_INDEX_BITS) | ((*(uint64 *)c) % NMAP);
 
     /*
-     * During the insertion we insert each element
-     * in one bitmap only (a la Flajolet pseudocode, page 16).
-     * Choose the bitmap by taking the 64 high-order bits worth of hash value mod NMAP
+     * the empty key marks unused slots; stand in a key for the same bitmap
+     * whose rightmost 1 is one place to the left, a 2^-64 event
      */
-    index = (*(uint64 *)c) % NMAP;
+    if (key == FM_EMPTY_KEY)
+        key = (uint64)1 << 63;
+    return key;
+}
+
+/*!
+ * Main logic of Flajolet and Martin's sketching algorithm.
+ * For each call, we get the key of the value passed in.
+ * First we use its index bits as a random number to choose one of
+ * the NMAP bitmaps at random to update.
+ * Then we find the position "rmost" of the rightmost 1 bit in the hash.
+ * We then turn on the "rmost"-th bit FROM THE LEFT in the chosen bitmap.
+ * \param bitmaps the FM sketch
+ * \param key the key of a value, from fm_key
+ */
+static void fm_set_key(bytea *bitmaps, uint64 key)
+{
+    uint64 bits = key >> FM_INDEX_BITS;
+    int    rmost = 0;
 
     /*
-     * Find index of the rightmost non-0 bit.  Turn on that bit (from left!) in the sketch.
+     * Find index of the rightmost non-0 bit.  A key keeps enough bits of the
+     * hash for any count a 64-bit integer can hold.
      */
-    rmost = rightmost_one(c, 1, MD5_HASHLEN_BITS, 0);
+    if (bits == 0)
+        rmost = FM_KEY_BITS;
+    else
+        for (; !(bits & 1); bits >>= 1)
+            rmost++;
 
     /*
+     * During the insertion we insert each element
+     * in one bitmap only (a la Flajolet pseudocode, page 16).
      * last argument must be the index of the bit position from the right.
      * i.e. position 0 is the rightmost.
      * so to set the bit at rmost from the left, we subtract from the total number of bits.
      */
-    result =
-        array_set_bit_in_place(bitmaps, NMAP, MD5_HASHLEN_BITS, index,
-                               (MD5_HASHLEN_BITS - 1) - rmost);
+    array_set_bit_in_place(bitmaps, NMAP, MD5_HASHLEN_BITS, key % NMAP,
+                           (MD5_HASHLEN_BITS - 1) - rmost);
+}
+
+/*!
+ * apply the FM sketching algorithm to a value
+ * \param transblob a transition value in BIG mode packed into a bytea
+ * \param indat the value to sketch
+ */
+Datum __fmsketch_trans_c(bytea *transblob, Datum indat)
+{
+    fmtransval *transval = (fmtransval *) VARDATA(transblob);
+
+    fm_set_key((bytea *)transval->storage, fm_key(transval, indat));
     return PointerGetDatum(transblob);
 }
 
 PG_FUNCTION_INFO_V1(__fmsketch_count_distinct);
 
-/*! UDA final function to get count(distinct) out of an FM sketch */
+/*!
+ * UDA final function to get count(distinct) out of an FM sketch.
+ * Also a UDF for the estimated number of distinct values in a stored sketch.
+ */
 Datum __fmsketch_count_distinct(PG_FUNCTION_ARGS)
 {
-    fmtransval *transval = (fmtransval *)VARDATA((PG_GETARG_BYTEA_P(0)));
+    bytea *     transblob = PG_GETARG_BYTEA_P(0);
+    fmtransval *transval;
 
-    if (VARSIZE((PG_GETARG_BYTEA_P(0))) == VARHDRSZ)
+    if (VARSIZE(transblob) <= VARHDRSZ)
         /* nothing was ever aggregated! */
-        return (0);
+        PG_RETURN_INT64(0);
+    transval = fm_check(transblob);
 
-    /* if status is not BIG then get count from sortasort */
+    /* if status is not BIG then get count from the set */
     if (transval->status == SMALL)
-        return ((sortasort *)(transval->storage))->num_vals;
+        PG_RETURN_INT64(((fmset *)(transval->storage))->count);
     /* else get count via fm */
-    else if (transval->status != BIG) {
-        elog(ERROR, "FM transval neither SMALL nor BIG");
-        return(0);
-    }
-    else     /* transval->status == BIG */
+    else
         return __fmsketch_count_distinct_c((bytea *)transval->storage);
 }
 
+PG_FUNCTION_INFO_V1(__fmsketch_final);
+
+/*!
+ * UDA final function for the fmsketch aggregate: the sketch in its stored
+ * form, which is the transval itself, or NULL if there were no values
+ */
+Datum __fmsketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (VARSIZE(transblob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(transblob);
+}
+
 /*!
  * Finish up the Flajolet-Martin approximation.
  * We sum up the number of leading 1 bits across all bitmaps in the sketch.
@@ -346,103 +537,71 @@ PG_FUNCTION_INFO_V1(__fmsketch_merge);
 
 /*!
  * Greenplum "prefunc": a function to merge 2 transvals computed at different machines.
+ * Also the transition function of fmsketch_merge, over stored sketches.
  * For simple FM, this is trivial: just OR together the two arrays of bitmaps.
  * But we have to deal with cases where one or both transval is SMALL: i.e. it
- * holds a sortasort, not an FM sketch.
- *
- * XXX  TESTING: Ensure we exercise all branches!
+ * holds a set of keys, not an FM sketch.  Its keys are added to the other
+ * transval as if they had been aggregated there.  The second transval is
+ * never modified.
  */
 Datum __fmsketch_merge(PG_FUNCTION_ARGS)
 {
     bytea *     transblob1 = (bytea *)PG_GETARG_BYTEA_P(0);
     bytea *     transblob2 = (bytea *)PG_GETARG_BYTEA_P(1);
     fmtransval *transval1, *transval2;
-    sortasort * s1, *s2;
-    sortasort * sortashort, *sortabig;
-    bytea *     tblob_big, *tblob_small;
-    uint32      i;
+    bytea *     out;
+    bool        inplace = (fcinfo->context &&
+                           (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+                            || IsA(fcinfo->context, WindowAggState)
+    #endif
+                           ));
 
     /* deal with the case where one or both items is the initial value of '' */
-    if (VARSIZE(transblob1) == VARHDRSZ) {
-        PG_RETURN_DATUM(PointerGetDatum(transblob2));
-    }
-    if (VARSIZE(transblob2) == VARHDRSZ) {
+    if (VARSIZE(transblob2) <= VARHDRSZ)
         PG_RETURN_DATUM(PointerGetDatum(transblob1));
-    }
+    transval2 = fm_check(transblob2);
+    if (VARSIZE(transblob1) <= VARHDRSZ)
+        PG_RETURN_DATUM(PointerGetDatum(transblob2));
+    transval1 = fm_check(transblob1);
 
-    transval1 = (fmtransval *)VARDATA(transblob1);
-    transval2 = (fmtransval *)VARDATA(transblob2);
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR, "cannot merge FM sketches of different types");
+    if (transval1->hashkind != transval2->hashkind)
+        elog(ERROR,
+             "cannot merge FM sketches built with different hash functions");
 
-    if (transval1->status == BIG && transval2->status == BIG) {
-        /* easy case: merge two FM sketches via bitwise OR. */
-        fmtransval *newval;
-        tblob_big = fm_new(transval1);
-        newval = (fmtransval *)VARDATA(tblob_big);
-        big_or(transblob1, transblob2, (bytea *)newval->storage);
-        PG_RETURN_DATUM(PointerGetDatum(tblob_big));
+    if (transval1->status == SMALL && transval2->status == BIG) {
+        /* sketch the keys of transval1 into a copy of transval2 */
+        out = (bytea *)palloc(VARSIZE(transblob2));
+        memcpy(out, transblob2, VARSIZE(transblob2));
+        PG_RETURN_DATUM(PointerGetDatum(fm_add_keys(out, transval1)));
     }
-    else if (transval1->status == SMALL && transval2->status == SMALL) {
-        s1 = (sortasort *)(transval1->storage);
-        s2 = (sortasort *)(transval2->storage);
-        tblob_big =
-            (s1->num_vals > s2->num_vals) ? transblob1 : transblob2;
-        tblob_small =
-            (s1->num_vals > s2->num_vals) ? transblob2 : transblob1;
-        sortashort =
-            (sortasort *)(((fmtransval *)((fmtransval *)VARDATA(tblob_small)))->storage);
-        sortabig = (sortasort *)(((fmtransval *)((fmtransval *)VARDATA(tblob_big)))->storage);
-        if (sortabig->num_vals + sortashort->num_vals <=
-            sortabig->capacity) {
-            /*
-             * we have room in sortabig
-             * one could imagine a more efficient (merge-based) sortasort merge,
-             * but for now we just copy the values from the smaller sortasort into
-             * the bigger one.
-             */
-            for (i = 0; i < sortashort->num_vals; i++) {
-                Datum the_val = PointerExtractDatum(SORTASORT_GETVAL(sortashort,i),
-                                                    transval1->typByVal);
-                int the_len = ExtractDatumLen(the_val, transval1->typLen, 
-                                              transval1->typByVal);
-                tblob_big = fmsketch_sortasort_insert(tblob_big, 
-                                                      the_val, 
-                                                      the_len);
-            }
-            PG_RETURN_DATUM(PointerGetDatum(tblob_big));
-        }
-        /* else drop through. */
+
+    /* merge into transblob1 in place, unless it might not be ours to modify */
+    if (!inplace) {
+        out = (bytea *)palloc(VARSIZE(transblob1));
+        memcpy(out, transblob1, VARSIZE(transblob1));
+        transblob1 = out;
+        transval1 = (fmtransval *)VARDATA(transblob1);
     }
 
-    /*
-     * if we got here, then at most one transval is BIG, i.e. one or both transvals is SMALL.
-     * need to form an FM sketch and populate with the SMALL transval(s)
-     */
-    if (transval1->status == SMALL && transval2->status == SMALL)
-        tblob_big = fm_new(transval1);
+    if (transval2->status == BIG)
+        /* easy case: merge two FM sketches via bitwise OR. */
+        fm_bitmap_or((bytea *)transval1->storage, (bytea *)transval2->storage);
     else
-        tblob_big =
-            (transval1->status == BIG) ? transblob1 : transblob2;
-
-    if (transval1->status == SMALL) {
-        s1 = (sortasort *)(transval1->storage);
-        for(i = 0; i < s1->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s1,i),
-                                                              transval1->typByVal));
-        }
-    }
-    if (transval2->status == SMALL) {
-        s2 = (sortasort *)(transval2->storage);
-        for(i = 0; i < s2->num_vals; i++) {
-            __fmsketch_trans_c(tblob_big, PointerExtractDatum(SORTASORT_GETVAL(s2,i),
-                                                              transval1->typByVal));
-        }
-    }
-    PG_RETURN_DATUM(PointerGetDatum(tblob_big));
+        transblob1 = fm_add_keys(transblob1, transval2);
+    PG_RETURN_DATUM(PointerGetDatum(transblob1));
 }
 
-/*! OR of two big bitmaps, for gathering sketches computed in parallel. */
-void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
+/*!
+ * OR the FM bitmaps in bitmap2 into bitmap1, for gathering sketches
+ * computed in parallel
+ */
+static void fm_bitmap_or(bytea *bitmap1, bytea *bitmap2)
 {
+    uint8 * b1 = (uint8 *)VARDATA(bitmap1);
+    uint8 * b2 = (uint8 *)VARDATA(bitmap2);
     uint32  i;
 
     if (VARSIZE(bitmap1) != VARSIZE(bitmap2))
@@ -451,66 +610,19 @@ void big_or(bytea *bitmap1, bytea *bitmap2, bytea *out)
              VARSIZE(bitmap1),
              VARSIZE(bitmap2));
 
-    out = (bytea *)palloc(VARSIZE(bitmap1));
-    SET_VARSIZE(out, VARSIZE(bitmap1));
-
-    /* could probably be more efficient doing this 32 or 64 bits at a time */
-    for (i=0; i < VARSIZE(bitmap1) - VARHDRSZ; i+=8)
-        ((char *)(VARDATA(out)))[i] = ((char *)(VARDATA(bitmap1)))[i] |
-                                      ((char *)(VARDATA(bitmap2)))[i];
-
+    /* a plain byte-wise OR, which compilers vectorize */
+    for (i = 0; i < VARSIZE(bitmap1) - VARHDRSZ; i++)
+        b1[i] |= b2[i];
 }
 
-/*!
- * wrapper for insertion into a sortasort. calls sortasort_try_insert and if that fails it
- * makes more space for insertion (double or more the size) and tries again.
- * \param transblob the current transition value packed into a bytea
- * \param dat the Datum to be inserted
- */
-bytea *fmsketch_sortasort_insert(bytea *transblob, Datum dat, size_t len)
-{
-    fmtransval *transval = (fmtransval *)VARDATA(transblob);
-    sortasort *s_in =
-        (sortasort *)(transval->storage);
-    bytea *    newblob;
-    bool       success = FALSE;
-    size_t     new_storage_sz;
-    size_t     newsize;
-
-    if (s_in->num_vals >= s_in->capacity)
-        elog(ERROR, "attempt to insert into full sortasort");
-
-    success = sortasort_try_insert(s_in, dat, transval->typLen);
-    if (success < 0)
-        elog(ERROR, "insufficient directory capacity in sortasort");
+PG_FUNCTION_INFO_V1(big_or);
 
-    if (success == TRUE) return (transblob);
-
-    /* XXX  THIS WHILE LOOP WILL SUCCEED THE FIRST TRY ... REMOVE IT. */
-    while (!success) {
-        /*
-         * else insufficient space
-         * allocate a fmtransval with double-big storage area plus room for v
-         * should work 2nd time around the loop.
-         * we can't use repalloc because it fails trying to free the old transblob
-         */
+/*! UDF for the bitwise OR of two bitmaps of the same size */
+Datum big_or(PG_FUNCTION_ARGS)
+{
+    bytea *bitmap1 = PG_GETARG_BYTEA_P_COPY(0);
+    bytea *bitmap2 = PG_GETARG_BYTEA_P(1);
 
-        new_storage_sz = s_in->storage_sz*2 + len;
-        /* XXX THIS POINTER ARITHMETIC SHOULD BE HIDDEN BY A MACRO IN THE SORTASORT LIBRARY! */
-        newsize = VARHDRSZ + sizeof(fmtransval) + sizeof(sortasort)
-                  + s_in->capacity*sizeof(s_in->dir[0]) +
-                  new_storage_sz;
-        newblob = (bytea *)palloc(newsize);
-        memcpy(newblob, transblob, VARSIZE(transblob));
-        SET_VARSIZE(newblob, newsize);
-        s_in = (sortasort *)((fmtransval *)VARDATA(newblob))->storage;
-        s_in->storage_sz = new_storage_sz;
-        /*
-         * Can't figure out how to make pfree happy with transblob
-         * pfree(transblob);
-         */
-        transblob = newblob;
-        success = sortasort_try_insert(s_in, dat, transval->typLen);
-    }
-    return(transblob);
+    fm_bitmap_or(bitmap1, bitmap2);
+    PG_RETURN_BYTEA_P(bitmap1);
 }
@@ -0,0 +1,577 @@
+/*!
+ * \file hll.c
+ *
+ * \brief HyperLogLog++ sketch implementation
+ */
+/*!
+ * \implementation
+ * A HyperLogLog sketch hashes every value to 64 bits, uses the first p bits
+ * of the hash to pick one of m = 2^p registers, and keeps in each register
+ * the largest "rank" seen there: the position of the leftmost 1 bit in the
+ * rest of the hash.  The distinct count is estimated from the harmonic mean
+ * of 2^rank over the registers, with a relative error of about 1.04/sqrt(m).
+ *
+ * Following Heule, Nunkesser and Hall's HyperLogLog++, a sketch starts out
+ * "sparse": a sorted list of (index, rank) pairs at the much finer precision
+ * of 25 bits, which is far smaller than m registers for small inputs and
+ * nearly exact.  New pairs are appended unsorted and merged into the list
+ * in batches.  Once the list would take more room than the registers, the
+ * sketch is converted to the "dense" array of m one-byte registers.
+ *
+ * Rather than HLL++'s empirical bias-correction tables, dense sketches are
+ * estimated with Ertl's improved estimator ("New cardinality estimation
+ * algorithms for HyperLogLog sketches", 2017), which is unbiased from
+ * small to very large counts and needs no tables.
+ *
+ * The sketch is stored as a bytea in the same layout as the transition
+ * value, so it can be kept in tables and merged later with hll_union.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define HLL_MAGIC             0x2b4c4c48 /* "HLL+" */
+#define HLL_VERSION           1
+#define HLL_SPARSE            0
+#define HLL_DENSE             1
+#define HLL_MIN_PRECISION     4
+#define HLL_MAX_PRECISION     18
+#define HLL_DEFAULT_PRECISION 14
+/*! precision of the index in sparse entries */
+#define HLL_SPARSE_PRECISION  25
+/*! initial number of sparse entries a new sketch has room for */
+#define HLL_SPARSE_INITIAL    64
+
+/*!
+ * \internal
+ * \brief a HyperLogLog++ sketch, as transition value and as stored value
+ *
+ * In sparse encoding, data holds nsparse sorted uint32 entries of the form
+ * (index << 6) | rank, with at most one entry per index, followed by ntail
+ * unsorted ones, with room for capacity entries in all.  Stored sketches
+ * have no unsorted entries.  In dense encoding, data holds 2^precision
+ * one-byte registers.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;     /*! HLL_MAGIC */
+    uint8  version;   /*! HLL_VERSION */
+    uint8  precision; /*! log2 of the number of dense registers */
+    uint8  encoding;  /*! HLL_SPARSE or HLL_DENSE */
+    uint8  hashkind;  /*! SKETCH_HASH_* function used for the sketch */
+    uint32 nsparse;   /*! number of sorted sparse entries */
+    uint32 ntail;     /*! number of unsorted sparse entries after them */
+    uint32 capacity;  /*! number of sparse entries there is room for */
+    uint8  data[0];   /*! sparse entries or dense registers */
+} hllsketch;
+
+#define HLL_SKETCH(b)          ((hllsketch *)VARDATA(b))
+#define HLL_INITIALIZED(b)     (VARSIZE(b) > VARHDRSZ)
+#define HLL_REGISTERS(p)       ((uint32)1 << (p))
+#define HLL_SPARSE_SZ(cap)     (VARHDRSZ + sizeof(hllsketch) + \
+                                (size_t)(cap)*sizeof(uint32))
+#define HLL_DENSE_SZ(p)        (VARHDRSZ + sizeof(hllsketch) + HLL_REGISTERS(p))
+/*! sparse entries beyond this take more room than the dense registers */
+#define HLL_SPARSE_MAX(p)      (HLL_REGISTERS(p)/sizeof(uint32))
+#define HLL_ENTRY(idx, rank)   (((uint32)(idx) << 6) | (rank))
+#define HLL_ENTRY_INDEX(e)     ((e) >> 6)
+#define HLL_ENTRY_RANK(e)      ((e) & 0x3f)
+
+/*!
+ * \internal
+ * \brief properties of the input type, cached in fn_extra by __hll_trans
+ * \endinternal
+ */
+typedef struct {
+    int16 typLen;
+    bool  typByVal;
+} hlltypcache;
+
+Datum __hll_trans(PG_FUNCTION_ARGS);
+Datum __hll_merge(PG_FUNCTION_ARGS);
+Datum __hll_final(PG_FUNCTION_ARGS);
+Datum __hll_dcount_final(PG_FUNCTION_ARGS);
+Datum hll_union(PG_FUNCTION_ARGS);
+Datum hll_cardinality(PG_FUNCTION_ARGS);
+bytea *hll_new(int, int);
+bytea *hll_insert_hash(bytea *, uint64);
+bytea *hll_merge_c(bytea *, bytea *);
+bytea *hll_compacted(bytea *);
+double hll_estimate(hllsketch *);
+
+static bytea *hll_add_entry(bytea *, uint32);
+static bytea *hll_to_dense(bytea *);
+static void   hll_compact(hllsketch *);
+static hllsketch *hll_check(bytea *);
+
+/*!
+ * one more than the number of leading zeros in the first bits bits of w,
+ * or bits+1 if they are all zero
+ */
+static inline uint8 hll_rank(uint64 w, int bits)
+{
+    uint8 rank = 1;
+
+    while (rank <= bits && !(w & ((uint64)1 << 63))) {
+        rank++;
+        w <<= 1;
+    }
+    return rank;
+}
+
+/*! set a dense register to rank, if that is larger */
+static inline void hll_dense_set(hllsketch *s, uint32 idx, uint8 rank)
+{
+    if (s->data[idx] < rank)
+        s->data[idx] = rank;
+}
+
+/*! apply a sparse entry to the registers of a dense sketch */
+static inline void hll_dense_set_entry(hllsketch *s, uint32 e)
+{
+    int    shift = HLL_SPARSE_PRECISION - s->precision;
+    uint32 idx = HLL_ENTRY_INDEX(e);
+    uint32 low = idx & (((uint32)1 << shift) - 1);
+
+    /*
+     * the bits of the sparse index below the dense index are the first bits
+     * of the part of the hash that the dense rank is taken from
+     */
+    hll_dense_set(s, idx >> shift,
+                  low ? hll_rank((uint64)low << (64 - shift), shift)
+                  : shift + HLL_ENTRY_RANK(e));
+}
+
+static int uint32_cmp(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*!
+ * allocate an empty sparse sketch
+ * \param precision log2 of the number of registers once the sketch is dense
+ * \param hashkind the SKETCH_HASH_* function to use
+ */
+bytea *hll_new(int precision, int hashkind)
+{
+    uint32     capacity;
+    bytea *    blob;
+    hllsketch *s;
+
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        elog(ERROR, "HyperLogLog precision must be between %d and %d",
+             HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+
+    capacity = Min(HLL_SPARSE_INITIAL, HLL_SPARSE_MAX(precision) + 1);
+    blob = (bytea *)palloc0(HLL_SPARSE_SZ(capacity));
+    SET_VARSIZE(blob, HLL_SPARSE_SZ(capacity));
+    s = HLL_SKETCH(blob);
+    s->magic = HLL_MAGIC;
+    s->version = HLL_VERSION;
+    s->precision = precision;
+    s->encoding = HLL_SPARSE;
+    s->hashkind = hashkind;
+    s->capacity = capacity;
+    return blob;
+}
+
+/*!
+ * sort the unsorted sparse entries into the sorted ones, keeping only the
+ * largest rank for each index
+ */
+static void hll_compact(hllsketch *s)
+{
+    uint32 *e = (uint32 *)s->data;
+    uint32  n = s->nsparse, end = s->nsparse + s->ntail;
+    uint32  i = 0, j = n, k = 0, next;
+    uint32 *merged;
+
+    if (s->ntail == 0)
+        return;
+    qsort(e + n, s->ntail, sizeof(uint32), uint32_cmp);
+    merged = (uint32 *)palloc(end*sizeof(uint32));
+    while (i < n || j < end) {
+        next = (j >= end || (i < n && e[i] <= e[j])) ? e[i++] : e[j++];
+        /* entries are in order, so a repeated index has the larger rank */
+        if (k > 0 && HLL_ENTRY_INDEX(merged[k-1]) == HLL_ENTRY_INDEX(next))
+            merged[k-1] = next;
+        else
+            merged[k++] = next;
+    }
+    memcpy(e, merged, k*sizeof(uint32));
+    pfree(merged);
+    s->nsparse = k;
+    s->ntail = 0;
+}
+
+/*!
+ * convert a sparse sketch to dense registers
+ * \returns a new blob
+ */
+static bytea *hll_to_dense(bytea *blob)
+{
+    hllsketch *s = HLL_SKETCH(blob);
+    bytea *    newblob = (bytea *)palloc0(HLL_DENSE_SZ(s->precision));
+    hllsketch *d;
+    uint32 *   e = (uint32 *)s->data;
+    uint32     i;
+
+    SET_VARSIZE(newblob, HLL_DENSE_SZ(s->precision));
+    d = HLL_SKETCH(newblob);
+    memcpy(d, s, sizeof(hllsketch));
+    d->encoding = HLL_DENSE;
+    d->nsparse = d->ntail = d->capacity = 0;
+    for (i = 0; i < s->nsparse + s->ntail; i++)
+        hll_dense_set_entry(d, e[i]);
+    return newblob;
+}
+
+/*!
+ * add a sparse entry to a sketch, compacting, growing or converting the
+ * sketch to dense as needed
+ * \returns the blob, which may have been reallocated
+ */
+static bytea *hll_add_entry(bytea *blob, uint32 entry)
+{
+    hllsketch *s = HLL_SKETCH(blob);
+    uint32     max = HLL_SPARSE_MAX(s->precision);
+
+    if (s->encoding == HLL_DENSE) {
+        hll_dense_set_entry(s, entry);
+        return blob;
+    }
+
+    if (s->nsparse + s->ntail == s->capacity) {
+        hll_compact(s);
+        if (s->nsparse > max) {
+            blob = hll_to_dense(blob);
+            hll_dense_set_entry(HLL_SKETCH(blob), entry);
+            return blob;
+        }
+        if (s->nsparse == s->capacity) {
+            /* can't use repalloc, so copy into a larger blob */
+            uint32 capacity = Min(Max(2*s->capacity, HLL_SPARSE_INITIAL),
+                                  max + 1);
+            bytea *newblob = (bytea *)palloc(HLL_SPARSE_SZ(capacity));
+
+            memcpy(newblob, blob, HLL_SPARSE_SZ(s->nsparse));
+            SET_VARSIZE(newblob, HLL_SPARSE_SZ(capacity));
+            blob = newblob;
+            s = HLL_SKETCH(blob);
+            s->capacity = capacity;
+        }
+    }
+    ((uint32 *)s->data)[s->nsparse + s->ntail++] = entry;
+    return blob;
+}
+
+/*!
+ * insert a 64-bit hash into a sketch
+ * \returns the blob, which may have been reallocated
+ */
+bytea *hll_insert_hash(bytea *blob, uint64 h)
+{
+    hllsketch *s = HLL_SKETCH(blob);
+
+    if (s->encoding == HLL_DENSE) {
+        hll_dense_set(s, h >> (64 - s->precision),
+                      hll_rank(h << s->precision, 64 - s->precision));
+        return blob;
+    }
+    return hll_add_entry(blob,
+                         HLL_ENTRY(h >> (64 - HLL_SPARSE_PRECISION),
+                                   hll_rank(h << HLL_SPARSE_PRECISION,
+                                            64 - HLL_SPARSE_PRECISION)));
+}
+
+/*!
+ * merge the sketch in blob2 into the one in blob1, which is modified
+ * \returns blob1, which may have been reallocated
+ */
+bytea *hll_merge_c(bytea *blob1, bytea *blob2)
+{
+    hllsketch *s1 = HLL_SKETCH(blob1);
+    hllsketch *s2 = HLL_SKETCH(blob2);
+    uint32     i, m;
+
+    if (s1->precision != s2->precision)
+        elog(ERROR,
+             "cannot merge HyperLogLog sketches of different precisions");
+    if (s1->hashkind != s2->hashkind)
+        elog(ERROR,
+             "cannot merge HyperLogLog sketches built with different hash functions");
+
+    if (s2->encoding == HLL_SPARSE) {
+        uint32 *e = (uint32 *)s2->data;
+
+        for (i = 0; i < s2->nsparse + s2->ntail; i++)
+            blob1 = hll_add_entry(blob1, e[i]);
+        return blob1;
+    }
+
+    if (s1->encoding == HLL_SPARSE) {
+        blob1 = hll_to_dense(blob1);
+        s1 = HLL_SKETCH(blob1);
+    }
+    /* a plain byte-wise max, which compilers vectorize */
+    m = HLL_REGISTERS(s1->precision);
+    for (i = 0; i < m; i++)
+        s1->data[i] = Max(s1->data[i], s2->data[i]);
+    return blob1;
+}
+
+/*!
+ * a copy of a sketch with its sparse entries sorted and no spare room,
+ * i.e. in its stored form
+ */
+bytea *hll_compacted(bytea *blob)
+{
+    hllsketch *s = HLL_SKETCH(blob);
+    bytea *    out;
+
+    if (s->encoding == HLL_DENSE) {
+        out = (bytea *)palloc(VARSIZE(blob));
+        memcpy(out, blob, VARSIZE(blob));
+        return out;
+    }
+    out = (bytea *)palloc(HLL_SPARSE_SZ(s->nsparse + s->ntail));
+    memcpy(out, blob, HLL_SPARSE_SZ(s->nsparse + s->ntail));
+    s = HLL_SKETCH(out);
+    s->capacity = s->nsparse + s->ntail;
+    hll_compact(s);
+    s->capacity = s->nsparse;
+    SET_VARSIZE(out, HLL_SPARSE_SZ(s->capacity));
+    return out;
+}
+
+/*! Ertl's sigma function, for the registers that are still zero */
+static double hll_sigma(double x)
+{
+    double y = 1, z = x, zprev;
+
+    if (x == 1)
+        return HUGE_VAL;
+    do {
+        x *= x;
+        zprev = z;
+        z += x*y;
+        y += y;
+    } while (z != zprev);
+    return z;
+}
+
+/*! Ertl's tau function, for the registers that have overflowed */
+static double hll_tau(double x)
+{
+    double y = 1, z, zprev;
+
+    if (x == 0 || x == 1)
+        return 0;
+    z = 1 - x;
+    do {
+        x = sqrt(x);
+        zprev = z;
+        y *= 0.5;
+        z -= (1 - x)*(1 - x)*y;
+    } while (z != zprev);
+    return z/3;
+}
+
+/*!
+ * estimate the number of distinct values in a sketch
+ */
+double hll_estimate(hllsketch *s)
+{
+    if (s->encoding == HLL_SPARSE) {
+        /* linear counting over the 2^25 sparse indexes */
+        double  mp = (double)((uint32)1 << HLL_SPARSE_PRECISION);
+        uint32 *e = (uint32 *)s->data;
+        uint32  n = s->nsparse + s->ntail, distinct = 0, i;
+
+        if (s->ntail > 0) {
+            uint32 *sorted = (uint32 *)palloc(n*sizeof(uint32));
+
+            memcpy(sorted, e, n*sizeof(uint32));
+            qsort(sorted, n, sizeof(uint32), uint32_cmp);
+            e = sorted;
+        }
+        for (i = 0; i < n; i++)
+            if (i == 0 || HLL_ENTRY_INDEX(e[i]) != HLL_ENTRY_INDEX(e[i-1]))
+                distinct++;
+        return mp*log(mp/(mp - distinct));
+    }
+    else {
+        uint32 m = HLL_REGISTERS(s->precision);
+        int    q = 64 - s->precision;
+        double hist[66];
+        double z;
+        uint32 i;
+        int    k;
+
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < m; i++)
+            hist[s->data[i]]++;
+        z = m*hll_tau(1 - hist[q+1]/m);
+        for (k = q; k >= 1; k--)
+            z = 0.5*(z + hist[k]);
+        z += m*hll_sigma(hist[0]/m);
+        return m/(2*log(2))*m/z;
+    }
+}
+
+/*!
+ * check that a bytea holds a sketch from hll_sketch, and return it
+ */
+static hllsketch *hll_check(bytea *blob)
+{
+    hllsketch *s = HLL_SKETCH(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(hllsketch)
+        || s->magic != HLL_MAGIC || s->version != HLL_VERSION)
+        elog(ERROR, "not a HyperLogLog sketch");
+    if (s->precision < HLL_MIN_PRECISION || s->precision > HLL_MAX_PRECISION
+        || (s->encoding == HLL_DENSE
+            && VARSIZE(blob) != HLL_DENSE_SZ(s->precision))
+        || (s->encoding == HLL_SPARSE
+            && (VARSIZE(blob) != HLL_SPARSE_SZ(s->capacity)
+                || s->nsparse + s->ntail > s->capacity))
+        || s->encoding > HLL_DENSE)
+        elog(ERROR, "corrupt HyperLogLog sketch");
+    return s;
+}
+
+PG_FUNCTION_INFO_V1(__hll_trans);
+
+/*!
+ * UDA transition function for hll_sketch and hll_dcount.  An optional third
+ * argument sets the precision.
+ */
+Datum __hll_trans(PG_FUNCTION_ARGS)
+{
+    bytea *      blob = PG_GETARG_BYTEA_P(0);
+    hlltypcache *typ = (hlltypcache *)fcinfo->flinfo->fn_extra;
+    uint64       hash[SKETCH_HASHLEN/sizeof(uint64)];
+    hllsketch *  s;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (typ == NULL) {
+        /* look up the input type once per query */
+        Oid element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+        if (!OidIsValid(element_type))
+            elog(ERROR, "could not determine data type of input");
+        typ = (hlltypcache *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                sizeof(hlltypcache));
+        get_typlenbyval(element_type, &typ->typLen, &typ->typByVal);
+        fcinfo->flinfo->fn_extra = typ;
+    }
+    if (!HLL_INITIALIZED(blob))
+        blob = hll_new((PG_NARGS() > 2) ? PG_GETARG_INT32(2)
+                       : HLL_DEFAULT_PRECISION, SKETCH_HASH_DEFAULT);
+    s = HLL_SKETCH(blob);
+
+    sketch_hash_value(PG_GETARG_DATUM(1), typ->typLen, typ->typByVal,
+                      s->hashkind, (uint8 *)hash);
+    PG_RETURN_BYTEA_P(hll_insert_hash(blob, hash[0]));
+}
+
+PG_FUNCTION_INFO_V1(__hll_merge);
+
+/*!
+ * Greenplum "prefunc" to combine sketches from multiple machines.
+ * Also the transition function of hll_merge, over stored sketches.
+ */
+Datum __hll_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (!HLL_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    hll_check(blob2);
+    if (!HLL_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+    hll_check(blob1);
+
+    /* merge into blob1 in place, unless it might not be ours to modify */
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          ))) {
+        bytea *copy = (bytea *)palloc(VARSIZE(blob1));
+
+        memcpy(copy, blob1, VARSIZE(blob1));
+        blob1 = copy;
+    }
+    PG_RETURN_BYTEA_P(hll_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__hll_final);
+
+/*! UDA final function for hll_sketch: the sketch in its stored form */
+Datum __hll_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    /* nothing was aggregated: emit an empty sketch */
+    if (!HLL_INITIALIZED(blob))
+        blob = hll_new(HLL_DEFAULT_PRECISION, SKETCH_HASH_DEFAULT);
+    PG_RETURN_BYTEA_P(hll_compacted(blob));
+}
+
+PG_FUNCTION_INFO_V1(__hll_dcount_final);
+
+/*! UDA final function for hll_dcount */
+Datum __hll_dcount_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (!HLL_INITIALIZED(blob))
+        PG_RETURN_INT64(0);
+    PG_RETURN_INT64((int64)(hll_estimate(HLL_SKETCH(blob)) + 0.5));
+}
+
+PG_FUNCTION_INFO_V1(hll_union);
+
+/*! UDF to combine two stored sketches into a sketch of their union */
+Datum hll_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    hll_check(blob1);
+    hll_check(blob2);
+    PG_RETURN_BYTEA_P(hll_compacted(hll_merge_c(hll_compacted(blob1),
+                                                blob2)));
+}
+
+PG_FUNCTION_INFO_V1(hll_cardinality);
+
+/*! UDF for the estimated number of distinct values in a stored sketch */
+Datum hll_cardinality(PG_FUNCTION_ARGS)
+{
+    hllsketch *s = hll_check(PG_GETARG_BYTEA_P(0));
+
+    PG_RETURN_INT64((int64)(hll_estimate(s) + 0.5));
+}
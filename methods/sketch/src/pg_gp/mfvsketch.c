@@ -1,29 +1,31 @@
 /*!
  * \file mfvsketch.c
- 
- \brief CountMin sketch for Most Frequent Value estimation
+
+ \brief Space-Saving sketch for Most Frequent Value estimation
  \implementation
- This is basically a CountMin sketch that keeps track of most frequent values
- as it goes.  This is easy to do, because at any point during a scan,
- it can use the CM sketch to quickly get the count of any value so far.
- 
- It only uses CountMin sketches for value counting, and doesn't need the "dyadic" range trick.
- As a result it's not limited to integers, and the implementation works
- for any Postgres data type.
-
-
- The parallel method (<c>mfvsketch_quick_histogram</c>) is a heuristic with no
- such guarantees, but it will likely work well in most cases.  As an example
- of a case where it will fail, consider a scenario where the top <i>n</i> values on node 1 are very infrequent on
- node 2, and the top <i>n</i> values on node 2 are infrequent on node 1.  But the <i>n</i>+1'th value
- is the same on both nodes and the most frequent value in toto.  It will get
- surpressed incorrectly by the parallel heuristic, but get chosen by the standard method.
-
- However, we're probably OK here most of the time.  What we're interested in are
- values whose frequencies are unusually high. For
-  columns with very flat distributions, we likely don't care about the results much.
-  Otherwise, The results of this heuristic will likely be
-  unusually frequent values, if not precisely the *most* frequent values.
+ This is the Space-Saving algorithm of Metwally, Agrawal and El Abbadi.
+ It keeps a fixed number of counters, each holding a value and a count.
+ A value that already has a counter increments it.  A new value takes a
+ free counter if there is one, and otherwise takes over the smallest
+ counter, adding one to its count.  So counts are upper bounds, and a
+ count overestimates the frequency of its value by at most the count it
+ took over, which is recorded alongside.  With k counters over n rows
+ every value that occurs more than n/k times has a counter, and no count
+ is off by more than n/k.
+
+ The counters are kept in a min-heap ordered by count, and found through
+ an open-addressing hash index from values to counters, so each row costs
+ a hash and O(log k) at worst; repeated values usually leave the heap in
+ order, and cost O(1).  The sketch keeps MFV_SLOTS_PER_MFV counters per
+ value it reports, so that the reported counts are tight.  It works for
+ any Postgres data type.
+
+ Sketches merge as in Agarwal et al., "Mergeable Summaries": a value
+ counted by both sides gets the sum of its counts, and a value counted by
+ only one side is charged the smallest count of the other, which bounds
+ how often it can have occurred there.  The largest k combined counts
+ are kept.  The merged sketch has the same guarantees as one built in a
+ single scan, so the parallel aggregate in Greenplum loses nothing.
  */
 
 
@@ -44,21 +46,72 @@
 
 #include <ctype.h>
 
+/*!
+ * \internal
+ * \brief a candidate counter while merging two mfv sketches
+ * \endinternal
+ */
+typedef struct {
+    uint64 cnt;  /*! combined count */
+    uint64 err;  /*! combined maximum overestimate */
+    bytea *blob; /*! the sketch holding the value */
+    uint32 slot; /*! the slot of the value in that sketch */
+} mfvmerge;
+
+static void  mfv_heap_down(mfvtransval *, uint32);
+static void  mfv_heap_up(mfvtransval *, uint32);
+static void  mfv_index_insert(mfvtransval *, uint32);
+static void  mfv_index_delete(mfvtransval *, uint32);
+static bytea *mfv_store_value(bytea *, uint32, const void *, size_t);
+static bytea *mfv_repack(bytea *, size_t);
+static void *mfv_slot_value(bytea *, offsetcnt *);
+static int   mfvmerge_cmp_desc(const void *, const void *);
+
+/*!
+ * the 32 bits of the value hash used by the index.  Varlena values are
+ * hashed by their contents, whatever their header.
+ * \param dat the value
+ * \param transval the sketch, for the type and hash function
+ */
+uint32 mfv_hash(Datum dat, mfvtransval *transval)
+{
+    uint8  hash[SKETCH_HASHLEN];
+    uint32 h;
+
+    sketch_hash_value(dat, transval->typLen, transval->typByVal,
+                      transval->hashkind, hash);
+    memcpy(&h, hash, sizeof(uint32));
+    return h;
+}
+
+/*!
+ * whether a stored value is the same as another one.  Varlena values are
+ * compared by their contents, since the same value can be stored with a
+ * short or a long header.
+ */
+static bool mfv_equal(mfvtransval *transval, const void *valp1, size_t len1,
+                      const void *valp2, size_t len2)
+{
+    if (transval->typLen == -1)
+        return VARSIZE_ANY_EXHDR(valp1) == VARSIZE_ANY_EXHDR(valp2)
+               && !memcmp(VARDATA_ANY(valp1), VARDATA_ANY(valp2),
+                          VARSIZE_ANY_EXHDR(valp1));
+    return len1 == len2 && !memcmp(valp1, valp2, len1);
+}
+
 PG_FUNCTION_INFO_V1(__mfvsketch_trans);
 
 /*!
- *  transition function to maintain a CountMin sketch with
+ *  transition function to maintain a Space-Saving sketch of
  *  Most-Frequent Values
  */
 Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
 {
     bytea *      transblob = PG_GETARG_BYTEA_P(0);
     Datum        newdatum  = PG_GETARG_DATUM(1);
-    int          max_mfvs  = PG_GETARG_INT32(2);
     mfvtransval *transval;
-    uint64       tmpcnt;
-    int          i;
-    Datum        md5_datum;
+    void *       valp;
+    size_t       len;
 
     /*
      * This function makes destructive updates to its arguments.
@@ -74,9 +127,9 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
              "destructive pass by reference outside agg");
 
     /* initialize if this is first call */
-    if (VARSIZE(transblob) <= sizeof(MFV_TRANSVAL_SZ(0))) {
+    if (!MFV_TRANSVAL_INITIALIZED(transblob) && !PG_ARGISNULL(2)) {
         Oid typOid = get_fn_expr_argtype(fcinfo->flinfo, 1);
-        transblob = mfv_init_transval(max_mfvs, typOid);
+        transblob = mfv_init_transval(PG_GETARG_INT32(2), typOid);
     }
 
     /* ignore NULL inputs */
@@ -84,74 +137,78 @@ Datum __mfvsketch_trans(PG_FUNCTION_ARGS)
         PG_RETURN_DATUM(PointerGetDatum(transblob));
 
     transval = (mfvtransval *)VARDATA(transblob);
-    /* insert into the countmin sketch */
-    md5_datum = countmin_trans_c(transval->sketch,
-                                newdatum,
-                                transval->outFuncOid,
-                                transval->typOid);
+    /* keep a plain copy of toasted values, never a toast pointer */
+    if (transval->typLen == -1)
+        newdatum = PointerGetDatum(PG_DETOAST_DATUM_PACKED(newdatum));
+    len = MFV_DATUM_LEN(newdatum, transval);
+    valp = DatumExtractPointer(newdatum, transval->typByVal);
+    transblob = mfv_transval_add(transblob, valp, len,
+                                 mfv_hash(newdatum, transval), 1);
+    PG_RETURN_DATUM(PointerGetDatum(transblob));
+}
 
-    tmpcnt = cmsketch_count_md5_datum(transval->sketch,
-                                      (bytea *)DatumGetPointer(md5_datum),
-                                      transval->outFuncOid);
-    i = mfv_find(transblob, newdatum);
+/*!
+ * count a value <c>weight</c> more times in an mfv sketch.
+ * If the value has no counter and all counters are in use, it takes over
+ * the smallest one.
+ * \param transblob a bytea holding an mfv transval
+ * \param valp the bytes of the value
+ * \param len the number of bytes
+ * \param hash the hash of the value, from mfv_hash
+ * \param weight the number of occurrences to add
+ */
+bytea *mfv_transval_add(bytea *transblob, const void *valp, size_t len,
+                        uint32 hash, uint64 weight)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    int          i = mfv_find(transblob, valp, len, hash);
 
     if (i > -1) {
-        transval->mfvs[i].cnt = tmpcnt;
+        transval->mfvs[i].cnt += weight;
+        mfv_heap_down(transval, transval->mfvs[i].heappos);
     }
+    else if (transval->next_mfv < transval->nslots)
+        transblob = mfv_transval_insert(transblob, valp, len, hash, weight, 0);
     else {
-        /* try to insert as either a new or replacement entry */
-        for (i = 0; i < (int)transval->max_mfvs; i++) {
-            if ((i == (int)transval->next_mfv)) {
-                /* room for new */
-                transblob = mfv_transval_append(transblob, newdatum);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            else if (transval->mfvs[i].cnt < tmpcnt) {
-                /* arg beats this mfv */
-                transblob = mfv_transval_replace(transblob, newdatum, i);
-                transval = (mfvtransval *)VARDATA(transblob);
-                transval->mfvs[i].cnt = tmpcnt;
-                break;
-            }
-            /* else this is not a frequent value */
-        }
+        /* evict the smallest counter, which is at the top of the heap */
+        uint32 slot = MFV_HEAP(transval)[0];
+        uint64 mincnt = transval->mfvs[slot].cnt;
+
+        transblob = mfv_transval_replace(transblob, slot, valp, len, hash);
+        transval = (mfvtransval *)VARDATA(transblob);
+        transval->mfvs[slot].cnt = mincnt + weight;
+        transval->mfvs[slot].err = mincnt;
+        mfv_heap_down(transval, 0);
     }
-    PG_RETURN_DATUM(PointerGetDatum(transblob));
+    return(transblob);
 }
 
 /*!
- * look to see if the mfvsketch currently has <c>val</c>
- * stored as one of its most-frequent values.
- * Returns the offset in the <c>mfvs</c> array, or -1
+ * look to see if the mfvsketch currently has a counter for the value
+ * Returns the slot in the <c>mfvs</c> array, or -1
  * if not found.
  * NOTE: a 0 return value means the item <i>was found</i>
- * at offset 0!
+ * at slot 0!
  * \param blob a bytea holding an mfv transval
- * \param val the datum to search for
+ * \param valp the bytes of the value to search for
+ * \param len the number of bytes
+ * \param hash the hash of the value, from mfv_hash
  */
-int mfv_find(bytea *blob, Datum val)
+int mfv_find(bytea *blob, const void *valp, size_t len, uint32 hash)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(blob);
-    unsigned     i;
-    uint32       len;
-    void *       datp;
-    Datum        iDat;
-    void        *valp = DatumExtractPointer(val, transval->typByVal);
-
-    /* look for existing entry for this value */
-    for (i = 0; i < transval->next_mfv; i++) {
-        /* if they're the same */
-        datp = mfv_transval_getval(blob,i);
-        iDat = PointerExtractDatum(datp, transval->typByVal);
-
-        if ((len = ExtractDatumLen(iDat, transval->typLen, transval->typByVal))
-            == ExtractDatumLen(val, transval->typLen, transval->typByVal)) {
-            if (!memcmp(datp, valp, len))
-                /* arg is an mfv */
-                return(i);
-        }
+    int32 *      index = MFV_INDEX(transval);
+    uint32       mask = transval->indexsize - 1;
+    uint32       pos;
+    int32        i;
+
+    for (pos = hash & mask; (i = index[pos]) >= 0; pos = (pos + 1) & mask) {
+        offsetcnt *mfv = &transval->mfvs[i];
+
+        if (mfv->hash == hash
+            && mfv_equal(transval, ((char *)transval) + mfv->offset,
+                         mfv->len, valp, len))
+            return(i);
     }
     return(-1);
 }
@@ -165,32 +222,53 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
 {
     int          initial_size;
     bool         typIsVarLen;
+    int16        typLen;
+    bool         typByVal;
+    unsigned     nslots, indexsize;
     bytea *      transblob;
     mfvtransval *transval;
 
+    if (max_mfvs < 1 || max_mfvs > MFV_MAX_MFVS)
+        elog(ERROR, "number of buckets must be between 1 and %d",
+             MFV_MAX_MFVS);
+
+    get_typlenbyval(typOid, &typLen, &typByVal);
+
+    nslots = Max(max_mfvs*MFV_SLOTS_PER_MFV, MFV_MIN_SLOTS);
+    /* keep the index at most half full, so that probe sequences are short */
+    for (indexsize = 1; indexsize < 2*nslots; indexsize <<= 1)
+        ;
+
     /*
      * initialize mfvtransval, using palloc0 to zero it out.
      * if typlen is positive (fixed), size chosen accurately.
-     * Else we'll do a conservative estimate of 16 bytes, and repalloc as needed.
+     * Else we'll do a conservative estimate of 16 bytes, and grow as needed.
      */
-    if ((initial_size = get_typlen(typOid)) > 0)
-        initial_size *= max_mfvs*get_typlen(typOid);
+    if (typLen > 0)
+        initial_size = nslots*MAXALIGN(typLen);
     else /* guess */
-        initial_size = max_mfvs*16;
+        initial_size = nslots*16;
 
-    transblob = (bytea *)palloc0(MFV_TRANSVAL_SZ(max_mfvs) + initial_size);
+    transblob = (bytea *)palloc0(MFV_TRANSVAL_SZ(nslots, indexsize)
+                                 + initial_size);
 
-    SET_VARSIZE(transblob, MFV_TRANSVAL_SZ(max_mfvs) + initial_size);
+    SET_VARSIZE(transblob, MFV_TRANSVAL_SZ(nslots, indexsize) + initial_size);
     transval = (mfvtransval *)VARDATA(transblob);
+    transval->magic = MFV_MAGIC;
+    transval->version = MFV_VERSION;
     transval->max_mfvs = max_mfvs;
+    transval->nslots = nslots;
+    transval->indexsize = indexsize;
     transval->next_mfv = 0;
-    transval->next_offset = MFV_TRANSVAL_SZ(max_mfvs)-VARHDRSZ;
+    transval->next_offset = MFV_VALUES_START(transval);
     transval->typOid = typOid;
+    transval->hashkind = SKETCH_HASH_DEFAULT;
+    memset(MFV_INDEX(transval), -1, indexsize*sizeof(int32));
     getTypeOutputInfo(transval->typOid,
                       &(transval->outFuncOid),
                       &(typIsVarLen));
-    transval->typLen = get_typlen(transval->typOid);
-    transval->typByVal = get_typbyval(transval->typOid);
+    transval->typLen = typLen;
+    transval->typByVal = typByVal;
     if (!transval->outFuncOid) {
         /* no outFunc for this type! */
         elog(ERROR, "no outFunc for type %d", transval->typOid);
@@ -198,161 +276,347 @@ bytea *mfv_init_transval(int max_mfvs, Oid typOid)
     return(transblob);
 }
 
-/*! 
+/*!
+ * \param blob a bytea holding an mfv transval
+ * \param mfv a slot of the transval, or a copy of one
+ * \returns pointer to the value held by the slot
+ */
+static void *mfv_slot_value(bytea *blob, offsetcnt *mfv)
+{
+    mfvtransval *tvp = (mfvtransval *)VARDATA(blob);
+
+    if (mfv->offset > VARSIZE(blob) - VARHDRSZ
+        || mfv->offset < MFV_VALUES_START(tvp))
+        elog(ERROR, "illegal offset %u in mfv sketch", mfv->offset);
+    if (mfv->offset + mfv->len > VARSIZE(blob) - VARHDRSZ)
+        elog(ERROR, "value overruns size of mfv sketch");
+
+    return ((void *)(((char*)tvp) + mfv->offset));
+}
+
+/*!
  * \param blob a bytea holding an mfv transval
  * \param i index of the mfv to look up
- * \returns pointer to the datum associated with the i'th mfv 
+ * \returns pointer to the datum associated with the i'th mfv
  */
 void *mfv_transval_getval(bytea *blob, uint32 i)
 {
     mfvtransval *tvp = (mfvtransval *)VARDATA(blob);
-    void *       retval = (void *)(((char*)tvp) + tvp->mfvs[i].offset);
-    Datum        dat = PointerExtractDatum(retval, tvp->typByVal);
 
-    if (i > tvp->next_mfv || i < 0)
+    if (i >= tvp->next_mfv)
         elog(ERROR,
-             "attempt to get frequent value at illegal index %d in mfv sketch",
+             "attempt to get frequent value at illegal index %u in mfv sketch",
              i);
-    if (tvp->mfvs[i].offset > VARSIZE(blob) - VARHDRSZ
-        || tvp->mfvs[i].offset < MFV_TRANSVAL_SZ(tvp->max_mfvs)-VARHDRSZ)
-        elog(ERROR, "illegal offset %u in mfv sketch", tvp->mfvs[i].offset);
-    if (tvp->mfvs[i].offset  + ExtractDatumLen(dat, tvp->typLen, tvp->typByVal)
-        > VARSIZE(blob) - VARHDRSZ)
-        elog(ERROR, "value overruns size of mfv sketch");
-
-    return (retval);
+    return (mfv_slot_value(blob, &tvp->mfvs[i]));
 }
 
 /*!
- * copy datum <c>dat</c> into the offset of position <c>index</c> of
- * the mfv sketch stored in <c>transblob</c>.
+ * copy a value into the storage of slot <c>i</c> of the mfv sketch.
  *
- * <i>Caller beware: this helper return assumes that 
- * <c>dat</c> is small enough to fit in the storage
- * currently used by the datum at position <c>index</c>.</i>
+ * The value overwrites the old one if it fits in the old one's storage.
+ * Otherwise it goes at next_offset, and the old storage becomes garbage.
+ * When the sketch runs out of room, the values are compacted into a new
+ * sketch, which doubles in size if they would fill more than half of it;
+ * so the copying costs O(1) amortized per byte stored.
  *
- * \param transblob a bytea holding and mfv transval
- * \param index the index of the destination for copying
- * \param dat the datum to be copied into the transval
+ * \param transblob the transition value packed into a bytea
+ * \param i the slot to store into
+ * \param valp the bytes of the value
+ * \param len the number of bytes
  */
-void mfv_copy_datum(bytea *transblob, int index, Datum dat)
+static bytea *mfv_store_value(bytea *transblob, uint32 i, const void *valp,
+                              size_t len)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
-    size_t       datumLen = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
-    void *       curval = mfv_transval_getval(transblob,index);
+    offsetcnt *  mfv = &transval->mfvs[i];
+    size_t       need = MAXALIGN(len);
+
+    if (mfv->len > 0 && need <= MAXALIGN(mfv->len)) {
+        transval->garbage += MAXALIGN(mfv->len) - need;
+        memcpy(((char *)transval) + mfv->offset, valp, len);
+        mfv->len = len;
+        return(transblob);
+    }
+
+    transval->garbage += MAXALIGN(mfv->len);
+    mfv->len = 0;
+    if (MFV_TRANSVAL_CAPACITY(transblob) < need) {
+        size_t start = MFV_VALUES_START(transval);
+        size_t room = VARSIZE(transblob) - VARHDRSZ - start;
+        size_t live = transval->next_offset - start - transval->garbage;
+
+        if (2*(live + need) > room)
+            room = 2*(live + need);
+        transblob = mfv_repack(transblob, room);
+        transval = (mfvtransval *)VARDATA(transblob);
+        mfv = &transval->mfvs[i];
+    }
+    mfv->offset = transval->next_offset;
+    mfv->len = len;
+    memcpy(((char *)transval) + mfv->offset, valp, len);
+    transval->next_offset += need;
 
-    memmove(curval, (void *)DatumExtractPointer(dat, transval->typByVal), datumLen);
+    return(transblob);
 }
 
 /*!
- * insert a value at position i of the mfv sketch
- *
- * we do not overwrite the previous value at position i.
- * instead we place the new value at the next_offset. 
- * 
- * <i>Note: we do not currently garbage collection the old value's storage.
- * This wastes space, with the worst-case scenario being a column with values
- * of increasing size and frequency!</i>
- *
+ * copy an mfv sketch into a new one with <c>room</c> bytes for values,
+ * packing the values in use together
  * \param transblob the transition value packed into a bytea
- * \param dat the value to be inserted
- * \param i the position to insert at
+ * \param room the bytes for values in the copy; at least those in use
  */
-bytea *mfv_transval_insert_at(bytea *transblob, Datum dat, uint32 i)
+static bytea *mfv_repack(bytea *transblob, size_t room)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    size_t       start = MFV_VALUES_START(transval);
+    size_t       offset = start;
     bytea *      tmpblob;
-    size_t       datumLen = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
-
-    if (i > transval->next_mfv || i < 0)
-        elog(
-            ERROR,
-            "attempt to insert frequent value at illegal index %d in mfv sketch",
-            i);
-    if (MFV_TRANSVAL_CAPACITY(transblob) < datumLen) {
-        /* allocate a copy with room for this, and double the current space for values */
-        size_t curspace = VARSIZE(transblob) - transval->mfvs[0].offset -
-                          VARHDRSZ;
-        tmpblob = (bytea *)palloc0(VARSIZE(transblob) + curspace + datumLen);
-        memmove(tmpblob, transblob, VARSIZE(transblob));
-        SET_VARSIZE(tmpblob, VARSIZE(transblob) + curspace + datumLen);
-        /*
-         * PG won't let us pfree the old transblob
-         * pfree(transblob);
-         */
-        transblob = tmpblob;
-        transval = (mfvtransval *)VARDATA(transblob);
+    mfvtransval *tmpval;
+    uint32       j;
+
+    if (VARHDRSZ + start + room > MaxAllocSize)
+        elog(ERROR, "mfv sketch too large");
+
+    /*
+     * PG won't let us pfree the old transblob, so we copy out of it
+     */
+    tmpblob = (bytea *)palloc0(VARHDRSZ + start + room);
+    memcpy(tmpblob, transblob, VARHDRSZ + start);
+    SET_VARSIZE(tmpblob, VARHDRSZ + start + room);
+    tmpval = (mfvtransval *)VARDATA(tmpblob);
+    for (j = 0; j < tmpval->next_mfv; j++) {
+        if (tmpval->mfvs[j].len == 0)
+            continue;
+        memcpy(((char *)tmpval) + offset,
+               ((char *)transval) + tmpval->mfvs[j].offset,
+               tmpval->mfvs[j].len);
+        tmpval->mfvs[j].offset = offset;
+        offset += MAXALIGN(tmpval->mfvs[j].len);
     }
-    transval->mfvs[i].offset = transval->next_offset;
-    mfv_copy_datum(transblob, i, dat);
+    tmpval->next_offset = offset;
+    tmpval->garbage = 0;
+    return(tmpblob);
+}
 
-    transval->next_offset += datumLen;
+/*!
+ * a copy of an mfv sketch with no spare room or garbage among its values,
+ * i.e. in its stored form
+ */
+bytea *mfv_compacted(bytea *transblob)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
 
-    return(transblob);
+    return(mfv_repack(transblob,
+                      transval->next_offset - MFV_VALUES_START(transval)
+                      - transval->garbage));
 }
 
 /*!
- * insert a value into the mfvsketch
+ * check that a bytea holds a transval or the output of the mfvsketch
+ * aggregate, and return the transval
+ */
+mfvtransval *mfv_check(bytea *blob)
+{
+    mfvtransval *transval = (mfvtransval *)VARDATA(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(mfvtransval)
+        || transval->magic != MFV_MAGIC || transval->version != MFV_VERSION)
+        elog(ERROR, "not an MFV sketch");
+    if (transval->max_mfvs < 1 || transval->max_mfvs > MFV_MAX_MFVS
+        || transval->nslots != Max(transval->max_mfvs*MFV_SLOTS_PER_MFV,
+                                   MFV_MIN_SLOTS)
+        || transval->indexsize < 2*transval->nslots
+        || (transval->indexsize & (transval->indexsize - 1)) != 0
+        || transval->next_mfv > transval->nslots
+        || VARSIZE(blob) < MFV_TRANSVAL_SZ(transval->nslots,
+                                           transval->indexsize)
+        || transval->next_offset < MFV_VALUES_START(transval)
+        || transval->next_offset > VARSIZE(blob) - VARHDRSZ)
+        elog(ERROR, "corrupt MFV sketch");
+    return(transval);
+}
+
+/*!
+ * add a counter for a new value to the mfvsketch, which must have a
+ * free slot
  * \param transblob the transition value packed into a bytea
- * \param dat the value to be inserted
+ * \param valp the bytes of the value
+ * \param len the number of bytes
+ * \param hash the hash of the value, from mfv_hash
+ * \param cnt the initial count
+ * \param err the maximum overestimate in cnt
  */
-bytea *mfv_transval_append(bytea *transblob, Datum dat)
+bytea *mfv_transval_insert(bytea *transblob, const void *valp, size_t len,
+                           uint32 hash, uint64 cnt, uint64 err)
 {
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
-    bytea *      retval;
+    uint32       i = transval->next_mfv;
 
-    if (transval->next_mfv == transval->max_mfvs) {
+    if (i == transval->nslots) {
         elog(ERROR, "attempt to append to a full mfv sketch");
     }
-    retval = mfv_transval_insert_at(transblob,
-                                    dat,
-                                    transval->next_mfv);
-    (((mfvtransval *)VARDATA(retval))->next_mfv)++;
+    transblob = mfv_store_value(transblob, i, valp, len);
+    transval = (mfvtransval *)VARDATA(transblob);
+    transval->next_mfv++;
+    transval->mfvs[i].hash = hash;
+    transval->mfvs[i].cnt = cnt;
+    transval->mfvs[i].err = err;
+    transval->mfvs[i].heappos = i;
+    MFV_HEAP(transval)[i] = i;
+    mfv_heap_up(transval, i);
+    mfv_index_insert(transval, i);
 
-    return(retval);
+    return(transblob);
 }
 
 /*!
- * replace the value at position i of the mfvsketch with dat
+ * replace the value in slot i of the mfvsketch, leaving its count for
+ * the caller to set
  *
  * \param transblob the transition value packed into a bytea
- * \param dat the value to be inserted
- * \param i the position to replace
+ * \param i the slot to replace
+ * \param valp the bytes of the new value
+ * \param len the number of bytes
+ * \param hash the hash of the new value, from mfv_hash
  */
-bytea *mfv_transval_replace(bytea *transblob, Datum dat, int i)
+bytea *mfv_transval_replace(bytea *transblob, uint32 i, const void *valp,
+                            size_t len, uint32 hash)
 {
-    /*
-     * if new value is smaller than old, we overwrite at the old offset.
-     * otherwise we call mfv_transval_insert_at which will take care of
-     * space allocation for the new value
-     */
     mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
-    size_t       datumLen = ExtractDatumLen(dat, transval->typLen, transval->typByVal);
-    void *       tmpp = mfv_transval_getval(transblob,i);
-    Datum        oldDat = PointerExtractDatum(tmpp, transval->typByVal);
-    size_t       oldLen = ExtractDatumLen(oldDat, transval->typLen, transval->typByVal);
-
-    if (datumLen <= oldLen) {
-        mfv_copy_datum(transblob, i, dat);
-        return transblob;
+
+    mfv_index_delete(transval, i);
+    transblob = mfv_store_value(transblob, i, valp, len);
+    transval = (mfvtransval *)VARDATA(transblob);
+    transval->mfvs[i].hash = hash;
+    mfv_index_insert(transval, i);
+
+    return(transblob);
+}
+
+/*!
+ * add slot i to the hash index, by linear probing from its hash
+ */
+static void mfv_index_insert(mfvtransval *transval, uint32 i)
+{
+    int32 *index = MFV_INDEX(transval);
+    uint32 mask = transval->indexsize - 1;
+    uint32 pos;
+
+    for (pos = transval->mfvs[i].hash & mask; index[pos] >= 0;
+         pos = (pos + 1) & mask)
+        ;
+    index[pos] = i;
+}
+
+/*!
+ * remove slot i from the hash index.  Rather than leave a tombstone,
+ * later entries of the probe sequence are shifted back into the hole,
+ * so lookups never probe past entries that are gone.
+ */
+static void mfv_index_delete(mfvtransval *transval, uint32 i)
+{
+    int32 *index = MFV_INDEX(transval);
+    uint32 mask = transval->indexsize - 1;
+    uint32 pos, next, home;
+
+    for (pos = transval->mfvs[i].hash & mask; index[pos] != (int32)i;
+         pos = (pos + 1) & mask)
+        if (index[pos] < 0)
+            elog(ERROR, "mfv sketch index is missing slot %u", i);
+
+    for (;;) {
+        index[pos] = -1;
+        next = pos;
+        do {
+            next = (next + 1) & mask;
+            if (index[next] < 0)
+                return;
+            home = transval->mfvs[index[next]].hash & mask;
+            /* the entry can't move to pos if its home lies in (pos, next] */
+        } while (next > pos ? (home > pos && home <= next)
+                            : (home > pos || home <= next));
+        index[pos] = index[next];
+        pos = next;
+    }
+}
+
+/*! swap two entries of the heap, keeping the slots' heap positions */
+#define MFV_HEAP_SWAP(tv, heap, a, b) do { \
+        uint32 tmp_ = (heap)[a]; \
+        (heap)[a] = (heap)[b]; \
+        (heap)[b] = tmp_; \
+        (tv)->mfvs[(heap)[a]].heappos = (a); \
+        (tv)->mfvs[(heap)[b]].heappos = (b); \
+    } while (0)
+
+/*!
+ * restore the heap order after the count at heap position pos grew
+ */
+static void mfv_heap_down(mfvtransval *transval, uint32 pos)
+{
+    uint32 *heap = MFV_HEAP(transval);
+    uint32  n = transval->next_mfv;
+
+    for (;;) {
+        uint32 child = 2*pos + 1;
+
+        if (child >= n)
+            break;
+        if (child + 1 < n && transval->mfvs[heap[child + 1]].cnt
+                             < transval->mfvs[heap[child]].cnt)
+            child++;
+        if (transval->mfvs[heap[pos]].cnt <= transval->mfvs[heap[child]].cnt)
+            break;
+        MFV_HEAP_SWAP(transval, heap, pos, child);
+        pos = child;
+    }
+}
+
+/*!
+ * restore the heap order after adding a count at heap position pos
+ */
+static void mfv_heap_up(mfvtransval *transval, uint32 pos)
+{
+    uint32 *heap = MFV_HEAP(transval);
+
+    while (pos > 0) {
+        uint32 parent = (pos - 1)/2;
+
+        if (transval->mfvs[heap[parent]].cnt <= transval->mfvs[heap[pos]].cnt)
+            break;
+        MFV_HEAP_SWAP(transval, heap, pos, parent);
+        pos = parent;
     }
-    else return(mfv_transval_insert_at(transblob, dat, i));
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_sketch_final);
+/*!
+ * UDA final function for the mfvsketch aggregates: the sketch in its
+ * stored form, or NULL if there were no rows
+ */
+Datum __mfvsketch_sketch_final(PG_FUNCTION_ARGS)
+{
+    bytea *transblob = PG_GETARG_BYTEA_P(0);
+
+    if (!MFV_TRANSVAL_INITIALIZED(transblob)) PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(mfv_compacted(transblob));
 }
 
 PG_FUNCTION_INFO_V1(__mfvsketch_final);
 /*!
  * scalar function taking an mfv sketch, returning a histogram of
- * its most frequent values
+ * its most frequent values.  Also takes stored sketches, as
+ * mfvsketch_histogram.
  */
 Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 {
     bytea *      transblob = PG_GETARG_BYTEA_P(0);
-    mfvtransval *transval = (mfvtransval *)VARDATA(transblob);
+    mfvtransval *transval;
     ArrayType *  retval;
-    uint32       i;
-    Datum        histo[transval->max_mfvs][2];
+    offsetcnt *  mfvs;
+    uint32       i, nmfvs;
+    Datum *      histo;
     int          dims[2], lbs[2];
-    /* Oid     typInput, typIOParam; */
     Oid          outFuncOid;
     bool         typIsVarlena;
     int16        typlen;
@@ -364,25 +628,30 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
 
 
     if (PG_ARGISNULL(0)) PG_RETURN_NULL();
-    if (VARSIZE(transblob) < MFV_TRANSVAL_SZ(0)) PG_RETURN_NULL();
+    if (!MFV_TRANSVAL_INITIALIZED(transblob)) PG_RETURN_NULL();
 
-    transval = (mfvtransval *)VARDATA(transblob);
+    transval = mfv_check(transblob);
 
-    qsort(transval->mfvs, transval->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
+    /* sort a copy of the counters, so the heap stays intact */
+    mfvs = (offsetcnt *)palloc(Max(transval->next_mfv, 1)*sizeof(offsetcnt));
+    memcpy(mfvs, transval->mfvs, transval->next_mfv*sizeof(offsetcnt));
+    qsort(mfvs, transval->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
+    nmfvs = Min(transval->next_mfv, transval->max_mfvs);
+    histo = (Datum *)palloc(Max(nmfvs, 1)*2*sizeof(Datum));
     getTypeOutputInfo(INT8OID,
                       &outFuncOid,
                       &typIsVarlena);
 
-    for (i = 0; i < transval->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob,i);
+    for (i = 0; i < nmfvs; i++) {
+        void *tmpp = mfv_slot_value(transblob, &mfvs[i]);
         Datum curval = PointerExtractDatum(tmpp, transval->typByVal);
         char *countbuf =
             OidOutputFunctionCall(outFuncOid,
-                                  Int64GetDatum(transval->mfvs[i].cnt));
+                                  Int64GetDatum(mfvs[i].cnt));
         char *valbuf = OidOutputFunctionCall(transval->outFuncOid, curval);
-        
-        histo[i][0] = PointerGetDatum(cstring_to_text(valbuf));
-        histo[i][1] = PointerGetDatum(cstring_to_text(countbuf));
+
+        histo[2*i] = PointerGetDatum(cstring_to_text(valbuf));
+        histo[2*i + 1] = PointerGetDatum(cstring_to_text(countbuf));
         pfree(countbuf);
         pfree(valbuf);
     }
@@ -398,7 +667,7 @@ Datum __mfvsketch_final(PG_FUNCTION_ARGS)
     dims[0] = i;
     dims[1] = 2;
     lbs[0] = lbs[1] = 0;
-    retval = construct_md_array((Datum *)histo,
+    retval = construct_md_array(histo,
                                 NULL,
                                 2,
                                 dims,
@@ -422,13 +691,27 @@ int cnt_cmp_desc(const void *i, const void *j)
     offsetcnt *o = (offsetcnt *)i;
     offsetcnt *p = (offsetcnt *)j;
 
-    return (p->cnt - o->cnt);
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
+}
+
+/*!
+ * support function to sort merge candidates by count
+ * \param i an mfvmerge object cast to a (void *)
+ * \param j an mfvmerge object cast to a (void *)
+ */
+static int mfvmerge_cmp_desc(const void *i, const void *j)
+{
+    mfvmerge *o = (mfvmerge *)i;
+    mfvmerge *p = (mfvmerge *)j;
+
+    return (p->cnt > o->cnt) - (p->cnt < o->cnt);
 }
 
 
 /*!
  * Greenplum "prefunc" to combine sketches from multiple machines.
- * See notes at top of file regarding the heuristic nature of this approach.
+ * Also the transition function of mfvsketch_merge, over stored sketches.
+ * See notes at top of file regarding the merge.
  */
 PG_FUNCTION_INFO_V1(__mfvsketch_merge);
 Datum __mfvsketch_merge(PG_FUNCTION_ARGS)
@@ -436,15 +719,20 @@ Datum __mfvsketch_merge(PG_FUNCTION_ARGS)
     bytea * transblob1 = (bytea *)PG_GETARG_BYTEA_P(0);
     bytea * transblob2 = (bytea *)PG_GETARG_BYTEA_P(1);
 
+    if (MFV_TRANSVAL_INITIALIZED(transblob1))
+        mfv_check(transblob1);
+    if (MFV_TRANSVAL_INITIALIZED(transblob2))
+        mfv_check(transblob2);
     PG_RETURN_DATUM(PointerGetDatum(mfvsketch_merge_c(transblob1, transblob2)));
 }
 
 /*!
- * implementation of the merge of two mfv sketches.  we
- * first merge the embedded countmin sketches to get the
- * sums of the counts, and then use those sums to pick the
- * top values for the resulting histogram.  We overwrite
- * the first argument and return it.
+ * implementation of the merge of two mfv sketches.  Each value counted
+ * by either sketch gets its count in that sketch plus its count in the
+ * other, or if the other sketch has no counter for it, the smallest count
+ * there; that is the most the value can have occurred there unseen.
+ * The largest combined counts make up a new sketch of the same size, which
+ * is returned.
  * \param transblob1 an mfv transval stored inside a bytea
  * \param transblob2 another mfv transval in a bytea
  */
@@ -452,70 +740,78 @@ bytea *mfvsketch_merge_c(bytea *transblob1, bytea *transblob2)
 {
     mfvtransval *transval1 = (mfvtransval *)VARDATA(transblob1);
     mfvtransval *transval2 = (mfvtransval *)VARDATA(transblob2);
-    uint32       i, j;
+    mfvtransval *transval;
+    bytea *      transblob;
+    mfvmerge *   cands;
+    uint64       min1 = 0, min2 = 0;
+    uint32       i, ncands = 0;
 
     /* handle uninitialized args */
-    if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))
-        && VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0)))
+    if (!MFV_TRANSVAL_INITIALIZED(transblob2))
         return(transblob1);
-    else if (VARSIZE(transblob1) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob1 = mfv_init_transval(transval2->max_mfvs, transval2->typOid);
-        transval1 = (mfvtransval *)VARDATA(transblob1);
+    else if (!MFV_TRANSVAL_INITIALIZED(transblob1)) {
+        transblob = (bytea *)palloc(VARSIZE(transblob2));
+        memcpy(transblob, transblob2, VARSIZE(transblob2));
+        return(transblob);
     }
-    else if (VARSIZE(transblob2) <= sizeof(MFV_TRANSVAL_SZ(0))) {
-        transblob2 = mfv_init_transval(transval1->max_mfvs, transval1->typOid);
-        transval2 = (mfvtransval *)VARDATA(transblob2);
-    }
-
-    /* combine sketches */
-    for (i = 0; i < DEPTH; i++)
-        for (j = 0; j < NUMCOUNTERS; j++)
-            transval1->sketch[i][j] += transval2->sketch[i][j];
 
-    /* recompute the counts using the merged sketch */
+    if (transval1->hashkind != transval2->hashkind)
+        elog(ERROR,
+             "cannot merge MFV sketches built with different hash functions");
+    if (transval1->typOid != transval2->typOid)
+        elog(ERROR, "cannot merge MFV sketches of different types");
+    /*
+     * a bigger result could keep free slots after dropping values, and a
+     * sketch with a free slot is taken to have exact counts
+     */
+    if (transval1->max_mfvs != transval2->max_mfvs)
+        elog(ERROR, "cannot merge MFV sketches of different sizes (%d and %d)",
+             transval1->max_mfvs, transval2->max_mfvs);
+
+    /* a sketch with a free slot has seen every value it hasn't counted */
+    if (transval1->next_mfv == transval1->nslots)
+        min1 = transval1->mfvs[MFV_HEAP(transval1)[0]].cnt;
+    if (transval2->next_mfv == transval2->nslots)
+        min2 = transval2->mfvs[MFV_HEAP(transval2)[0]].cnt;
+
+    cands = (mfvmerge *)palloc(Max(transval1->next_mfv + transval2->next_mfv, 1)
+                               * sizeof(mfvmerge));
     for (i = 0; i < transval1->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob1,i);
-        Datum dat = PointerExtractDatum(tmpp, transval1->typByVal);
-
-        transval1->mfvs[i].cnt = cmsketch_count_c(transval1->sketch,
-                                                  dat,
-                                                  transval1->outFuncOid,
-                                                  transval1->typOid);
+        offsetcnt *mfv = &transval1->mfvs[i];
+        int        j = mfv_find(transblob2, mfv_slot_value(transblob1, mfv),
+                                mfv->len, mfv->hash);
+
+        cands[ncands].cnt = mfv->cnt + (j > -1 ? transval2->mfvs[j].cnt : min2);
+        cands[ncands].err = mfv->err + (j > -1 ? transval2->mfvs[j].err : min2);
+        cands[ncands].blob = transblob1;
+        cands[ncands++].slot = i;
     }
     for (i = 0; i < transval2->next_mfv; i++) {
-        void *tmpp = mfv_transval_getval(transblob2,i);
-        Datum dat = PointerExtractDatum(tmpp, transval2->typByVal);
-
-        transval2->mfvs[i].cnt = cmsketch_count_c(transval2->sketch,
-                                                  dat,
-                                                  transval2->outFuncOid,
-                                                  transval2->typOid);
+        offsetcnt *mfv = &transval2->mfvs[i];
+
+        if (mfv_find(transblob1, mfv_slot_value(transblob2, mfv),
+                     mfv->len, mfv->hash) > -1)
+            continue;
+        cands[ncands].cnt = mfv->cnt + min1;
+        cands[ncands].err = mfv->err + min1;
+        cands[ncands].blob = transblob2;
+        cands[ncands++].slot = i;
     }
+    qsort(cands, ncands, sizeof(mfvmerge), mfvmerge_cmp_desc);
 
-    /* now take maxes on mfvs in a sort-merge style, copying into transval1  */
-    qsort(transval1->mfvs, transval1->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-    qsort(transval2->mfvs, transval2->next_mfv, sizeof(offsetcnt), cnt_cmp_desc);
-
-    /* scan through transval1, replace as we find bigger things in transval2 */
-    for (i = j = 0;
-         j < transval2->next_mfv && i < transval1->max_mfvs;
-         i++) {
-        void *tmpp = mfv_transval_getval(transblob2, j);
-        Datum jDatum = PointerExtractDatum(tmpp, transval2->typByVal);
-
-        if (i == transval1->next_mfv && (mfv_find(transblob1, jDatum) == -1)
-            /* && i < transval1->max_mfvs from for loop */) {
-            transblob1 = mfv_transval_append(transblob1, jDatum);
-            transval1 = (mfvtransval *)VARDATA(transblob1);
-            j++;
-        }
-        else if (transval1->mfvs[i].cnt < transval2->mfvs[j].cnt
-                 && mfv_find(transblob1, jDatum) == -1) {
-            /* copy into transval1 and advance both  */
-            transblob1 = mfv_transval_replace(transblob1, jDatum, i);
-            transval1 = (mfvtransval *)VARDATA(transblob1);
-            j++;
-        }
+    transblob = mfv_init_transval(transval1->max_mfvs, transval1->typOid);
+    transval = (mfvtransval *)VARDATA(transblob);
+    transval->hashkind = transval1->hashkind;
+    for (i = 0; i < ncands && i < transval->nslots; i++) {
+        mfvtransval *src = (mfvtransval *)VARDATA(cands[i].blob);
+        offsetcnt *  mfv = &src->mfvs[cands[i].slot];
+
+        transblob = mfv_transval_insert(transblob,
+                                        mfv_slot_value(cands[i].blob, mfv),
+                                        mfv->len, mfv->hash,
+                                        cands[i].cnt, cands[i].err);
     }
-    return(transblob1);
+    pfree(cands);
+
+    return(transblob);
 }
@@ -297,32 +297,158 @@ bit_print(uint8 *c, int numbytes)
     elog(NOTICE, "bitmap: %s", p);
 }
 
+/*! rotate a 64-bit word left by r bits */
+static inline uint64 rotl64(uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/*! MurmurHash3 finalization mix: force all bits of the hash to avalanche */
+static inline uint64 fmix64(uint64 k)
+{
+    k ^= k >> 33;
+    k *= UINT64CONST(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
 /*!
- * Run the datum through an md5 hash.  No need to special-case variable-length types,
- * we'll just has their length header too.
- * The POSTGRES code for md5 returns a bytea with a textual representation of the
- * md5 result.  We then convert it back into binary.
+ * Austin Appleby's MurmurHash3 (x64_128 variant), a fast non-cryptographic
+ * 128-bit hash.  The two 64-bit halves of the result are written to out in
+ * native byte order.
+ * \param key the bytes to hash
+ * \param len the number of bytes
+ * \param seed the hash seed
+ * \param out a buffer of SKETCH_HASHLEN bytes to hold the result
+ */
+void sketch_murmur3_128(const void *key, size_t len, uint32 seed, uint8 *out)
+{
+    const uint8 *data = (const uint8 *)key;
+    size_t       nblocks = len / 16;
+    const uint8 *tail = data + nblocks*16;
+    uint64       h1 = seed;
+    uint64       h2 = seed;
+    uint64       c1 = UINT64CONST(0x87c37b91114253d5);
+    uint64       c2 = UINT64CONST(0x4cf5ad432745937f);
+    uint64       k1, k2;
+    size_t       i;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + i*16, sizeof(uint64));
+        memcpy(&k2, data + i*16 + 8, sizeof(uint64));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= ((uint64)tail[14]) << 48;
+        case 14: k2 ^= ((uint64)tail[13]) << 40;
+        case 13: k2 ^= ((uint64)tail[12]) << 32;
+        case 12: k2 ^= ((uint64)tail[11]) << 24;
+        case 11: k2 ^= ((uint64)tail[10]) << 16;
+        case 10: k2 ^= ((uint64)tail[9]) << 8;
+        case 9:  k2 ^= ((uint64)tail[8]);
+                 k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        case 8:  k1 ^= ((uint64)tail[7]) << 56;
+        case 7:  k1 ^= ((uint64)tail[6]) << 48;
+        case 6:  k1 ^= ((uint64)tail[5]) << 40;
+        case 5:  k1 ^= ((uint64)tail[4]) << 32;
+        case 4:  k1 ^= ((uint64)tail[3]) << 24;
+        case 3:  k1 ^= ((uint64)tail[2]) << 16;
+        case 2:  k1 ^= ((uint64)tail[1]) << 8;
+        case 1:  k1 ^= ((uint64)tail[0]);
+                 k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64)len;
+    h2 ^= (uint64)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    memcpy(out, &h1, sizeof(uint64));
+    memcpy(out + 8, &h2, sizeof(uint64));
+}
+
+/*!
+ * Hash the bytes of a datum into a caller-supplied buffer.  No need to
+ * special-case variable-length types, we'll just hash their length header too.
  * \param dat a Postgres Datum
- * \param typOid Postgres type Oid
- * \returns a bytea containing the hashed bytes
+ * \param typLen the length of the datum's type
+ * \param typByVal whether the datum's type is passed by value
+ * \param hashkind SKETCH_HASH_MD5 or SKETCH_HASH_MURMUR3
+ * \param out a buffer of SKETCH_HASHLEN bytes to hold the hash
  */
-bytea *sketch_md5_bytea(Datum dat, Oid typOid)
+void sketch_hash_datum(Datum dat, int16 typLen, bool typByVal, int hashkind,
+                       uint8 *out)
 {
-    // according to postgres' libpq/md5.c, need 33 bytes to hold 
-    // null-terminated md5 string
-    char outbuf[MD5_HASHLEN*2+1];
-    bytea *out = palloc0(MD5_HASHLEN+VARHDRSZ);    
-    bool byval = get_typbyval(typOid);
-    int len = ExtractDatumLen(dat, get_typlen(typOid), byval);
-    void *datp = DatumExtractPointer(dat, byval);
-        
-    pg_md5_hash(datp, len, outbuf);        
-    
-    hex_to_bytes(outbuf, (uint8 *)VARDATA(out), MD5_HASHLEN*2);
-    SET_VARSIZE(out, MD5_HASHLEN+VARHDRSZ);
-    return out;
+    sketch_hash_bytes(DatumExtractPointer(dat, typByVal),
+                      ExtractDatumLen(dat, typLen, typByVal), hashkind, out);
 }
 
+/*!
+ * Hash a value into a caller-supplied buffer, however it is represented.
+ * Unlike sketch_hash_datum(), a varlena value is detoasted and only its
+ * contents are hashed, so a value read from a table (with a short header,
+ * or compressed) hashes like the same value computed in a query.  Sketches
+ * whose values are compared across inputs or merged need this.
+ * \param dat a Postgres Datum
+ * \param typLen the length of the datum's type
+ * \param typByVal whether the datum's type is passed by value
+ * \param hashkind SKETCH_HASH_MD5 or SKETCH_HASH_MURMUR3
+ * \param out a buffer of SKETCH_HASHLEN bytes to hold the hash
+ */
+void sketch_hash_value(Datum dat, int16 typLen, bool typByVal, int hashkind,
+                       uint8 *out)
+{
+    if (typLen == -1) {
+        struct varlena *raw = (struct varlena *)DatumGetPointer(dat);
+        struct varlena *val = pg_detoast_datum_packed(raw);
+
+        sketch_hash_bytes(VARDATA_ANY(val), VARSIZE_ANY_EXHDR(val), hashkind,
+                          out);
+        if (val != raw)
+            pfree(val);
+    }
+    else
+        sketch_hash_datum(dat, typLen, typByVal, hashkind, out);
+}
+
+/*!
+ * Hash len bytes into a caller-supplied buffer.
+ * Sketches record the hashkind they were built with, so that sketches from
+ * before the switch to MurmurHash3 can still be read.
+ * \param datp the bytes to hash
+ * \param len the number of bytes
+ * \param hashkind SKETCH_HASH_MD5 or SKETCH_HASH_MURMUR3
+ * \param out a buffer of SKETCH_HASHLEN bytes to hold the hash
+ */
+void sketch_hash_bytes(const void *datp, size_t len, int hashkind, uint8 *out)
+{
+    if (hashkind == SKETCH_HASH_MURMUR3)
+        sketch_murmur3_128(datp, len, 0, out);
+    else if (hashkind == SKETCH_HASH_MD5) {
+        /*
+         * according to postgres' libpq/md5.c, need 33 bytes to hold
+         * null-terminated md5 string
+         */
+        char outbuf[MD5_HASHLEN*2+1];
+
+        pg_md5_hash((void *)datp, len, outbuf);
+        hex_to_bytes(outbuf, out, MD5_HASHLEN*2);
+    }
+    else
+        elog(ERROR, "unknown sketch hash function %d", hashkind);
+}
 
 /*  TEST ROUTINES */
 PG_FUNCTION_INFO_V1(sketch_array_set_bit_in_place);
@@ -331,6 +457,8 @@ PG_FUNCTION_INFO_V1(sketch_rightmost_one);
 Datum sketch_rightmost_one(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(sketch_leftmost_zero);
 Datum sketch_leftmost_zero(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(sketch_murmur3_bytea);
+Datum sketch_murmur3_bytea(PG_FUNCTION_ARGS);
 
 Datum sketch_rightmost_one(PG_FUNCTION_ARGS)
 {
@@ -354,6 +482,17 @@ Datum sketch_leftmost_zero(PG_FUNCTION_ARGS)
     return leftmost_zero((uint8 *)bits, len, sketchsz, sketchnum);
 }
 
+Datum sketch_murmur3_bytea(PG_FUNCTION_ARGS)
+{
+    bytea *in = (bytea *)PG_GETARG_BYTEA_P(0);
+    bytea *out = (bytea *)palloc(SKETCH_HASHLEN + VARHDRSZ);
+
+    sketch_murmur3_128(VARDATA(in), VARSIZE(in) - VARHDRSZ, 0,
+                       (uint8 *)VARDATA(out));
+    SET_VARSIZE(out, SKETCH_HASHLEN + VARHDRSZ);
+    PG_RETURN_BYTEA_P(out);
+}
+
 Datum sketch_array_set_bit_in_place(PG_FUNCTION_ARGS)
 {
 
@@ -9,6 +9,15 @@
 #define MD5_HASHLEN 16
 #define MD5_HASHLEN_BITS 8*MD5_HASHLEN /*! md5 hash length in bits */
 
+/*!
+ * Hash functions a sketch can be built with.  Both produce SKETCH_HASHLEN
+ * bytes; each sketch records which one it used.
+ */
+#define SKETCH_HASH_MD5     0  /*! md5, used by sketches before versioning */
+#define SKETCH_HASH_MURMUR3 1  /*! MurmurHash3 x64_128 */
+#define SKETCH_HASH_DEFAULT SKETCH_HASH_MURMUR3
+#define SKETCH_HASHLEN      MD5_HASHLEN
+
 #ifndef MAXINT8LEN
 #define MAXINT8LEN              25 /*! number of chars to hold an int8 */
 #endif
@@ -20,7 +29,10 @@ uint32 ui_rightmost_one(uint32 v);
 void   hex_to_bytes(char *hex, uint8 *bytes, size_t);
 void bit_print(uint8 *c, int numbytes);
 Datum md5_cstring(char *);
-bytea *sketch_md5_bytea(Datum, Oid);
+void   sketch_murmur3_128(const void *, size_t, uint32, uint8 *);
+void   sketch_hash_datum(Datum, int16, bool, int, uint8 *);
+void   sketch_hash_value(Datum, int16, bool, int, uint8 *);
+void   sketch_hash_bytes(const void *, size_t, int, uint8 *);
 int4   safe_log2(int64);
 void   int64_big_endianize(uint64 *, uint32, bool);
 
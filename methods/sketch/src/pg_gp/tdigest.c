@@ -0,0 +1,630 @@
+/*!
+ * \file tdigest.c
+ *
+ * \brief t-digest sketch implementation for quantiles
+ */
+/*!
+ * \implementation
+ * A t-digest summarizes a distribution by a sorted list of centroids, each
+ * a mean and the number of values it stands for.  A scale function limits
+ * the weight of a centroid according to where it lies in the distribution:
+ * with the scale function k(q) = c/(2 pi) asin(2q - 1), where c is the
+ * compression, a centroid may only span one unit of k.  So centroids near
+ * the median hold about N/c values, and those in the tails far fewer, which
+ * makes extreme quantiles especially accurate.  A digest never has more
+ * than about c centroids.
+ *
+ * This is the "merging" variant of Dunning and Ertl: values are appended to
+ * a buffer, and when the buffer is full it is sorted and merged into the
+ * centroids in one sweep.  Two digests merge the same way, so sketches from
+ * different segments or different groups can be combined.
+ *
+ * Quantiles and CDF values are read off the piecewise-linear function
+ * through (min, 0), (mean_i, weight before centroid i + half its weight)
+ * and (max, N).
+ *
+ * The sketch is stored as a bytea in the same layout as the transition
+ * value, with an empty buffer, so it can be kept in tables and merged later
+ * with tdigest_union.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "catalog/pg_type.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define TD_MAGIC               0x54474454 /* "TDGT" */
+#define TD_VERSION             1
+#define TD_MIN_COMPRESSION     10
+#define TD_MAX_COMPRESSION     10000
+#define TD_DEFAULT_COMPRESSION 100
+/*! a merged digest has at most compression+1 centroids; leave slack */
+#define TD_MAX_CENTROIDS(c)    (2*(c))
+/*! values buffered between merges, per unit of compression */
+#define TD_BUFFER_FACTOR       5
+
+/*!
+ * \internal
+ * \brief a centroid: the mean of weight values
+ * \endinternal
+ */
+typedef struct {
+    float8 mean;
+    float8 weight;
+} tdcentroid;
+
+/*!
+ * \internal
+ * \brief a t-digest, as transition value and as stored value
+ *
+ * centroids holds ncentroids centroids sorted by mean, followed by
+ * nbuffered unsorted values of weight 1, with room for capacity in all.
+ * Stored sketches have no buffered values.
+ * \endinternal
+ */
+typedef struct {
+    uint32     magic;       /*! TD_MAGIC */
+    uint16     version;     /*! TD_VERSION */
+    uint16     compression; /*! bound on the number of centroids */
+    uint32     ncentroids;  /*! number of merged centroids */
+    uint32     nbuffered;   /*! number of unmerged values after them */
+    uint32     capacity;    /*! number of entries there is room for */
+    uint32     unused;      /*! padding, zero */
+    float8     count;       /*! total weight */
+    float8     min;         /*! smallest value */
+    float8     max;         /*! largest value */
+    tdcentroid centroids[0];
+} tdigest;
+
+#define TD_SKETCH(b)       ((tdigest *)VARDATA(b))
+#define TD_INITIALIZED(b)  (VARSIZE(b) > VARHDRSZ)
+#define TD_SZ(cap)         (VARHDRSZ + sizeof(tdigest) + \
+                            (size_t)(cap)*sizeof(tdcentroid))
+#define TD_CAPACITY(c)     (TD_MAX_CENTROIDS(c) + TD_BUFFER_FACTOR*(c))
+
+Datum __tdigest_trans(PG_FUNCTION_ARGS);
+Datum __tdigest_merge(PG_FUNCTION_ARGS);
+Datum __tdigest_final(PG_FUNCTION_ARGS);
+Datum tdigest_union(PG_FUNCTION_ARGS);
+Datum tdigest_quantile(PG_FUNCTION_ARGS);
+Datum tdigest_quantile_array(PG_FUNCTION_ARGS);
+Datum tdigest_cdf(PG_FUNCTION_ARGS);
+Datum tdigest_width_histogram(PG_FUNCTION_ARGS);
+Datum tdigest_depth_histogram(PG_FUNCTION_ARGS);
+bytea *tdigest_new(int);
+bytea *tdigest_insert(bytea *, float8);
+bytea *tdigest_merge_c(bytea *, bytea *);
+bytea *tdigest_compacted(bytea *);
+double tdigest_quantile_c(tdigest *, double);
+double tdigest_cdf_c(tdigest *, double);
+
+static void     tdigest_compress(tdigest *);
+static tdigest *tdigest_check(bytea *);
+
+/*! support function to sort centroids by mean */
+static int tdcentroid_cmp(const void *a, const void *b)
+{
+    float8 x = ((const tdcentroid *)a)->mean;
+    float8 y = ((const tdcentroid *)b)->mean;
+
+    return (x > y) - (x < y);
+}
+
+/*! the scale function k(q), for a digest of the given compression */
+static inline double tdigest_k(double q, int compression)
+{
+    return compression / (2*M_PI) * asin(2*q - 1);
+}
+
+/*! the inverse of the scale function */
+static inline double tdigest_k_inv(double k, int compression)
+{
+    if (k >= compression / 4.0)
+        return 1;
+    return (sin(k * (2*M_PI) / compression) + 1) / 2;
+}
+
+/*!
+ * a new, empty t-digest
+ * \param compression bound on the number of centroids
+ */
+bytea *tdigest_new(int compression)
+{
+    bytea *  blob;
+    tdigest *s;
+
+    if (compression < TD_MIN_COMPRESSION || compression > TD_MAX_COMPRESSION)
+        elog(ERROR, "t-digest compression must be between %d and %d",
+             TD_MIN_COMPRESSION, TD_MAX_COMPRESSION);
+
+    blob = (bytea *)palloc0(TD_SZ(TD_CAPACITY(compression)));
+    SET_VARSIZE(blob, TD_SZ(TD_CAPACITY(compression)));
+    s = TD_SKETCH(blob);
+    s->magic = TD_MAGIC;
+    s->version = TD_VERSION;
+    s->compression = compression;
+    s->capacity = TD_CAPACITY(compression);
+    s->min = get_float8_infinity();
+    s->max = -get_float8_infinity();
+    return blob;
+}
+
+/*!
+ * sort the buffered values, and merge them into the centroids in one sweep
+ * from the smallest mean to the largest.  Each centroid absorbs its
+ * successors for as long as it stays within one unit of the scale function.
+ */
+static void tdigest_compress(tdigest *s)
+{
+    uint32      n = s->ncentroids + s->nbuffered;
+    tdcentroid *sorted;
+    tdcentroid *c = s->centroids;
+    uint32      i, j, k, out;
+    double      before = 0, limit;
+
+    if (s->nbuffered == 0)
+        return;
+
+    /* sort the buffer, then merge it with the centroids */
+    qsort(c + s->ncentroids, s->nbuffered, sizeof(tdcentroid),
+          tdcentroid_cmp);
+    sorted = (tdcentroid *)palloc(n*sizeof(tdcentroid));
+    for (i = 0, j = s->ncentroids, k = 0; k < n; k++)
+        if (j == n || (i < s->ncentroids && c[i].mean <= c[j].mean))
+            sorted[k] = c[i++];
+        else
+            sorted[k] = c[j++];
+
+    out = 0;
+    c[0] = sorted[0];
+    limit = s->count * tdigest_k_inv(tdigest_k(0, s->compression) + 1,
+                                     s->compression);
+    for (k = 1; k < n; k++) {
+        if (before + c[out].weight + sorted[k].weight <= limit) {
+            c[out].weight += sorted[k].weight;
+            c[out].mean += (sorted[k].mean - c[out].mean)
+                           * sorted[k].weight / c[out].weight;
+        }
+        else {
+            before += c[out].weight;
+            limit = s->count
+                    * tdigest_k_inv(tdigest_k(before / s->count,
+                                              s->compression) + 1,
+                                    s->compression);
+            c[++out] = sorted[k];
+        }
+    }
+    s->ncentroids = out + 1;
+    s->nbuffered = 0;
+    pfree(sorted);
+}
+
+/*!
+ * add a value to a t-digest
+ * \param blob a bytea holding a t-digest with room for one more value
+ * \param x the value
+ */
+bytea *tdigest_insert(bytea *blob, float8 x)
+{
+    tdigest *s = TD_SKETCH(blob);
+    uint32   n;
+
+    if (isnan(x) || isinf(x))
+        elog(ERROR, "t-digest values must be finite");
+
+    if (s->ncentroids + s->nbuffered == s->capacity) {
+        tdigest_compress(s);
+        if (s->ncentroids == s->capacity)
+            elog(ERROR, "t-digest has no room after merging");
+    }
+    n = s->ncentroids + s->nbuffered++;
+    s->centroids[n].mean = x;
+    s->centroids[n].weight = 1;
+    s->count += 1;
+    if (x < s->min)
+        s->min = x;
+    if (x > s->max)
+        s->max = x;
+    return blob;
+}
+
+/*!
+ * merge two t-digests into a new one with the smaller compression of the
+ * two, and room to go on adding values
+ * \param blob1 a bytea holding a t-digest
+ * \param blob2 a bytea holding a t-digest
+ */
+bytea *tdigest_merge_c(bytea *blob1, bytea *blob2)
+{
+    tdigest *s1 = TD_SKETCH(blob1);
+    tdigest *s2 = TD_SKETCH(blob2);
+    uint32   n1 = s1->ncentroids + s1->nbuffered;
+    uint32   n2 = s2->ncentroids + s2->nbuffered;
+    int      compression = Min(s1->compression, s2->compression);
+    uint32   capacity = Max(TD_CAPACITY(compression), n1 + n2);
+    bytea *  blob;
+    tdigest *s;
+
+    blob = (bytea *)palloc0(TD_SZ(capacity));
+    SET_VARSIZE(blob, TD_SZ(capacity));
+    s = TD_SKETCH(blob);
+    memcpy(s, s1, sizeof(tdigest));
+    s->compression = compression;
+    s->capacity = capacity;
+
+    /* append all of both digests to the buffer, and merge it */
+    s->ncentroids = 0;
+    s->nbuffered = n1 + n2;
+    memcpy(s->centroids, s1->centroids, n1*sizeof(tdcentroid));
+    memcpy(s->centroids + n1, s2->centroids, n2*sizeof(tdcentroid));
+    s->count = s1->count + s2->count;
+    s->min = Min(s1->min, s2->min);
+    s->max = Max(s1->max, s2->max);
+    tdigest_compress(s);
+
+    if (capacity > TD_CAPACITY(compression)) {
+        /* shrink back to the usual size, so repeated merges stay bounded */
+        bytea *shrunk = (bytea *)palloc(TD_SZ(TD_CAPACITY(compression)));
+
+        memcpy(shrunk, blob, TD_SZ(s->ncentroids));
+        SET_VARSIZE(shrunk, TD_SZ(TD_CAPACITY(compression)));
+        TD_SKETCH(shrunk)->capacity = TD_CAPACITY(compression);
+        pfree(blob);
+        blob = shrunk;
+    }
+    return blob;
+}
+
+/*!
+ * a copy of a t-digest with its buffer merged, and no spare room
+ */
+bytea *tdigest_compacted(bytea *blob)
+{
+    tdigest *s = TD_SKETCH(blob);
+    bytea *  out;
+
+    tdigest_compress(s);
+    out = (bytea *)palloc(TD_SZ(s->ncentroids));
+    memcpy(out, blob, TD_SZ(s->ncentroids));
+    SET_VARSIZE(out, TD_SZ(s->ncentroids));
+    TD_SKETCH(out)->capacity = s->ncentroids;
+    return out;
+}
+
+/*!
+ * the i'th point of the piecewise-linear CDF of a merged digest, counting
+ * (min, 0) as point 0 and (max, count) as point ncentroids + 1
+ * \param s a t-digest with no buffered values
+ * \param i the point
+ * \param before the weight of the centroids before centroid i-1
+ * \param x set to the value at the point
+ */
+static inline double tdigest_point(tdigest *s, uint32 i, double before,
+                                   double *x)
+{
+    if (i == 0) {
+        *x = s->min;
+        return 0;
+    }
+    if (i > s->ncentroids) {
+        *x = s->max;
+        return s->count;
+    }
+    *x = s->centroids[i - 1].mean;
+    return before + s->centroids[i - 1].weight / 2;
+}
+
+/*!
+ * the estimated q-quantile of a merged digest
+ * \param s a t-digest with no buffered values and a positive count
+ * \param q the fraction, between 0 and 1
+ */
+double tdigest_quantile_c(tdigest *s, double q)
+{
+    double rank = q * s->count;
+    double before = 0, x0, x1, r0, r1;
+    uint32 i;
+
+    r0 = tdigest_point(s, 0, 0, &x0);
+    for (i = 1; i <= s->ncentroids + 1; i++) {
+        r1 = tdigest_point(s, i, before, &x1);
+        if (rank <= r1) {
+            if (r1 == r0)
+                return x1;
+            return x0 + (rank - r0) / (r1 - r0) * (x1 - x0);
+        }
+        if (i <= s->ncentroids)
+            before += s->centroids[i - 1].weight;
+        x0 = x1;
+        r0 = r1;
+    }
+    return s->max;
+}
+
+/*!
+ * the estimated fraction of values at most x in a merged digest
+ * \param s a t-digest with no buffered values and a positive count
+ * \param x the value
+ */
+double tdigest_cdf_c(tdigest *s, double x)
+{
+    double before = 0, x0, x1, r0, r1;
+    uint32 i;
+
+    if (x < s->min)
+        return 0;
+    if (x >= s->max)
+        return 1;
+
+    r0 = tdigest_point(s, 0, 0, &x0);
+    for (i = 1; i <= s->ncentroids + 1; i++) {
+        r1 = tdigest_point(s, i, before, &x1);
+        /* interpolate in the segment after the last point at or below x */
+        if (x1 > x)
+            return (r0 + (x - x0) / (x1 - x0) * (r1 - r0)) / s->count;
+        if (i <= s->ncentroids)
+            before += s->centroids[i - 1].weight;
+        x0 = x1;
+        r0 = r1;
+    }
+    return 1;
+}
+
+/*!
+ * check that a bytea holds a sketch from tdigest_sketch, and return it
+ */
+static tdigest *tdigest_check(bytea *blob)
+{
+    tdigest *s = TD_SKETCH(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(tdigest)
+        || s->magic != TD_MAGIC || s->version != TD_VERSION)
+        elog(ERROR, "not a t-digest sketch");
+    if (s->compression < TD_MIN_COMPRESSION
+        || s->compression > TD_MAX_COMPRESSION
+        || VARSIZE(blob) != TD_SZ(s->capacity)
+        || s->ncentroids + s->nbuffered > s->capacity)
+        elog(ERROR, "corrupt t-digest sketch");
+    return s;
+}
+
+/*! check the sketch argument of a query UDF, merging any buffered values */
+static tdigest *tdigest_getarg(PG_FUNCTION_ARGS, int argno)
+{
+    tdigest *s = tdigest_check(PG_GETARG_BYTEA_P(argno));
+
+    if (s->nbuffered > 0)
+        s = TD_SKETCH(tdigest_compacted(PG_GETARG_BYTEA_P_COPY(argno)));
+    return s;
+}
+
+PG_FUNCTION_INFO_V1(__tdigest_trans);
+
+/*!
+ * UDA transition function for tdigest_sketch.  An optional third argument
+ * sets the compression.  NaN and infinite values are skipped, like NULLs.
+ */
+Datum __tdigest_trans(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+    float8 x = PG_GETARG_FLOAT8(1);
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (isnan(x) || isinf(x))
+        PG_RETURN_BYTEA_P(blob);
+    if (!TD_INITIALIZED(blob))
+        blob = tdigest_new((PG_NARGS() > 2) ? PG_GETARG_INT32(2)
+                           : TD_DEFAULT_COMPRESSION);
+    PG_RETURN_BYTEA_P(tdigest_insert(blob, x));
+}
+
+PG_FUNCTION_INFO_V1(__tdigest_merge);
+
+/*!
+ * UDA prefunc to merge the t-digests of two segments.  Also the transition
+ * function of tdigest_merge, over stored sketches.
+ */
+Datum __tdigest_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (!TD_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    tdigest_check(blob2);
+    if (!TD_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+    tdigest_check(blob1);
+    PG_RETURN_BYTEA_P(tdigest_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__tdigest_final);
+
+/*! UDA final function for tdigest_sketch: the stored form of the sketch */
+Datum __tdigest_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    /* nothing was aggregated: emit an empty sketch */
+    if (!TD_INITIALIZED(blob))
+        blob = tdigest_new(TD_DEFAULT_COMPRESSION);
+    PG_RETURN_BYTEA_P(tdigest_compacted(blob));
+}
+
+PG_FUNCTION_INFO_V1(tdigest_union);
+
+/*! UDF to combine two stored t-digests into a digest of all their values */
+Datum tdigest_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    tdigest_check(blob1);
+    tdigest_check(blob2);
+    PG_RETURN_BYTEA_P(tdigest_compacted(tdigest_merge_c(blob1, blob2)));
+}
+
+PG_FUNCTION_INFO_V1(tdigest_quantile);
+
+/*!
+ * UDF for the estimated quantile of a stored t-digest.  Returns NULL for an
+ * empty digest.
+ */
+Datum tdigest_quantile(PG_FUNCTION_ARGS)
+{
+    tdigest *s = tdigest_getarg(fcinfo, 0);
+    float8   q = PG_GETARG_FLOAT8(1);
+
+    if (!(q >= 0 && q <= 1))
+        elog(ERROR, "quantile must be between 0 and 1");
+    if (s->count == 0)
+        PG_RETURN_NULL();
+    PG_RETURN_FLOAT8(tdigest_quantile_c(s, q));
+}
+
+PG_FUNCTION_INFO_V1(tdigest_quantile_array);
+
+/*!
+ * UDF for many estimated quantiles of a stored t-digest at once.
+ * NULL fractions get NULL quantiles, as do all fractions for an empty
+ * digest.
+ */
+Datum tdigest_quantile_array(PG_FUNCTION_ARGS)
+{
+    tdigest *  s = tdigest_getarg(fcinfo, 0);
+    ArrayType *qs = PG_GETARG_ARRAYTYPE_P(1);
+    Datum *    elems;
+    bool *     nulls;
+    int        n, i;
+
+    if (ARR_ELEMTYPE(qs) != FLOAT8OID)
+        elog(ERROR, "tdigest_quantile expects an array of float8");
+    deconstruct_array(qs, FLOAT8OID, sizeof(float8), true, 'd',
+                      &elems, &nulls, &n);
+    for (i = 0; i < n; i++) {
+        float8 q = DatumGetFloat8(elems[i]);
+
+        if (nulls[i])
+            continue;
+        if (!(q >= 0 && q <= 1))
+            elog(ERROR, "quantile must be between 0 and 1");
+        if (s->count == 0)
+            nulls[i] = true;
+        else
+            elems[i] = Float8GetDatum(tdigest_quantile_c(s, q));
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, ARR_NDIM(qs),
+                                             ARR_DIMS(qs), ARR_LBOUND(qs),
+                                             FLOAT8OID, sizeof(float8), true,
+                                             'd'));
+}
+
+PG_FUNCTION_INFO_V1(tdigest_cdf);
+
+/*!
+ * UDF for the estimated fraction of values at most x in a stored t-digest.
+ * Returns NULL for an empty digest.
+ */
+Datum tdigest_cdf(PG_FUNCTION_ARGS)
+{
+    tdigest *s = tdigest_getarg(fcinfo, 0);
+
+    if (s->count == 0)
+        PG_RETURN_NULL();
+    PG_RETURN_FLOAT8(tdigest_cdf_c(s, PG_GETARG_FLOAT8(1)));
+}
+
+/*!
+ * a float8[nbuckets][3] array of {lo, hi, count} rows
+ */
+static ArrayType *tdigest_histogram_array(float8 *rows, int nbuckets)
+{
+    int dims[2], lbs[2];
+
+    dims[0] = nbuckets;
+    dims[1] = 3;
+    lbs[0] = lbs[1] = 1;
+    return construct_md_array((Datum *)rows, NULL, 2, dims, lbs, FLOAT8OID,
+                              sizeof(float8), true, 'd');
+}
+
+PG_FUNCTION_INFO_V1(tdigest_width_histogram);
+
+/*!
+ * UDF for an equi-width histogram of a stored t-digest: nbuckets buckets
+ * of equal width from its minimum to its maximum, with estimated counts.
+ */
+Datum tdigest_width_histogram(PG_FUNCTION_ARGS)
+{
+    tdigest *s = tdigest_getarg(fcinfo, 0);
+    int      nbuckets = PG_GETARG_INT32(1);
+    float8 * rows;
+    double   prev = 0;
+    int      i;
+
+    if (nbuckets < 1)
+        elog(ERROR, "number of buckets must be positive");
+    if (s->count == 0)
+        PG_RETURN_NULL();
+
+    rows = (float8 *)palloc(3*nbuckets*sizeof(float8));
+    for (i = 0; i < nbuckets; i++) {
+        double hi = (i == nbuckets - 1) ? s->max
+                    : s->min + (s->max - s->min) * (i + 1) / nbuckets;
+        double cum = s->count * tdigest_cdf_c(s, hi);
+
+        rows[3*i] = s->min + (s->max - s->min) * i / nbuckets;
+        rows[3*i + 1] = hi;
+        rows[3*i + 2] = cum - prev;
+        prev = cum;
+    }
+    PG_RETURN_ARRAYTYPE_P(tdigest_histogram_array(rows, nbuckets));
+}
+
+PG_FUNCTION_INFO_V1(tdigest_depth_histogram);
+
+/*!
+ * UDF for an equi-depth histogram of a stored t-digest: nbuckets buckets
+ * bounded by estimated quantiles, each holding an equal share of the values.
+ */
+Datum tdigest_depth_histogram(PG_FUNCTION_ARGS)
+{
+    tdigest *s = tdigest_getarg(fcinfo, 0);
+    int      nbuckets = PG_GETARG_INT32(1);
+    float8 * rows;
+    double   lo;
+    int      i;
+
+    if (nbuckets < 1)
+        elog(ERROR, "number of buckets must be positive");
+    if (s->count == 0)
+        PG_RETURN_NULL();
+
+    rows = (float8 *)palloc(3*nbuckets*sizeof(float8));
+    lo = s->min;
+    for (i = 0; i < nbuckets; i++) {
+        double hi = (i == nbuckets - 1) ? s->max
+                    : tdigest_quantile_c(s, (double)(i + 1) / nbuckets);
+
+        rows[3*i] = lo;
+        rows[3*i + 1] = hi;
+        rows[3*i + 2] = s->count / nbuckets;
+        lo = hi;
+    }
+    PG_RETURN_ARRAYTYPE_P(tdigest_histogram_array(rows, nbuckets));
+}
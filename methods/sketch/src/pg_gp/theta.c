@@ -0,0 +1,601 @@
+/*!
+ * \file theta.c
+ *
+ * \brief Theta sketch implementation
+ */
+/*!
+ * \implementation
+ * A Theta sketch (a "k minimum values" sketch) hashes every value to 63
+ * bits, read as a fraction of 2^63, and keeps the distinct hashes below a
+ * threshold theta: at most k of them, the smallest seen.  The hashes kept
+ * are a uniform sample of the distinct values at rate theta, so the
+ * distinct count is estimated as their number divided by theta, with a
+ * relative error of about 1/sqrt(k).  Until k distinct values have been
+ * seen, theta is 1 and the count is exact.
+ *
+ * Unlike FM and HyperLogLog sketches, the sample supports set operations.
+ * Two sketches, cut down to the smaller of their thetas, are samples of
+ * their sets at the same rate; the hashes in both are then a sample of the
+ * intersection, and the hashes in the first and not the second a sample of
+ * the difference.  Union, intersection and A-not-B of stored sketches are
+ * sketches again, and can be combined further.
+ *
+ * During aggregation the hashes are kept in an open-addressing hash table,
+ * growing up to twice k slots.  When the table is three-quarters full,
+ * theta is lowered to the (k+1)-th smallest hash and the larger ones are
+ * dropped (the "QuickSelect" sketch of the Apache DataSketches library).
+ * Stored sketches keep their hashes sorted, with no table.
+ *
+ * Variable-length values are hashed by their contents, so sketches of a
+ * stored column and of computed values can be combined.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+
+#include <stdlib.h>
+
+#define THETA_MAGIC           0x41544854 /* "THTA" */
+#define THETA_VERSION         1
+#define THETA_TABLE           0
+#define THETA_SORTED          1
+#define THETA_MIN_K           16
+#define THETA_MAX_K           (1 << 20)
+#define THETA_DEFAULT_K       4096
+/*! theta of a sketch that has kept every hash: 1, as a fraction of 2^63 */
+#define THETA_ONE             (UINT64CONST(1) << 63)
+/*! initial number of table slots */
+#define THETA_TABLE_INITIAL   32
+
+/*!
+ * \internal
+ * \brief a Theta sketch, as transition value and as stored value
+ *
+ * The count hashes are all nonzero and below theta.  In table form, hashes
+ * holds capacity slots, a power of two, with zero for an empty slot.  In
+ * sorted form, it holds the count hashes in increasing order.
+ * \endinternal
+ */
+typedef struct {
+    uint32 magic;     /*! THETA_MAGIC */
+    uint8  version;   /*! THETA_VERSION */
+    uint8  form;      /*! THETA_TABLE or THETA_SORTED */
+    uint8  hashkind;  /*! SKETCH_HASH_* function used for the sketch */
+    uint8  unused;
+    uint32 k;         /*! most hashes kept below theta */
+    uint32 count;     /*! number of hashes kept */
+    uint32 capacity;  /*! table slots, or count for the sorted form */
+    uint32 unused2;
+    uint64 theta;     /*! sampling threshold, as a fraction of 2^63 */
+    uint64 hashes[0]; /*! table slots or sorted hashes */
+} thetasketch;
+
+#define THETA_SKETCH(b)      ((thetasketch *)VARDATA(b))
+#define THETA_INITIALIZED(b) (VARSIZE(b) > VARHDRSZ)
+#define THETA_SZ(n)          (VARHDRSZ + sizeof(thetasketch) + \
+                              (size_t)(n)*sizeof(uint64))
+
+/*!
+ * \internal
+ * \brief properties of the input type, cached in fn_extra by __theta_trans
+ * \endinternal
+ */
+typedef struct {
+    int16 typLen;
+    bool  typByVal;
+} thetatypcache;
+
+Datum __theta_trans(PG_FUNCTION_ARGS);
+Datum __theta_merge(PG_FUNCTION_ARGS);
+Datum __theta_intersect_trans(PG_FUNCTION_ARGS);
+Datum __theta_final(PG_FUNCTION_ARGS);
+Datum theta_union(PG_FUNCTION_ARGS);
+Datum theta_intersection(PG_FUNCTION_ARGS);
+Datum theta_a_not_b(PG_FUNCTION_ARGS);
+Datum theta_cardinality(PG_FUNCTION_ARGS);
+bytea *theta_new(int, int, uint64);
+bytea *theta_insert_hash(bytea *, uint64);
+bytea *theta_union_c(bytea *, bytea *);
+bytea *theta_intersection_c(bytea *, bytea *);
+bytea *theta_a_not_b_c(bytea *, bytea *);
+bytea *theta_sorted(bytea *);
+double theta_estimate(thetasketch *);
+
+static bytea *      theta_rebuild(bytea *);
+static void         theta_table_add(thetasketch *, uint64);
+static uint32       theta_max_capacity(uint32);
+static uint64       theta_select(uint64 *, uint32, uint32);
+static bytea *      theta_new_sorted(thetasketch *, thetasketch *, uint32);
+static thetasketch *theta_check(bytea *);
+static void         theta_check_compatible(thetasketch *, thetasketch *);
+
+static int uint64_cmp(const void *a, const void *b)
+{
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*! the most table slots for a sketch of k: a power of two of at least 2k */
+static uint32 theta_max_capacity(uint32 k)
+{
+    uint32 capacity = THETA_TABLE_INITIAL;
+
+    while (capacity < 2*k)
+        capacity *= 2;
+    return capacity;
+}
+
+/*!
+ * allocate an empty sketch in table form
+ * \param k the most hashes to keep
+ * \param hashkind the SKETCH_HASH_* function to use
+ * \param theta the initial threshold, THETA_ONE for a new sketch
+ */
+bytea *theta_new(int k, int hashkind, uint64 theta)
+{
+    uint32       capacity;
+    bytea *      blob;
+    thetasketch *s;
+
+    if (k < THETA_MIN_K || k > THETA_MAX_K)
+        elog(ERROR, "Theta sketch size k must be between %d and %d",
+             THETA_MIN_K, THETA_MAX_K);
+
+    capacity = Min(THETA_TABLE_INITIAL, theta_max_capacity(k));
+    blob = (bytea *)palloc0(THETA_SZ(capacity));
+    SET_VARSIZE(blob, THETA_SZ(capacity));
+    s = THETA_SKETCH(blob);
+    s->magic = THETA_MAGIC;
+    s->version = THETA_VERSION;
+    s->form = THETA_TABLE;
+    s->hashkind = hashkind;
+    s->k = k;
+    s->capacity = capacity;
+    s->theta = theta;
+    return blob;
+}
+
+/*!
+ * add a hash that is not yet in the table, which must have a free slot
+ */
+static void theta_table_add(thetasketch *s, uint64 h)
+{
+    uint32 mask = s->capacity - 1;
+    uint32 pos;
+
+    for (pos = (uint32)h & mask; s->hashes[pos] != 0; pos = (pos + 1) & mask)
+        ;
+    s->hashes[pos] = h;
+    s->count++;
+}
+
+/*!
+ * the n-th smallest (from 0) of len distinct values, which are reordered
+ */
+static uint64 theta_select(uint64 *v, uint32 len, uint32 n)
+{
+    uint32 lo = 0, hi = len - 1;
+
+    while (lo < hi) {
+        uint64 pivot = v[lo + (hi - lo)/2];
+        uint32 i = lo, j = hi;
+
+        while (i <= j) {
+            while (v[i] < pivot) i++;
+            while (v[j] > pivot) j--;
+            if (i <= j) {
+                uint64 tmp = v[i];
+
+                v[i++] = v[j];
+                v[j] = tmp;
+                if (j == 0)
+                    break;
+                j--;
+            }
+        }
+        if (n <= j)
+            hi = j;
+        else if (n >= i)
+            lo = i;
+        else
+            break;
+    }
+    return v[n];
+}
+
+/*!
+ * make room in a full table: grow it if it has fewer than its most slots,
+ * and otherwise lower theta to keep only the k smallest hashes
+ * \returns a new blob
+ */
+static bytea *theta_rebuild(bytea *blob)
+{
+    thetasketch *s = THETA_SKETCH(blob);
+    uint32       capacity = Min(2*s->capacity, theta_max_capacity(s->k));
+    uint64 *     live = (uint64 *)palloc(s->count*sizeof(uint64));
+    uint32       i, n = 0;
+    bytea *      newblob;
+    thetasketch *news;
+
+    for (i = 0; i < s->capacity; i++)
+        if (s->hashes[i] != 0)
+            live[n++] = s->hashes[i];
+
+    /* can't use repalloc, so copy into a new blob */
+    newblob = (bytea *)palloc0(THETA_SZ(capacity));
+    SET_VARSIZE(newblob, THETA_SZ(capacity));
+    news = THETA_SKETCH(newblob);
+    memcpy(news, s, sizeof(thetasketch));
+    news->capacity = capacity;
+    news->count = 0;
+    if (n > news->k && capacity == s->capacity)
+        news->theta = theta_select(live, n, news->k);
+    for (i = 0; i < n; i++)
+        if (live[i] < news->theta)
+            theta_table_add(news, live[i]);
+    pfree(live);
+    return newblob;
+}
+
+/*!
+ * insert a 63-bit hash into a sketch in table form
+ * \returns the blob, which may have been reallocated
+ */
+bytea *theta_insert_hash(bytea *blob, uint64 h)
+{
+    thetasketch *s = THETA_SKETCH(blob);
+    uint32       mask = s->capacity - 1;
+    uint32       pos;
+
+    if (h == 0 || h >= s->theta)
+        return blob;
+    for (pos = (uint32)h & mask; s->hashes[pos] != 0; pos = (pos + 1) & mask)
+        if (s->hashes[pos] == h)
+            return blob;
+    s->hashes[pos] = h;
+    if (++s->count > s->capacity/4*3)
+        blob = theta_rebuild(blob);
+    return blob;
+}
+
+/*!
+ * the union of two sketches, in table form
+ * \returns a new blob
+ */
+bytea *theta_union_c(bytea *blob1, bytea *blob2)
+{
+    thetasketch *s1 = THETA_SKETCH(blob1);
+    thetasketch *s2 = THETA_SKETCH(blob2);
+    bytea *      blob;
+    uint32       i;
+
+    theta_check_compatible(s1, s2);
+    blob = theta_new(Max(s1->k, s2->k), s1->hashkind,
+                     Min(s1->theta, s2->theta));
+    for (i = 0; i < s1->capacity; i++)
+        blob = theta_insert_hash(blob, s1->hashes[i]);
+    for (i = 0; i < s2->capacity; i++)
+        blob = theta_insert_hash(blob, s2->hashes[i]);
+    return blob;
+}
+
+/*!
+ * a copy of a sketch in sorted form, i.e. its stored form.  Hashes above
+ * the k smallest are dropped, so a table sketch is cut down to k.
+ */
+bytea *theta_sorted(bytea *blob)
+{
+    thetasketch *s = THETA_SKETCH(blob);
+    thetasketch *out;
+    bytea *      outblob;
+    uint32       i, n = 0;
+
+    outblob = (bytea *)palloc(THETA_SZ(s->count));
+    SET_VARSIZE(outblob, THETA_SZ(s->count));
+    out = THETA_SKETCH(outblob);
+    memcpy(out, s, sizeof(thetasketch));
+    for (i = 0; i < s->capacity; i++)
+        if (s->hashes[i] != 0)
+            out->hashes[n++] = s->hashes[i];
+    if (s->form == THETA_TABLE)
+        qsort(out->hashes, n, sizeof(uint64), uint64_cmp);
+    if (n > out->k) {
+        out->theta = out->hashes[out->k];
+        n = out->k;
+        SET_VARSIZE(outblob, THETA_SZ(n));
+    }
+    out->form = THETA_SORTED;
+    out->count = out->capacity = n;
+    return outblob;
+}
+
+/*!
+ * an empty sketch in sorted form with the header of two others, and room
+ * for n hashes
+ */
+static bytea *theta_new_sorted(thetasketch *s1, thetasketch *s2, uint32 n)
+{
+    bytea *      blob = (bytea *)palloc0(THETA_SZ(n));
+    thetasketch *s = THETA_SKETCH(blob);
+
+    SET_VARSIZE(blob, THETA_SZ(n));
+    memcpy(s, s1, sizeof(thetasketch));
+    s->form = THETA_SORTED;
+    s->k = Max(s1->k, s2->k);
+    s->count = s->capacity = 0;
+    s->theta = Min(s1->theta, s2->theta);
+    return blob;
+}
+
+/*!
+ * the intersection of two sketches, in sorted form: the hashes in both,
+ * below the smaller theta
+ * \returns a new blob
+ */
+bytea *theta_intersection_c(bytea *blob1, bytea *blob2)
+{
+    thetasketch *s1 = THETA_SKETCH(blob1 = theta_sorted(blob1));
+    thetasketch *s2 = THETA_SKETCH(blob2 = theta_sorted(blob2));
+    bytea *      blob;
+    thetasketch *s;
+    uint32       i = 0, j = 0;
+
+    theta_check_compatible(s1, s2);
+    blob = theta_new_sorted(s1, s2, Min(s1->count, s2->count));
+    s = THETA_SKETCH(blob);
+    while (i < s1->count && j < s2->count
+           && s1->hashes[i] < s->theta && s2->hashes[j] < s->theta) {
+        if (s1->hashes[i] < s2->hashes[j])
+            i++;
+        else if (s1->hashes[i] > s2->hashes[j])
+            j++;
+        else {
+            s->hashes[s->count++] = s1->hashes[i];
+            i++;
+            j++;
+        }
+    }
+    s->capacity = s->count;
+    SET_VARSIZE(blob, THETA_SZ(s->count));
+    return blob;
+}
+
+/*!
+ * the difference of two sketches, in sorted form: the hashes in the first
+ * and not the second, below the smaller theta
+ * \returns a new blob
+ */
+bytea *theta_a_not_b_c(bytea *blob1, bytea *blob2)
+{
+    thetasketch *s1 = THETA_SKETCH(blob1 = theta_sorted(blob1));
+    thetasketch *s2 = THETA_SKETCH(blob2 = theta_sorted(blob2));
+    bytea *      blob;
+    thetasketch *s;
+    uint32       i, j = 0;
+
+    theta_check_compatible(s1, s2);
+    blob = theta_new_sorted(s1, s2, s1->count);
+    s = THETA_SKETCH(blob);
+    s->k = s1->k;
+    for (i = 0; i < s1->count && s1->hashes[i] < s->theta; i++) {
+        while (j < s2->count && s2->hashes[j] < s1->hashes[i])
+            j++;
+        if (j == s2->count || s2->hashes[j] != s1->hashes[i])
+            s->hashes[s->count++] = s1->hashes[i];
+    }
+    s->capacity = s->count;
+    SET_VARSIZE(blob, THETA_SZ(s->count));
+    return blob;
+}
+
+/*!
+ * estimate the number of distinct values in a sketch
+ */
+double theta_estimate(thetasketch *s)
+{
+    uint32 n = s->count;
+    uint64 theta = s->theta;
+
+    if (s->form == THETA_TABLE && n > s->k) {
+        /* the k smallest hashes are the sample, as in the sorted form */
+        uint64 *live = (uint64 *)palloc(n*sizeof(uint64));
+        uint32  i, j = 0;
+
+        for (i = 0; i < s->capacity; i++)
+            if (s->hashes[i] != 0)
+                live[j++] = s->hashes[i];
+        theta = theta_select(live, n, s->k);
+        n = s->k;
+        pfree(live);
+    }
+    if (theta == THETA_ONE)
+        return n;
+    return n/((double)theta/(double)THETA_ONE);
+}
+
+/*!
+ * error out unless two sketches can be combined
+ */
+static void theta_check_compatible(thetasketch *s1, thetasketch *s2)
+{
+    if (s1->hashkind != s2->hashkind)
+        elog(ERROR,
+             "cannot combine Theta sketches built with different hash functions");
+}
+
+/*!
+ * check that a bytea holds a sketch from theta_sketch, and return it
+ */
+static thetasketch *theta_check(bytea *blob)
+{
+    thetasketch *s = THETA_SKETCH(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(thetasketch)
+        || s->magic != THETA_MAGIC || s->version != THETA_VERSION)
+        elog(ERROR, "not a Theta sketch");
+    if (s->k < THETA_MIN_K || s->k > THETA_MAX_K
+        || s->theta == 0 || s->theta > THETA_ONE
+        || s->form > THETA_SORTED
+        || VARSIZE(blob) != THETA_SZ(s->capacity)
+        || (s->form == THETA_SORTED && s->count != s->capacity)
+        || (s->form == THETA_TABLE
+            && (s->count > s->capacity
+                || (s->capacity & (s->capacity - 1)) != 0)))
+        elog(ERROR, "corrupt Theta sketch");
+    return s;
+}
+
+PG_FUNCTION_INFO_V1(__theta_trans);
+
+/*!
+ * UDA transition function for theta_sketch.  An optional third argument
+ * sets k.
+ */
+Datum __theta_trans(PG_FUNCTION_ARGS)
+{
+    bytea *        blob = PG_GETARG_BYTEA_P(0);
+    thetatypcache *typ = (thetatypcache *)fcinfo->flinfo->fn_extra;
+    uint64         hash[SKETCH_HASHLEN/sizeof(uint64)];
+    thetasketch *  s;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    if (typ == NULL) {
+        /* look up the input type once per query */
+        Oid element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+        if (!OidIsValid(element_type))
+            elog(ERROR, "could not determine data type of input");
+        typ = (thetatypcache *)MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                  sizeof(thetatypcache));
+        get_typlenbyval(element_type, &typ->typLen, &typ->typByVal);
+        fcinfo->flinfo->fn_extra = typ;
+    }
+    if (!THETA_INITIALIZED(blob))
+        blob = theta_new((PG_NARGS() > 2) ? PG_GETARG_INT32(2)
+                         : THETA_DEFAULT_K, SKETCH_HASH_DEFAULT, THETA_ONE);
+    s = THETA_SKETCH(blob);
+
+    sketch_hash_value(PG_GETARG_DATUM(1), typ->typLen, typ->typByVal,
+                      s->hashkind, (uint8 *)hash);
+    PG_RETURN_BYTEA_P(theta_insert_hash(blob, hash[0] >> 1));
+}
+
+PG_FUNCTION_INFO_V1(__theta_merge);
+
+/*!
+ * Greenplum "prefunc" to combine sketches from multiple machines.
+ * Also the transition function of theta_merge, over stored sketches.
+ */
+Datum __theta_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (!THETA_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    theta_check(blob2);
+    if (!THETA_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(blob2);
+    theta_check(blob1);
+    PG_RETURN_BYTEA_P(theta_union_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__theta_intersect_trans);
+
+/*!
+ * UDA transition function and prefunc of theta_intersection_merge.  An
+ * uninitialized state stands for the intersection of no sketches.
+ */
+Datum __theta_intersect_trans(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (!THETA_INITIALIZED(blob2))
+        PG_RETURN_BYTEA_P(blob1);
+    theta_check(blob2);
+    if (!THETA_INITIALIZED(blob1))
+        PG_RETURN_BYTEA_P(theta_sorted(blob2));
+    theta_check(blob1);
+    PG_RETURN_BYTEA_P(theta_intersection_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__theta_final);
+
+/*! UDA final function for the Theta aggregates: the sketch in its stored form */
+Datum __theta_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    /* nothing was aggregated: emit an empty sketch */
+    if (!THETA_INITIALIZED(blob))
+        blob = theta_new(THETA_DEFAULT_K, SKETCH_HASH_DEFAULT, THETA_ONE);
+    PG_RETURN_BYTEA_P(theta_sorted(blob));
+}
+
+PG_FUNCTION_INFO_V1(theta_union);
+
+/*! UDF to combine two stored sketches into a sketch of their union */
+Datum theta_union(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    theta_check(blob1);
+    theta_check(blob2);
+    PG_RETURN_BYTEA_P(theta_sorted(theta_union_c(blob1, blob2)));
+}
+
+PG_FUNCTION_INFO_V1(theta_intersection);
+
+/*! UDF to combine two stored sketches into a sketch of their intersection */
+Datum theta_intersection(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    theta_check(blob1);
+    theta_check(blob2);
+    PG_RETURN_BYTEA_P(theta_intersection_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(theta_a_not_b);
+
+/*!
+ * UDF for a sketch of the values of the first stored sketch that are not
+ * in the second
+ */
+Datum theta_a_not_b(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    theta_check(blob1);
+    theta_check(blob2);
+    PG_RETURN_BYTEA_P(theta_a_not_b_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(theta_cardinality);
+
+/*! UDF for the estimated number of distinct values in a stored sketch */
+Datum theta_cardinality(PG_FUNCTION_ARGS)
+{
+    thetasketch *s = theta_check(PG_GETARG_BYTEA_P(0));
+
+    PG_RETURN_INT64((int64)(theta_estimate(s) + 0.5));
+}
@@ -0,0 +1,854 @@
+/*!
+ * \file window.c
+ *
+ * \brief Sliding-window CountMin and MFV sketches
+ *
+ * \implementation
+ * A window sketch counts the rows of a stream by time.  Time is cut into
+ * buckets of a fixed width, numbered from the Postgres epoch, and the
+ * sketch keeps a ring of the latest nbuckets of them: time bucket e lives
+ * in slot e mod nbuckets, with a sketch of its own rows.  For CountMin the
+ * bucket sketches are single levels of counters, laid out and hashed as
+ * in countmin.c; for MFV they are ordinary Space-Saving sketches.
+ *
+ * When a row of a newer time bucket arrives, the slot it needs is cleared
+ * for it, dropping a bucket that has left the window.  The buckets are
+ * updated in place: CountMin buckets have a fixed size, and an MFV bucket
+ * sketch that outgrows the room of its slot moves to the end of the
+ * window sketch, which doubles in size when it runs out of space.  Rows too old for
+ * the window are dropped too.  So a window sketch takes constant space
+ * however long the stream, and answers for the last nbuckets*width of it.
+ * A query adds up the buckets in the window ending at a given time,
+ * by default the newest bucket counted.
+ *
+ * Window sketches merge slot by slot: buckets of the same time merge as
+ * their sketches do, and otherwise the newer bucket is kept.  So a stored
+ * window sketch can be brought up to date by merging in a sketch of the
+ * rows that arrived since.
+ */
+
+#include "postgres.h"
+#include "utils/array.h"
+#include "utils/elog.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+#include "nodes/execnodes.h"
+#include "fmgr.h"
+#include "sketch_support.h"
+#include "catalog/pg_type.h"
+#include "countmin.h"
+
+#include <stddef.h>
+
+#ifdef HAVE_INT64_TIMESTAMP
+#define WINDOW_USECS(t) ((int64)(t))
+#else
+#define WINDOW_USECS(t) ((int64)floor((t)*USECS_PER_SEC))
+#endif
+
+Datum __cmsketch_window_trans(PG_FUNCTION_ARGS);
+Datum __cmsketch_window_merge(PG_FUNCTION_ARGS);
+Datum __cmsketch_window_final(PG_FUNCTION_ARGS);
+Datum cmsketch_window_count(PG_FUNCTION_ARGS);
+Datum __mfvsketch_window_trans(PG_FUNCTION_ARGS);
+Datum __mfvsketch_window_merge(PG_FUNCTION_ARGS);
+Datum __mfvsketch_window_final(PG_FUNCTION_ARGS);
+Datum mfvsketch_window_histogram(PG_FUNCTION_ARGS);
+
+static int64     window_bucket_width(Interval *);
+static int64     window_epoch(TimestampTz, int64);
+static uint32    window_slot(int64, uint32);
+static bool      window_live(int64, int64, uint32);
+static bytea *   cmw_new(uint32, int64, int, int, int, int);
+static bytea *   cmw_add(bytea *, uint32, size_t, uint64);
+static bytea *   cmw_add_bucket(bytea *, uint32, cmwbucket *, int);
+static bytea *   cmw_promote(bytea *);
+static bytea *   cmw_insert(bytea *, int64, int64);
+static bytea *   cmw_merge_c(bytea *, bytea *);
+static cmwindow *cmw_check(bytea *);
+static bytea *   mfvw_new(uint32, int64, int, Oid);
+static bytea *   mfvw_build(bytea *, bytea **, int64 *);
+static size_t    mfvw_end(mfvwindow *, uint32);
+static bytea *   mfvw_place(bytea *, uint32, bytea *, int64);
+static bytea *   mfvw_grow(bytea *, uint32, size_t);
+static bytea *   mfvw_merge_c(bytea *, bytea *);
+static mfvwindow *mfvw_check(bytea *);
+
+/*!
+ * the width of a time bucket in microseconds.  Months vary in length, so
+ * the interval must be given in days and smaller units.
+ */
+static int64 window_bucket_width(Interval *bucket)
+{
+    int64 width;
+
+    if (bucket->month != 0)
+        elog(ERROR, "window bucket width must not be given in months or years");
+    width = WINDOW_USECS(bucket->time) + bucket->day*USECS_PER_DAY;
+    if (width <= 0)
+        elog(ERROR, "window bucket width must be positive");
+    return width;
+}
+
+/*! the number of the time bucket holding a timestamp */
+static int64 window_epoch(TimestampTz t, int64 width)
+{
+    int64 usecs;
+
+    if (TIMESTAMP_NOT_FINITE(t))
+        elog(ERROR, "window sketches need finite timestamps");
+    usecs = WINDOW_USECS(t);
+    /* round down, also for times before the epoch */
+    return usecs/width - (usecs % width < 0);
+}
+
+/*! the slot of the ring that holds time bucket e */
+static uint32 window_slot(int64 e, uint32 nbuckets)
+{
+    int64 slot = e % (int64)nbuckets;
+
+    return (uint32)(slot < 0 ? slot + nbuckets : slot);
+}
+
+/*!
+ * whether time bucket e is in the window of nbuckets ending with bucket
+ * latest.  The difference is taken unsigned, as it may not fit an int64.
+ */
+static bool window_live(int64 e, int64 latest, uint32 nbuckets)
+{
+    return e != WINDOW_EMPTY && e <= latest
+           && (uint64)latest - (uint64)e < nbuckets;
+}
+
+
+/*
+ *******  Sliding-window CountMin sketches  ******
+ */
+
+/*!
+ * allocate an empty sliding-window CountMin sketch
+ * \param nbuckets the number of time buckets in the window
+ * \param width the width of a time bucket in microseconds
+ * \param depth the number of rows of each bucket sketch
+ * \param sketchwidth the number of counters per row
+ * \param counterbytes the size of a counter, 4 or 8
+ * \param hashkind the SKETCH_HASH_* function to hash values with
+ */
+static bytea *cmw_new(uint32 nbuckets, int64 width, int depth,
+                      int sketchwidth, int counterbytes, int hashkind)
+{
+    size_t    bucketsz = CM_WINDOW_BUCKET_SZ(depth, sketchwidth, counterbytes);
+    size_t    sz;
+    bytea *   blob;
+    cmwindow *w;
+    uint32    i;
+
+    if (nbuckets < 1 || nbuckets > WINDOW_MAX_BUCKETS)
+        elog(ERROR, "number of window buckets must be between 1 and %d",
+             WINDOW_MAX_BUCKETS);
+    if (depth < 1 || depth > CM_MAX_DEPTH)
+        elog(ERROR, "cmsketch depth must be between 1 and %d", CM_MAX_DEPTH);
+    if (sketchwidth < 1 || sketchwidth > CM_MAX_WIDTH)
+        elog(ERROR, "cmsketch width must be between 1 and %d", CM_MAX_WIDTH);
+    sz = VARHDRSZ + sizeof(cmwindow) + nbuckets*bucketsz;
+    if (sz > MaxAllocSize)
+        elog(ERROR, "window sketch too large");
+
+    blob = (bytea *)palloc0(sz);
+    SET_VARSIZE(blob, sz);
+    w = (cmwindow *)VARDATA(blob);
+    w->magic = CM_WINDOW_MAGIC;
+    w->version = CM_WINDOW_VERSION;
+    w->nbuckets = nbuckets;
+    w->width = width;
+    w->latest = WINDOW_EMPTY;
+    w->bucketsz = bucketsz;
+    w->depth = depth;
+    w->counterbytes = counterbytes;
+    w->sketchwidth = sketchwidth;
+    w->hashkind = hashkind;
+    for (i = 0; i < nbuckets; i++) {
+        cmwbucket *b = CM_WINDOW_BUCKET(w, i);
+
+        b->epoch = WINDOW_EMPTY;
+        b->sketch.magic = CM_SKETCH_MAGIC;
+        b->sketch.version = CM_SKETCH_VERSION;
+        b->sketch.hashkind = hashkind;
+        b->sketch.depth = depth;
+        b->sketch.width = sketchwidth;
+        b->sketch.counterbytes = counterbytes;
+        b->sketch.nlevels = b->sketch.materialized = 1;
+    }
+    return blob;
+}
+
+/*!
+ * a copy of a window sketch with 64-bit counters, for when a 32-bit one
+ * would overflow
+ */
+static bytea *cmw_promote(bytea *blob)
+{
+    cmwindow *w = (cmwindow *)VARDATA(blob);
+    size_t    n = (size_t)w->depth*w->sketchwidth;
+    bytea *   newblob = cmw_new(w->nbuckets, w->width, w->depth,
+                                w->sketchwidth, sizeof(uint64), w->hashkind);
+    cmwindow *neww = (cmwindow *)VARDATA(newblob);
+    uint32    i;
+    size_t    j;
+
+    neww->latest = w->latest;
+    for (i = 0; i < w->nbuckets; i++) {
+        cmwbucket *from = CM_WINDOW_BUCKET(w, i);
+        cmwbucket *to = CM_WINDOW_BUCKET(neww, i);
+
+        to->epoch = from->epoch;
+        to->sketch.total = from->sketch.total;
+        for (j = 0; j < n; j++)
+            ((uint64 *)to->sketch.counters)[j] =
+                ((uint32 *)from->sketch.counters)[j];
+    }
+    return newblob;
+}
+
+/*!
+ * add cnt to counter off of the bucket in slot i
+ * \returns the window sketch, which may have been reallocated
+ */
+static bytea *cmw_add(bytea *blob, uint32 i, size_t off, uint64 cnt)
+{
+    cmwindow * w = (cmwindow *)VARDATA(blob);
+    cmwbucket *b = CM_WINDOW_BUCKET(w, i);
+
+    if (w->counterbytes == sizeof(uint32)) {
+        uint32 *counters = (uint32 *)b->sketch.counters;
+
+        if (counters[off] + cnt <= CM_MAX_COUNTER32) {
+            counters[off] += cnt;
+            return blob;
+        }
+        blob = cmw_promote(blob);
+        w = (cmwindow *)VARDATA(blob);
+        b = CM_WINDOW_BUCKET(w, i);
+    }
+    ((uint64 *)b->sketch.counters)[off] += cnt;
+    if (((uint64 *)b->sketch.counters)[off] > (uint64)MAX_INT64)
+        elog(ERROR, "maximum count exceeded in sketch");
+    return blob;
+}
+
+/*!
+ * add the counters of a bucket into the bucket in slot i
+ * \param counterbytes the size of the counters of src
+ * \returns the window sketch, which may have been reallocated
+ */
+static bytea *cmw_add_bucket(bytea *blob, uint32 i, cmwbucket *src,
+                             int counterbytes)
+{
+    cmwindow *w = (cmwindow *)VARDATA(blob);
+    size_t    n = (size_t)w->depth*w->sketchwidth;
+    size_t    j;
+
+    for (j = 0; j < n; j++) {
+        uint64 cnt = (counterbytes == sizeof(uint32))
+                     ? ((uint32 *)src->sketch.counters)[j]
+                     : ((uint64 *)src->sketch.counters)[j];
+
+        if (cnt > 0)
+            blob = cmw_add(blob, i, j, cnt);
+    }
+    w = (cmwindow *)VARDATA(blob);
+    CM_WINDOW_BUCKET(w, i)->sketch.total += src->sketch.total;
+    return blob;
+}
+
+/*!
+ * count a value in time bucket e of a window sketch
+ * \returns the window sketch, which may have been reallocated
+ */
+static bytea *cmw_insert(bytea *blob, int64 e, int64 val)
+{
+    cmwindow * w = (cmwindow *)VARDATA(blob);
+    uint32     slot = window_slot(e, w->nbuckets);
+    cmwbucket *b = CM_WINDOW_BUCKET(w, slot);
+    uint32     cols[CM_MAX_DEPTH];
+    uint32     i;
+
+    if (w->latest == WINDOW_EMPTY || e > w->latest)
+        w->latest = e;
+    else if (!window_live(e, w->latest, w->nbuckets))
+        /* too old for the window */
+        return blob;
+
+    if (b->epoch != e) {
+        /* the slot held a bucket that has left the window */
+        memset(b->sketch.counters, 0,
+               (size_t)w->depth*w->sketchwidth*w->counterbytes);
+        b->sketch.total = 0;
+        b->epoch = e;
+    }
+
+    cm_columns(&b->sketch, val, cols);
+    for (i = 0; i < w->depth; i++)
+        blob = cmw_add(blob, slot, (size_t)i*w->sketchwidth + cols[i], 1);
+    w = (cmwindow *)VARDATA(blob);
+    CM_WINDOW_BUCKET(w, slot)->sketch.total++;
+    return blob;
+}
+
+/*!
+ * merge two window sketches of the same shape into a new one.  Each slot
+ * gets the newer of the two buckets there, or the sum of both if they
+ * count the same time, unless it has left the window of the result.
+ */
+static bytea *cmw_merge_c(bytea *blob1, bytea *blob2)
+{
+    cmwindow *w1 = (cmwindow *)VARDATA(blob1);
+    cmwindow *w2 = (cmwindow *)VARDATA(blob2);
+    bytea *   blob;
+    cmwindow *w;
+    uint32    i;
+
+    if (w1->nbuckets != w2->nbuckets || w1->width != w2->width
+        || w1->depth != w2->depth || w1->sketchwidth != w2->sketchwidth)
+        elog(ERROR, "cannot merge window sketches of different shapes");
+    if (w1->hashkind != w2->hashkind)
+        elog(ERROR,
+             "cannot merge CountMin sketches built with different hash functions");
+
+    blob = cmw_new(w1->nbuckets, w1->width, w1->depth, w1->sketchwidth,
+                   Max(w1->counterbytes, w2->counterbytes), w1->hashkind);
+    w = (cmwindow *)VARDATA(blob);
+    w->latest = Max(w1->latest, w2->latest);
+    for (i = 0; i < w->nbuckets; i++) {
+        cmwbucket *b1 = CM_WINDOW_BUCKET(w1, i);
+        cmwbucket *b2 = CM_WINDOW_BUCKET(w2, i);
+        bool       live1 = window_live(b1->epoch, w->latest, w->nbuckets);
+        bool       live2 = window_live(b2->epoch, w->latest, w->nbuckets);
+        int64      e;
+
+        if (!live1 && !live2)
+            continue;
+        e = (live1 && live2) ? Max(b1->epoch, b2->epoch)
+            : (live1 ? b1->epoch : b2->epoch);
+        CM_WINDOW_BUCKET(w, i)->epoch = e;
+        if (live1 && b1->epoch == e)
+            blob = cmw_add_bucket(blob, i, b1, w1->counterbytes);
+        if (live2 && b2->epoch == e)
+            blob = cmw_add_bucket(blob, i, b2, w2->counterbytes);
+        w = (cmwindow *)VARDATA(blob);
+    }
+    return blob;
+}
+
+/*!
+ * check that a bytea holds a sliding-window CountMin sketch, and return it
+ */
+static cmwindow *cmw_check(bytea *blob)
+{
+    cmwindow *w = (cmwindow *)VARDATA(blob);
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(cmwindow)
+        || w->magic != CM_WINDOW_MAGIC || w->version != CM_WINDOW_VERSION)
+        elog(ERROR, "not a sliding-window CountMin sketch");
+    if (w->nbuckets < 1 || w->width <= 0
+        || w->depth < 1 || w->depth > CM_MAX_DEPTH
+        || w->sketchwidth < 1 || w->sketchwidth > CM_MAX_WIDTH
+        || (w->counterbytes != sizeof(uint32)
+            && w->counterbytes != sizeof(uint64))
+        || w->bucketsz != CM_WINDOW_BUCKET_SZ(w->depth, w->sketchwidth,
+                                              w->counterbytes)
+        || VARSIZE(blob) != VARHDRSZ + sizeof(cmwindow)
+                            + (size_t)w->nbuckets*w->bucketsz)
+        elog(ERROR, "corrupt sliding-window CountMin sketch");
+    return w;
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_window_trans);
+
+/*!
+ * UDA transition function for cmsketch_window.  The arguments are the
+ * value, its timestamp, the bucket width and the number of buckets, and
+ * optionally the depth and width of the bucket sketches.
+ */
+Datum __cmsketch_window_trans(PG_FUNCTION_ARGS)
+{
+    bytea *   blob = PG_GETARG_BYTEA_P(0);
+    cmwindow *w;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore rows with a NULL value or timestamp */
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_BYTEA_P(blob);
+
+    if (VARSIZE(blob) <= VARHDRSZ)
+        blob = cmw_new(PG_GETARG_INT32(4),
+                       window_bucket_width(PG_GETARG_INTERVAL_P(3)),
+                       (PG_NARGS() > 5) ? PG_GETARG_INT32(5) : DEPTH,
+                       (PG_NARGS() > 6) ? PG_GETARG_INT32(6) : NUMCOUNTERS,
+                       sizeof(uint32), SKETCH_HASH_DEFAULT);
+    w = (cmwindow *)VARDATA(blob);
+
+    PG_RETURN_BYTEA_P(cmw_insert(blob,
+                                 window_epoch(PG_GETARG_TIMESTAMPTZ(2),
+                                              w->width),
+                                 PG_GETARG_INT64(1)));
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_window_merge);
+
+/*!
+ * UDA prefunc to merge the window sketches of two segments.  Also the
+ * transition function of cmsketch_window_merge, over stored sketches.
+ */
+Datum __cmsketch_window_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (VARSIZE(blob2) <= VARHDRSZ)
+        PG_RETURN_BYTEA_P(blob1);
+    cmw_check(blob2);
+    if (VARSIZE(blob1) <= VARHDRSZ)
+        PG_RETURN_BYTEA_P(blob2);
+    cmw_check(blob1);
+    PG_RETURN_BYTEA_P(cmw_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__cmsketch_window_final);
+
+/*!
+ * UDA final function for the window sketch aggregates: the sketch, or NULL
+ * if there were no rows
+ */
+Datum __cmsketch_window_final(PG_FUNCTION_ARGS)
+{
+    bytea *blob = PG_GETARG_BYTEA_P(0);
+
+    if (VARSIZE(blob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+    PG_RETURN_BYTEA_P(blob);
+}
+
+PG_FUNCTION_INFO_V1(cmsketch_window_count);
+
+/*!
+ * UDF for the approximate number of occurrences of a value in the window
+ * ending at a given time, or by default at the newest bucket counted
+ */
+Datum cmsketch_window_count(PG_FUNCTION_ARGS)
+{
+    cmwindow *w = cmw_check(PG_GETARG_BYTEA_P(0));
+    int64     val = PG_GETARG_INT64(1);
+    int64     end = (PG_NARGS() > 2)
+                    ? window_epoch(PG_GETARG_TIMESTAMPTZ(2), w->width)
+                    : w->latest;
+    int64     cnt = 0;
+    uint32    i;
+
+    for (i = 0; i < w->nbuckets; i++) {
+        cmwbucket *b = CM_WINDOW_BUCKET(w, i);
+
+        if (window_live(b->epoch, end, w->nbuckets))
+            cnt += cmsketch_level_count(&b->sketch, 0, val);
+    }
+    PG_RETURN_INT64(cnt);
+}
+
+
+/*
+ *******  Sliding-window MFV sketches  ******
+ */
+
+/*!
+ * allocate an empty sliding-window MFV sketch
+ * \param nbuckets the number of time buckets in the window
+ * \param width the width of a time bucket in microseconds
+ * \param max_mfvs the number of frequent values of each bucket sketch
+ * \param typOid the type being counted
+ */
+static bytea *mfvw_new(uint32 nbuckets, int64 width, int max_mfvs,
+                       Oid typOid)
+{
+    bytea *    blob;
+    mfvwindow *w;
+    uint32     i;
+
+    if (nbuckets < 1 || nbuckets > WINDOW_MAX_BUCKETS)
+        elog(ERROR, "number of window buckets must be between 1 and %d",
+             WINDOW_MAX_BUCKETS);
+    if (max_mfvs < 1 || max_mfvs > MFV_MAX_MFVS)
+        elog(ERROR, "number of buckets must be between 1 and %d",
+             MFV_MAX_MFVS);
+
+    blob = (bytea *)palloc0(MFV_WINDOW_SZ(nbuckets));
+    SET_VARSIZE(blob, MFV_WINDOW_SZ(nbuckets));
+    w = (mfvwindow *)VARDATA(blob);
+    w->magic = MFV_WINDOW_MAGIC;
+    w->version = MFV_WINDOW_VERSION;
+    w->nbuckets = nbuckets;
+    w->width = width;
+    w->latest = WINDOW_EMPTY;
+    w->max_mfvs = max_mfvs;
+    w->typOid = typOid;
+    for (i = 0; i < nbuckets; i++)
+        w->slots[i].epoch = WINDOW_EMPTY;
+    return blob;
+}
+
+/*!
+ * a window sketch with the header of an existing one and the given bucket
+ * sketches, copied in
+ * \param template a window sketch whose header we copy
+ * \param buckets the MFV sketch of each slot, or NULL
+ * \param epochs the time bucket of each slot
+ */
+static bytea *mfvw_build(bytea *template, bytea **buckets, int64 *epochs)
+{
+    mfvwindow *w = (mfvwindow *)VARDATA(template);
+    size_t     sz = MFV_WINDOW_SZ(w->nbuckets);
+    bytea *    blob;
+    mfvwindow *neww;
+    uint32     i;
+
+    for (i = 0; i < w->nbuckets; i++)
+        if (buckets[i] != NULL)
+            sz += MAXALIGN(VARSIZE(buckets[i]));
+    if (sz > MaxAllocSize)
+        elog(ERROR, "window sketch too large");
+
+    blob = (bytea *)palloc0(sz);
+    memcpy(blob, template, VARHDRSZ + sizeof(mfvwindow));
+    SET_VARSIZE(blob, sz);
+    neww = (mfvwindow *)VARDATA(blob);
+    sz = MFV_WINDOW_SZ(w->nbuckets);
+    for (i = 0; i < w->nbuckets; i++) {
+        neww->slots[i].epoch = epochs[i];
+        neww->slots[i].offset = 0;
+        neww->slots[i].room = 0;
+        if (buckets[i] == NULL)
+            continue;
+        neww->slots[i].offset = sz;
+        neww->slots[i].room = MAXALIGN(VARSIZE(buckets[i]));
+        memcpy((char *)blob + sz, buckets[i], VARSIZE(buckets[i]));
+        sz += MAXALIGN(VARSIZE(buckets[i]));
+    }
+    return blob;
+}
+
+/*!
+ * the offset of the free space after the sketches of all slots but slot i
+ */
+static size_t mfvw_end(mfvwindow *w, uint32 i)
+{
+    size_t end = MFV_WINDOW_SZ(w->nbuckets);
+    uint32 j;
+
+    for (j = 0; j < w->nbuckets; j++)
+        if (j != i && w->slots[j].offset)
+            end = Max(end, w->slots[j].offset + w->slots[j].room);
+    return end;
+}
+
+/*!
+ * put an MFV sketch into slot i of a window sketch, in place if it fits
+ * the room of the slot, else after the last sketch.  The other slots are
+ * left alone unless the window sketch has to grow.  A sketch copied into
+ * a larger room is given the rest of it as space for values.
+ * \param bucket the MFV sketch, not inside the window sketch
+ * \param e the time bucket it counts
+ */
+static bytea *mfvw_place(bytea *blob, uint32 i, bytea *bucket, int64 e)
+{
+    mfvwindow *w = (mfvwindow *)VARDATA(blob);
+    size_t     need = MAXALIGN(VARSIZE(bucket));
+
+    if (w->slots[i].offset == 0 || need > w->slots[i].room) {
+        size_t end = mfvw_end(w, i);
+
+        if (end + need > VARSIZE(blob)) {
+            blob = mfvw_grow(blob, i, need);
+            w = (mfvwindow *)VARDATA(blob);
+            end = mfvw_end(w, i);
+        }
+        w->slots[i].offset = end;
+        w->slots[i].room = need;
+    }
+    memcpy(MFV_WINDOW_BUCKET(blob, i), bucket, VARSIZE(bucket));
+    SET_VARSIZE(MFV_WINDOW_BUCKET(blob, i), w->slots[i].room);
+    w->slots[i].epoch = e;
+    return blob;
+}
+
+/*!
+ * a copy of a window sketch with the sketches of all slots but slot i
+ * packed together, and free space after them for at least need bytes.
+ * The copy doubles the space in use, so that growing the window sketch
+ * costs O(1) amortized per byte stored.
+ */
+static bytea *mfvw_grow(bytea *blob, uint32 i, size_t need)
+{
+    mfvwindow *w = (mfvwindow *)VARDATA(blob);
+    size_t     sz = MFV_WINDOW_SZ(w->nbuckets);
+    size_t     live = 0;
+    bytea *    newblob;
+    mfvwindow *neww;
+    uint32     j;
+
+    for (j = 0; j < w->nbuckets; j++)
+        if (j != i && w->slots[j].offset)
+            live += w->slots[j].room;
+    if (sz + 2*(live + need) > MaxAllocSize)
+        elog(ERROR, "window sketch too large");
+
+    newblob = (bytea *)palloc0(sz + 2*(live + need));
+    memcpy(newblob, blob, sz);
+    SET_VARSIZE(newblob, sz + 2*(live + need));
+    neww = (mfvwindow *)VARDATA(newblob);
+    for (j = 0; j < w->nbuckets; j++) {
+        if (j == i || w->slots[j].offset == 0) {
+            neww->slots[j].offset = 0;
+            neww->slots[j].room = 0;
+            continue;
+        }
+        memcpy((char *)newblob + sz, MFV_WINDOW_BUCKET(blob, j),
+               w->slots[j].room);
+        neww->slots[j].offset = sz;
+        sz += w->slots[j].room;
+    }
+    return newblob;
+}
+
+/*!
+ * merge two window sketches of the same shape into a new one, as for
+ * sliding-window CountMin sketches
+ */
+static bytea *mfvw_merge_c(bytea *blob1, bytea *blob2)
+{
+    mfvwindow *w1 = (mfvwindow *)VARDATA(blob1);
+    mfvwindow *w2 = (mfvwindow *)VARDATA(blob2);
+    int64      latest = Max(w1->latest, w2->latest);
+    bytea **   buckets;
+    int64 *    epochs;
+    bytea *    blob;
+    uint32     i;
+
+    if (w1->nbuckets != w2->nbuckets || w1->width != w2->width
+        || w1->max_mfvs != w2->max_mfvs)
+        elog(ERROR, "cannot merge window sketches of different shapes");
+    if (w1->typOid != w2->typOid)
+        elog(ERROR, "cannot merge MFV sketches of different types");
+
+    buckets = (bytea **)palloc(w1->nbuckets*sizeof(bytea *));
+    epochs = (int64 *)palloc(w1->nbuckets*sizeof(int64));
+    for (i = 0; i < w1->nbuckets; i++) {
+        int64 e1 = w1->slots[i].offset ? w1->slots[i].epoch : WINDOW_EMPTY;
+        int64 e2 = w2->slots[i].offset ? w2->slots[i].epoch : WINDOW_EMPTY;
+        bool  live1 = window_live(e1, latest, w1->nbuckets);
+        bool  live2 = window_live(e2, latest, w1->nbuckets);
+
+        buckets[i] = NULL;
+        epochs[i] = WINDOW_EMPTY;
+        if (live1 && live2 && e1 == e2)
+            buckets[i] = mfvsketch_merge_c(MFV_WINDOW_BUCKET(blob1, i),
+                                           MFV_WINDOW_BUCKET(blob2, i));
+        else if (live1 && (!live2 || e1 > e2))
+            buckets[i] = MFV_WINDOW_BUCKET(blob1, i);
+        else if (live2)
+            buckets[i] = MFV_WINDOW_BUCKET(blob2, i);
+        if (buckets[i] != NULL)
+            epochs[i] = (live1 && (!live2 || e1 >= e2)) ? e1 : e2;
+    }
+    blob = mfvw_build(blob1, buckets, epochs);
+    ((mfvwindow *)VARDATA(blob))->latest = latest;
+    return blob;
+}
+
+/*!
+ * check that a bytea holds a sliding-window MFV sketch, and return it
+ */
+static mfvwindow *mfvw_check(bytea *blob)
+{
+    mfvwindow *w = (mfvwindow *)VARDATA(blob);
+    uint32     i;
+
+    if (VARSIZE(blob) < VARHDRSZ + sizeof(mfvwindow)
+        || w->magic != MFV_WINDOW_MAGIC || w->version != MFV_WINDOW_VERSION)
+        elog(ERROR, "not a sliding-window MFV sketch");
+    if (w->nbuckets < 1 || w->width <= 0
+        || VARSIZE(blob) < MFV_WINDOW_SZ(w->nbuckets))
+        elog(ERROR, "corrupt sliding-window MFV sketch");
+    for (i = 0; i < w->nbuckets; i++) {
+        uint32 off = w->slots[i].offset;
+
+        if (off == 0)
+            continue;
+        if (off < MFV_WINDOW_SZ(w->nbuckets)
+            || off > VARSIZE(blob) - VARHDRSZ
+            || w->slots[i].room > VARSIZE(blob) - off
+            || VARSIZE(MFV_WINDOW_BUCKET(blob, i)) > w->slots[i].room)
+            elog(ERROR, "corrupt sliding-window MFV sketch");
+        mfv_check(MFV_WINDOW_BUCKET(blob, i));
+    }
+    return w;
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_window_trans);
+
+/*!
+ * UDA transition function for mfvsketch_window.  The arguments are the
+ * value, the number of frequent values, the timestamp, the bucket width
+ * and the number of buckets.
+ */
+Datum __mfvsketch_window_trans(PG_FUNCTION_ARGS)
+{
+    bytea *      blob = PG_GETARG_BYTEA_P(0);
+    Datum        newdatum = PG_GETARG_DATUM(1);
+    mfvwindow *  w;
+    mfvtransval *transval;
+    bytea *      bucket, *newbucket;
+    int64        e;
+    uint32       slot;
+    void *       valp;
+    size_t       len;
+
+    if (!(fcinfo->context &&
+          (IsA(fcinfo->context, AggState)
+    #ifdef NOTGP
+           || IsA(fcinfo->context, WindowAggState)
+    #endif
+          )))
+        elog(ERROR,
+             "destructive pass by reference outside agg");
+
+    /* ignore rows with a NULL value or timestamp */
+    if (PG_ARGISNULL(1) || PG_ARGISNULL(3))
+        PG_RETURN_BYTEA_P(blob);
+
+    if (VARSIZE(blob) <= VARHDRSZ)
+        blob = mfvw_new(PG_GETARG_INT32(5),
+                        window_bucket_width(PG_GETARG_INTERVAL_P(4)),
+                        PG_GETARG_INT32(2),
+                        get_fn_expr_argtype(fcinfo->flinfo, 1));
+    w = (mfvwindow *)VARDATA(blob);
+    e = window_epoch(PG_GETARG_TIMESTAMPTZ(3), w->width);
+    slot = window_slot(e, w->nbuckets);
+
+    if (w->latest == WINDOW_EMPTY || e > w->latest)
+        w->latest = e;
+    else if (!window_live(e, w->latest, w->nbuckets))
+        /* too old for the window */
+        PG_RETURN_BYTEA_P(blob);
+
+    if (w->slots[slot].offset == 0 || w->slots[slot].epoch != e) {
+        /* start a sketch for the bucket, dropping one that left the window */
+        blob = mfvw_place(blob, slot,
+                          mfv_init_transval(w->max_mfvs, w->typOid), e);
+        w = (mfvwindow *)VARDATA(blob);
+    }
+
+    bucket = MFV_WINDOW_BUCKET(blob, slot);
+    transval = (mfvtransval *)VARDATA(bucket);
+    if (transval->typLen == -1)
+        newdatum = PointerGetDatum(PG_DETOAST_DATUM_PACKED(newdatum));
+    len = MFV_DATUM_LEN(newdatum, transval);
+    valp = DatumExtractPointer(newdatum, transval->typByVal);
+    newbucket = mfv_transval_add(bucket, valp, len,
+                                 mfv_hash(newdatum, transval), 1);
+    if (newbucket != bucket)
+        /* the bucket sketch outgrew the room of its slot */
+        blob = mfvw_place(blob, slot, newbucket, e);
+    PG_RETURN_BYTEA_P(blob);
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_window_merge);
+
+/*!
+ * UDA prefunc to merge the window sketches of two segments.  Also the
+ * transition function of mfvsketch_window_merge, over stored sketches.
+ */
+Datum __mfvsketch_window_merge(PG_FUNCTION_ARGS)
+{
+    bytea *blob1 = PG_GETARG_BYTEA_P(0);
+    bytea *blob2 = PG_GETARG_BYTEA_P(1);
+
+    if (VARSIZE(blob2) <= VARHDRSZ)
+        PG_RETURN_BYTEA_P(blob1);
+    mfvw_check(blob2);
+    if (VARSIZE(blob1) <= VARHDRSZ)
+        PG_RETURN_BYTEA_P(blob2);
+    mfvw_check(blob1);
+    PG_RETURN_BYTEA_P(mfvw_merge_c(blob1, blob2));
+}
+
+PG_FUNCTION_INFO_V1(__mfvsketch_window_final);
+
+/*!
+ * UDA final function for the window sketch aggregates: the sketch with
+ * its bucket sketches compacted and the buckets that have left the window
+ * dropped, or NULL if there were no rows
+ */
+Datum __mfvsketch_window_final(PG_FUNCTION_ARGS)
+{
+    bytea *    blob = PG_GETARG_BYTEA_P(0);
+    mfvwindow *w;
+    bytea **   buckets;
+    int64 *    epochs;
+    uint32     i;
+
+    if (VARSIZE(blob) <= VARHDRSZ)
+        PG_RETURN_NULL();
+    w = (mfvwindow *)VARDATA(blob);
+
+    buckets = (bytea **)palloc(w->nbuckets*sizeof(bytea *));
+    epochs = (int64 *)palloc(w->nbuckets*sizeof(int64));
+    for (i = 0; i < w->nbuckets; i++) {
+        buckets[i] = NULL;
+        epochs[i] = WINDOW_EMPTY;
+        if (w->slots[i].offset
+            && window_live(w->slots[i].epoch, w->latest, w->nbuckets)) {
+            buckets[i] = mfv_compacted(MFV_WINDOW_BUCKET(blob, i));
+            epochs[i] = w->slots[i].epoch;
+        }
+    }
+    PG_RETURN_BYTEA_P(mfvw_build(blob, buckets, epochs));
+}
+
+PG_FUNCTION_INFO_V1(mfvsketch_window_histogram);
+
+/*!
+ * UDF for the histogram of the most frequent values in the window ending
+ * at a given time, or by default at the newest bucket counted.  The
+ * bucket sketches of the window are merged, and the result is that of
+ * mfvsketch_top_histogram; NULL if the window is empty.
+ */
+Datum mfvsketch_window_histogram(PG_FUNCTION_ARGS)
+{
+    bytea *    blob = PG_GETARG_BYTEA_P(0);
+    mfvwindow *w = mfvw_check(blob);
+    int64      end = (PG_NARGS() > 1)
+                     ? window_epoch(PG_GETARG_TIMESTAMPTZ(1), w->width)
+                     : w->latest;
+    bytea *    merged = NULL;
+    uint32     i;
+
+    for (i = 0; i < w->nbuckets; i++) {
+        if (w->slots[i].offset == 0
+            || !window_live(w->slots[i].epoch, end, w->nbuckets))
+            continue;
+        merged = (merged == NULL) ? MFV_WINDOW_BUCKET(blob, i)
+                 : mfvsketch_merge_c(merged, MFV_WINDOW_BUCKET(blob, i));
+    }
+    if (merged == NULL)
+        PG_RETURN_NULL();
+    PG_RETURN_DATUM(DirectFunctionCall1(__mfvsketch_final,
+                                        PointerGetDatum(merged)));
+}
@@ -227,6 +227,62 @@ SparseData arr_to_sdata(char *array, size_t width, Oid type_of_data, int count){
 }
 
 
+/* Extends the run currently being built by sorted_pairs_to_sdata() with len
+ * copies of val, flushing the previous run if the value differs.
+ */
+static inline void extend_pending_run(double *run_val, int64 *run_len,
+		double val, int64 len, SparseData sdata)
+{
+	if (*run_len > 0 && memcmp(run_val,&val,sizeof(float8)) == 0) {
+		*run_len += len;
+		return;
+	}
+	if (*run_len > 0)
+		add_run_to_sdata((char *)run_val,*run_len,sizeof(float8),sdata);
+	*run_val = val;
+	*run_len = len;
+}
+
+/**
+ * Builds a SparseData directly from the non-zero entries of a vector, without
+ * materializing the dense array. Runs of equal values and the zero gaps
+ * between entries are merged, so the result is identical to what
+ * float8arr_to_sdata() produces on the corresponding dense array.
+ *
+ * @param idx Strictly increasing, zero-based positions of the entries
+ * @param vals The values at the positions in idx
+ * @param nnz The number of entries in idx and vals
+ * @param dimension The total number of elements in the result
+ * @return A SparseData of size dimension holding vals[k] at position idx[k]
+ * and zero everywhere else
+ */
+SparseData sorted_pairs_to_sdata(int64 *idx, double *vals, int nnz,
+		int64 dimension)
+{
+	SparseData sdata = makeSparseData();
+	double run_val = 0.;
+	int64 run_len = 0;
+	int64 pos = 0;
+
+	for (int k=0; k<nnz; k++) {
+		if (idx[k] < pos || idx[k] >= dimension)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("position %lld is out of order or exceeds the dimension %lld",
+					(long long int)idx[k]+1,(long long int)dimension)));
+		if (idx[k] > pos)
+			extend_pending_run(&run_val,&run_len,0.,idx[k]-pos,sdata);
+		extend_pending_run(&run_val,&run_len,vals[k],1,sdata);
+		pos = idx[k]+1;
+	}
+	if (pos < dimension)
+		extend_pending_run(&run_val,&run_len,0.,dimension-pos,sdata);
+	if (run_len > 0)
+		add_run_to_sdata((char *)&run_val,run_len,sizeof(float8),sdata);
+
+	return sdata;
+}
+
 /**
  * @param sdata The SparseData to be converted to an array of float8s
  * @return A float8[] representation of a SparseData
@@ -487,17 +543,39 @@ static bool lapply_error_checking(Oid foid, List * funcname);
  * @return A SparseData with the same dimension as sdata but with each element sdata[i] replaced by func(sdata[i]) 
  */
 SparseData lapply(text * func, SparseData sdata) {
+	FmgrInfo flinfo;
+
+	fmgr_info(lapply_lookup(func), &flinfo);
+	return lapply_fmgr(&flinfo, sdata);
+}
+
+/**
+ * Looks up the function applied by lapply().
+ *
+ * @param func The name of a function taking and returning a float8
+ * @return The Oid of the function
+ */
+Oid lapply_lookup(text * func) {
 	Oid argtypes[1] = { FLOAT8OID };
 	List * funcname = textToQualifiedNameList(func);
-	SparseData result = makeSparseDataCopy(sdata);
 	Oid foid = LookupFuncName(funcname, 1, argtypes, false);
 
 	lapply_error_checking(foid, funcname);
+	return foid;
+}
+
+/**
+ * Applies a function, already looked up with lapply_lookup(), to all
+ * elements of a sparse data. Callers that apply the same function to many
+ * sparse data should keep the FmgrInfo between calls.
+ */
+SparseData lapply_fmgr(FmgrInfo * flinfo, SparseData sdata) {
+	SparseData result = makeSparseDataCopy(sdata);
 
 	for (int i=0; i<sdata->unique_value_count; i++)
 		valref(float8,result,i) = 
 		    DatumGetFloat8(
-		      OidFunctionCall1(foid,
+		      FunctionCall1(flinfo,
 				    Float8GetDatum(valref(float8,sdata,i))));
 	return result;
 }
@@ -24,6 +24,7 @@
 #include <math.h>
 #include <string.h>
 #include "postgres.h"
+#include "fmgr.h"
 #include "lib/stringinfo.h"
 #include "utils/array.h"
 #include "catalog/pg_type.h"
@@ -149,9 +150,13 @@ double *sdata_to_float8arr(SparseData sdata);
 int64 *sdata_index_to_int64arr(SparseData sdata);
 SparseData float8arr_to_sdata(double *array, int count);
 SparseData arr_to_sdata(char *array, size_t width, Oid type_of_data, int count);
+SparseData sorted_pairs_to_sdata(int64 *idx, double *vals, int nnz,
+		int64 dimension);
 
 /* Some functions for accessing and changing elements of a SparseData */
 SparseData lapply(text * func, SparseData sdata);
+Oid lapply_lookup(text * func);
+SparseData lapply_fmgr(FmgrInfo * flinfo, SparseData sdata);
 double sd_proj(SparseData sdata, int idx);
 SparseData subarr(SparseData sdata, int start, int end);
 SparseData reverse(SparseData sdata);
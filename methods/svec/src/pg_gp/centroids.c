@@ -0,0 +1,598 @@
+/**
+ * @file centroids.c
+ *
+ * @brief Nearest-centroid search over svecs
+ *
+ * k-means assigns every point to the closest of an array of centroids, and
+ * calls svec_closest_centroid() once per point with the same array. Decoding
+ * that array (detoasting it, and expanding the runs of every centroid) costs
+ * as much as the distances themselves, so it is done once per query: the
+ * centroids are kept in fn_extra as a dense row-major matrix, together with
+ * their squared norms, under a copy of the array datum they came from.
+ *
+ * Squared distances are compared, so no square roots are taken. For a point
+ * with few nonzeros,
+ *
+ *     ||p - c||^2 = ||p||^2 - 2 p.c + ||c||^2
+ *
+ * needs only the coordinates in the nonzero runs of p. A mostly dense point
+ * is expanded instead and compared to every row directly, which avoids the
+ * cancellation of that formula. For a sparse point, the distance to the
+ * second closest centroid is a lower bound that k-means relies on, so it is
+ * lowered by the rounding error the formula can make.
+ *
+ * k-means|| seeding uses the same search for the distance of every point to
+ * the closest candidate, and svec_kmeans_recluster() reduces the weighted
+ * candidates to k centroids in memory.
+ */
+
+#include <postgres.h>
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "catalog/pg_type.h"
+
+#include "sparse_vector.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+ * The centroids of the last array seen, cached in fn_extra. NULL centroids
+ * (clusters that lost all their points) keep a row but are never chosen.
+ */
+typedef struct {
+	struct varlena *raw;	/**< copy of the array datum, as passed */
+	int k;			/**< number of centroids */
+	int lbound;		/**< subscript of the first centroid */
+	int dimension;		/**< dimension of every centroid */
+	bool *isnull;		/**< which centroids are NULL */
+	double *matrix;		/**< k rows of dimension values */
+	double *norms;		/**< squared norm of each row */
+	double *point;		/**< scratch row for expanding a dense point */
+} CentroidCache;
+
+static CentroidCache *centroid_cache(FunctionCallInfo fcinfo,
+		struct varlena *raw);
+static void centroid_cache_fill(CentroidCache *cache, ArrayType *array);
+
+/* Computes the squared distance between two dense rows of length n */
+static double dense_sqdist(const double *a, const double *b, int n)
+{
+	int i = 0;
+	double accum;
+#ifdef __AVX2__
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double lanes[4];
+
+	for (; i+8 <= n; i += 8) {
+		__m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a+i),
+					   _mm256_loadu_pd(b+i));
+		__m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a+i+4),
+					   _mm256_loadu_pd(b+i+4));
+		acc0 = _mm256_add_pd(acc0,_mm256_mul_pd(d0,d0));
+		acc1 = _mm256_add_pd(acc1,_mm256_mul_pd(d1,d1));
+	}
+	_mm256_storeu_pd(lanes,_mm256_add_pd(acc0,acc1));
+	accum = (lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+#else
+	double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+
+	for (; i+4 <= n; i += 4) {
+		double d0 = a[i]-b[i],     d1 = a[i+1]-b[i+1];
+		double d2 = a[i+2]-b[i+2], d3 = a[i+3]-b[i+3];
+
+		s0 += d0*d0; s1 += d1*d1;
+		s2 += d2*d2; s3 += d3*d3;
+	}
+	accum = (s0+s1)+(s2+s3);
+#endif
+	for (; i < n; i++) accum += (a[i]-b[i])*(a[i]-b[i]);
+	return accum;
+}
+
+/**
+ * Returns the centroids of the array datum raw, decoding them only if raw
+ * differs from the datum the cache was filled from.
+ */
+static CentroidCache *centroid_cache(FunctionCallInfo fcinfo,
+		struct varlena *raw)
+{
+	CentroidCache *cache = (CentroidCache *)fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+
+	if (cache != NULL && VARSIZE_ANY(cache->raw) == VARSIZE_ANY(raw)
+	    && memcmp(cache->raw, raw, VARSIZE_ANY(raw)) == 0)
+		return cache;
+
+	if (cache == NULL)
+		cache = (CentroidCache *)MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(CentroidCache));
+	else {
+		pfree(cache->raw);
+		pfree(cache->isnull);
+		pfree(cache->matrix);
+		pfree(cache->norms);
+		pfree(cache->point);
+		cache->raw = NULL;
+	}
+	fcinfo->flinfo->fn_extra = cache;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	centroid_cache_fill(cache,
+			    DatumGetArrayTypeP(PointerGetDatum(raw)));
+	cache->raw = (struct varlena *)palloc(VARSIZE_ANY(raw));
+	memcpy(cache->raw, raw, VARSIZE_ANY(raw));
+	MemoryContextSwitchTo(oldcontext);
+	return cache;
+}
+
+/**
+ * Expands the centroids of an svec[] into the matrix of a cache, allocating
+ * it in the current memory context. NULL (NVP) entries are treated as zeros.
+ */
+static void centroid_cache_fill(CentroidCache *cache, ArrayType *array)
+{
+	Datum *elems;
+	bool *nulls;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	int k;
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("centroids must be a one-dimensional array")));
+	get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+	deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval,
+			  typalign, &elems, &nulls, &k);
+
+	cache->k = k;
+	cache->lbound = (ARR_NDIM(array) == 1) ? ARR_LBOUND(array)[0] : 1;
+	cache->dimension = 0;
+	for (int i = 0; i < k; i++) {
+		SvecType *svec;
+
+		if (nulls[i]) continue;
+		svec = DatumGetSvecTypeP(elems[i]);
+		if (IS_SCALAR(svec))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("centroids must be vectors, not scalars")));
+		if (cache->dimension == 0)
+			cache->dimension = svec->dimension;
+		else if (svec->dimension != cache->dimension)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("centroids have different dimensions: %d and %d",
+					cache->dimension, svec->dimension)));
+	}
+	if ((double)k * cache->dimension * sizeof(double) >= MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("%d centroids of dimension %d are too many to cache",
+				k, cache->dimension)));
+
+	cache->isnull = (bool *)palloc(Max(k,1) * sizeof(bool));
+	cache->matrix = (double *)palloc0(Max((Size)k * cache->dimension,1)
+					  * sizeof(double));
+	cache->norms = (double *)palloc0(Max(k,1) * sizeof(double));
+	cache->point = (double *)palloc(Max(cache->dimension,1)
+					* sizeof(double));
+
+	for (int i = 0; i < k; i++) {
+		SvecType *svec;
+		double *row = cache->matrix + (Size)i * cache->dimension;
+		double *vals;
+		char *ix;
+		int64 coord = 0;
+
+		cache->isnull[i] = nulls[i];
+		if (nulls[i]) continue;
+		svec = DatumGetSvecTypeP(elems[i]);
+		vals = (double *)SVEC_VALS_PTR(svec);
+		ix = SVEC_INDEX_PTR(svec);
+		for (int r = 0; r < SVEC_UNIQUE_VALCNT(svec); r++) {
+			int64 run_len = compword_to_int8(ix);
+
+			if (vals[r] != 0. && !IS_NVP(vals[r])) {
+				for (int64 c = coord; c < coord + run_len; c++)
+					row[c] = vals[r];
+				cache->norms[i] += vals[r] * vals[r] * run_len;
+			}
+			coord += run_len;
+			ix += int8compstoragesize(ix);
+		}
+	}
+}
+
+/**
+ * Returns the (zero-based) row of the cache closest to an svec, and its
+ * squared distance in *sqdist, or -1 if all the centroids are NULL. If second
+ * is not NULL, it receives the squared distance to the second closest row,
+ * or HUGE_VAL if there is none; for a sparse point, a lower bound on it.
+ */
+static int closest_centroid(CentroidCache *cache, SvecType *svec,
+		double *sqdist, double *second)
+{
+	double *vals = (double *)SVEC_VALS_PTR(svec);
+	int nruns = SVEC_UNIQUE_VALCNT(svec);
+	int64 *starts, *lens;
+	double *runvals;
+	int64 nnz = 0, coord = 0;
+	double pnorm = 0., best = 0., runnerup = HUGE_VAL;
+	int nlive = 0, closest = -1;
+	char *ix;
+
+	if (IS_SCALAR(svec) || svec->dimension != cache->dimension) {
+		if (cache->dimension == 0) return -1;
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_closest_centroid: dimension of the point (%d) and the centroids (%d) are not the same",
+				svec->dimension, cache->dimension)));
+	}
+
+	/* the nonzero runs of the point */
+	starts = (int64 *)palloc(Max(nruns,1) * sizeof(int64));
+	lens = (int64 *)palloc(Max(nruns,1) * sizeof(int64));
+	runvals = (double *)palloc(Max(nruns,1) * sizeof(double));
+	ix = SVEC_INDEX_PTR(svec);
+	for (int r = 0; r < nruns; r++) {
+		int64 run_len = compword_to_int8(ix);
+
+		if (vals[r] != 0. && !IS_NVP(vals[r])) {
+			starts[nlive] = coord;
+			lens[nlive] = run_len;
+			runvals[nlive++] = vals[r];
+			nnz += run_len;
+			pnorm += vals[r] * vals[r] * run_len;
+		}
+		coord += run_len;
+		ix += int8compstoragesize(ix);
+	}
+
+	if (4 * nnz >= cache->dimension) {
+		/* mostly dense: expand the point and compare rows directly */
+		memset(cache->point, 0, cache->dimension * sizeof(double));
+		for (int r = 0; r < nlive; r++)
+			for (int64 c = starts[r]; c < starts[r] + lens[r]; c++)
+				cache->point[c] = runvals[r];
+		for (int i = 0; i < cache->k; i++) {
+			double d;
+
+			if (cache->isnull[i]) continue;
+			d = dense_sqdist(cache->point,
+					 cache->matrix + (Size)i * cache->dimension,
+					 cache->dimension);
+			if (closest < 0 || d < best) {
+				if (closest >= 0) runnerup = best;
+				best = d;
+				closest = i;
+			} else if (d < runnerup)
+				runnerup = d;
+		}
+	} else {
+		/*
+		 * sparse: only the coordinates of the nonzero runs matter. The
+		 * rounding error of the expansion is below (nnz + 4) epsilon
+		 * times ||p||^2 + 2|p.c| + ||c||^2 <= 2 (||p||^2 + ||c||^2), and
+		 * the runner-up is lowered by that much, so that it stays a
+		 * lower bound.
+		 */
+		double bestslack = 0.;
+
+		for (int i = 0; i < cache->k; i++) {
+			const double *row = cache->matrix
+					    + (Size)i * cache->dimension;
+			double slack = 2. * (nnz + 4) * DBL_EPSILON
+				       * (pnorm + cache->norms[i]);
+			double dot = 0., d;
+
+			if (cache->isnull[i]) continue;
+			for (int r = 0; r < nlive; r++) {
+				double sum = 0.;
+
+				for (int64 c = starts[r]; c < starts[r] + lens[r]; c++)
+					sum += row[c];
+				dot += runvals[r] * sum;
+			}
+			d = pnorm - 2. * dot + cache->norms[i];
+			if (closest < 0 || d < best) {
+				if (closest >= 0)
+					runnerup = Min(runnerup, best - bestslack);
+				best = d;
+				bestslack = slack;
+				closest = i;
+			} else if (d - slack < runnerup)
+				runnerup = d - slack;
+		}
+	}
+
+	pfree(starts);
+	pfree(lens);
+	pfree(runvals);
+	/* the expansion of the norm can round below zero */
+	*sqdist = Max(best, 0.);
+	if (second != NULL) *second = Max(runnerup, 0.);
+	return closest;
+}
+
+PG_FUNCTION_INFO_V1( svec_closest_centroid );
+/**
+ * svec_closest_centroid - returns the subscript of the centroid closest to
+ * an svec in Euclidean distance
+ *
+ * Arguments: the svec and an array of svec centroids. NULL centroids are
+ * skipped, and ties go to the lowest subscript. Returns NULL if all the
+ * centroids are NULL. NULL (NVP) entries are treated as zeros.
+ */
+Datum svec_closest_centroid(PG_FUNCTION_ARGS)
+{
+	CentroidCache *cache = centroid_cache(fcinfo,
+			(struct varlena *)PG_GETARG_POINTER(1));
+	double sqdist;
+	int closest = closest_centroid(cache, PG_GETARG_SVECTYPE_P(0), &sqdist,
+				       NULL);
+
+	if (closest < 0) PG_RETURN_NULL();
+	PG_RETURN_INT32(cache->lbound + closest);
+}
+
+PG_FUNCTION_INFO_V1( svec_closest_centroid_sqdist );
+/**
+ * svec_closest_centroid_sqdist - returns the squared Euclidean distance
+ * between an svec and the centroid closest to it
+ *
+ * Arguments and NULL handling as for svec_closest_centroid().
+ */
+Datum svec_closest_centroid_sqdist(PG_FUNCTION_ARGS)
+{
+	CentroidCache *cache = centroid_cache(fcinfo,
+			(struct varlena *)PG_GETARG_POINTER(1));
+	double sqdist;
+
+	if (closest_centroid(cache, PG_GETARG_SVECTYPE_P(0), &sqdist, NULL) < 0)
+		PG_RETURN_NULL();
+	PG_RETURN_FLOAT8(sqdist);
+}
+
+PG_FUNCTION_INFO_V1( svec_closest_centroid_bounds );
+/**
+ * svec_closest_centroid_bounds - returns the subscript of the centroid
+ * closest to an svec, together with the Euclidean distances to the closest
+ * and the second closest centroid
+ *
+ * The distances are the upper and lower bounds that k-means keeps for every
+ * point between refreshes (see the kmeans module); for a sparse point, the
+ * second is lowered by the rounding error of its computation. The result is a
+ * float8 array {subscript, closest, second}, where second is Infinity if
+ * there is only one centroid. Arguments and NULL handling as for
+ * svec_closest_centroid().
+ */
+Datum svec_closest_centroid_bounds(PG_FUNCTION_ARGS)
+{
+	CentroidCache *cache = centroid_cache(fcinfo,
+			(struct varlena *)PG_GETARG_POINTER(1));
+	double sqdist, second;
+	int closest = closest_centroid(cache, PG_GETARG_SVECTYPE_P(0), &sqdist,
+				       &second);
+	float8 result[3];
+
+	if (closest < 0) PG_RETURN_NULL();
+	result[0] = cache->lbound + closest;
+	result[1] = sqrt(sqdist);
+	result[2] = sqrt(second);
+	PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)result, 3, FLOAT8OID,
+					      sizeof(float8), true, 'd'));
+}
+
+/* Returns a uniform random number in [0,1) */
+#define RANDOM_RANGE	(((double)random())/(2147483647.+1))
+
+/* Number of Lloyd iterations of svec_kmeans_recluster() */
+#define RECLUSTER_ITERATIONS	10
+
+/**
+ * Returns the index of a random element of weights, each with a probability
+ * proportional to its weight. The weights must sum up to total > 0.
+ */
+static int weighted_choice(const double *weights, int n, double total)
+{
+	double r = RANDOM_RANGE * total;
+	int last = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (weights[i] <= 0.) continue;
+		last = i;
+		r -= weights[i];
+		if (r < 0.) return i;
+	}
+	/* rounding: fall back to the last element of positive weight */
+	return last;
+}
+
+/**
+ * Assigns each candidate of positive weight to its closest center, and
+ * returns whether any assignment changed.
+ */
+static bool assign_candidates(const CentroidCache *cand, const double *weights,
+		const double *centers, int ncenters, int *assign)
+{
+	bool changed = false;
+
+	for (int i = 0; i < cand->k; i++) {
+		const double *row = cand->matrix + (Size)i * cand->dimension;
+		double best = 0.;
+		int closest = 0;
+
+		if (weights[i] <= 0.) continue;
+		for (int c = 0; c < ncenters; c++) {
+			double d = dense_sqdist(row,
+					centers + (Size)c * cand->dimension,
+					cand->dimension);
+
+			if (c == 0 || d < best) {
+				best = d;
+				closest = c;
+			}
+		}
+		if (assign[i] != closest) {
+			assign[i] = closest;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+PG_FUNCTION_INFO_V1( svec_kmeans_recluster );
+/**
+ * svec_kmeans_recluster - clusters weighted candidate centroids into k
+ * centroids
+ *
+ * This is the last step of k-means|| seeding: the candidates are seeded with
+ * k-means++, where the probability of a candidate is proportional to its
+ * weight times its squared distance to the closest center chosen so far, and
+ * then refined with a few iterations of weighted Lloyd's algorithm.
+ *
+ * Arguments: an svec array of candidates, a float8 array of their weights
+ * (such as the number of points closest to each candidate) and k. NULL
+ * candidates and candidates of weight zero are ignored. Returns an svec array
+ * of at most k centroids; fewer if there are fewer distinct candidates.
+ */
+Datum svec_kmeans_recluster(PG_FUNCTION_ARGS)
+{
+	ArrayType *candidates = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *weightarr = PG_GETARG_ARRAYTYPE_P(1);
+	int k = PG_GETARG_INT32(2);
+	CentroidCache cand;
+	double *weights, *mind, *score, *centers, *sums, *wsums, total = 0.;
+	int *assign;
+	int maxcenters, ncenters = 0, dim;
+	Datum *elems;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+
+	if (k <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_kmeans_recluster: k must be positive")));
+	if (ARR_ELEMTYPE(weightarr) != FLOAT8OID || ARR_NDIM(weightarr) > 1
+	    || ARR_HASNULL(weightarr))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_kmeans_recluster: weights must be a one-dimensional float8 array without NULLs")));
+
+	memset(&cand, 0, sizeof(CentroidCache));
+	centroid_cache_fill(&cand, candidates);
+	if (ArrayGetNItems(ARR_NDIM(weightarr), ARR_DIMS(weightarr)) != cand.k)
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("svec_kmeans_recluster: %d candidates but %d weights",
+				cand.k, ArrayGetNItems(ARR_NDIM(weightarr),
+						       ARR_DIMS(weightarr)))));
+	dim = cand.dimension;
+
+	weights = (double *)palloc(Max(cand.k,1) * sizeof(double));
+	mind = (double *)palloc(Max(cand.k,1) * sizeof(double));
+	score = (double *)palloc(Max(cand.k,1) * sizeof(double));
+	assign = (int *)palloc(Max(cand.k,1) * sizeof(int));
+	for (int i = 0; i < cand.k; i++) {
+		double w = ((double *)ARR_DATA_PTR(weightarr))[i];
+
+		if (w < 0. || isnan(w))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("svec_kmeans_recluster: weights must not be negative")));
+		weights[i] = cand.isnull[i] ? 0. : w;
+		total += weights[i];
+		assign[i] = -1;
+	}
+
+	maxcenters = Min(k, cand.k);
+	centers = (double *)palloc(Max((Size)maxcenters * dim,1)
+				   * sizeof(double));
+
+	/* k-means++: the first center is drawn by weight alone */
+	if (total > 0. && dim > 0) {
+		int first = weighted_choice(weights, cand.k, total);
+
+		memcpy(centers, cand.matrix + (Size)first * dim,
+		       dim * sizeof(double));
+		ncenters = 1;
+		for (int i = 0; i < cand.k; i++)
+			mind[i] = dense_sqdist(cand.matrix + (Size)i * dim,
+					       centers, dim);
+	}
+	while (ncenters > 0 && ncenters < maxcenters) {
+		double *newest = centers + (Size)ncenters * dim;
+		int next;
+
+		total = 0.;
+		for (int i = 0; i < cand.k; i++) {
+			score[i] = weights[i] * mind[i];
+			total += score[i];
+		}
+		/* the remaining candidates coincide with the centers */
+		if (!(total > 0.)) break;
+		next = weighted_choice(score, cand.k, total);
+
+		memcpy(newest, cand.matrix + (Size)next * dim,
+		       dim * sizeof(double));
+		ncenters++;
+		for (int i = 0; i < cand.k; i++) {
+			double d = dense_sqdist(cand.matrix + (Size)i * dim,
+						newest, dim);
+
+			if (d < mind[i]) mind[i] = d;
+		}
+	}
+
+	/* weighted Lloyd's algorithm */
+	sums = (double *)palloc(Max((Size)ncenters * dim,1) * sizeof(double));
+	wsums = (double *)palloc(Max(ncenters,1) * sizeof(double));
+	assign_candidates(&cand, weights, centers, ncenters, assign);
+	for (int iter = 0; iter < RECLUSTER_ITERATIONS && ncenters > 0; iter++) {
+		memset(sums, 0, (Size)ncenters * dim * sizeof(double));
+		memset(wsums, 0, ncenters * sizeof(double));
+		for (int i = 0; i < cand.k; i++) {
+			const double *row = cand.matrix + (Size)i * dim;
+			double *sum = sums + (Size)assign[i] * dim;
+
+			if (weights[i] <= 0.) continue;
+			for (int j = 0; j < dim; j++)
+				sum[j] += weights[i] * row[j];
+			wsums[assign[i]] += weights[i];
+		}
+		/* a center without candidates keeps its position */
+		for (int c = 0; c < ncenters; c++)
+			if (wsums[c] > 0.)
+				for (int j = 0; j < dim; j++)
+					centers[(Size)c * dim + j] =
+						sums[(Size)c * dim + j] / wsums[c];
+		if (!assign_candidates(&cand, weights, centers, ncenters,
+				       assign))
+			break;
+	}
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(candidates), &typlen, &typbyval,
+			     &typalign);
+	if (ncenters == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(
+			ARR_ELEMTYPE(candidates)));
+	elems = (Datum *)palloc(ncenters * sizeof(Datum));
+	for (int c = 0; c < ncenters; c++)
+		elems[c] = PointerGetDatum(svec_from_float8arr(
+			centers + (Size)c * dim, dim));
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, ncenters,
+			ARR_ELEMTYPE(candidates), typlen, typbyval, typalign));
+}
@@ -11,13 +11,32 @@
 #include "utils/lsyscache.h"
 #include "catalog/pg_type.h"
 #include "access/tupmacs.h"
+#include "access/hash.h"
 
 #include "sparse_vector.h"
 
-static char **get_text_array_contents(ArrayType *array, int *numitems);
-
-SvecType * classify_document(char **features, int num_features, 
-			     char **document, int num_words);
+/*
+ * The dictionary of a gp_extract_feature_histogram() call, hashed for O(1)
+ * word lookup. It lives in fn_extra so that it is built once per query
+ * rather than once per document.
+ */
+typedef struct {
+	struct varlena *raw; /* copy of the dictionary datum, as passed */
+	char *dict_copy;    /* detoasted copy of the dictionary */
+	int num_features;   /* number of entries in the dictionary */
+	uint32 mask;        /* number of hash slots minus one */
+	int *slots;         /* feature number plus one, zero for empty slots */
+	char **words;       /* words, pointing into dict_copy */
+	int *word_lens;     /* lengths of the words */
+} FeatureDictionary;
+
+static char **get_text_array_words(ArrayType *array, int *numitems,
+		int **lens);
+static FeatureDictionary *get_feature_dictionary(FunctionCallInfo fcinfo,
+		struct varlena *raw);
+static int lookup_feature(FeatureDictionary *dict, char *word, int len);
+static SvecType *classify_document(FeatureDictionary *dict,
+		ArrayType *document);
 
 Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS);
 
@@ -75,19 +94,17 @@ void gp_extract_feature_histogram_errout(char *msg);
  * Returns:
  * 	SFV of the document with counts of each feature, stored in a Sparse Vector (svec) datatype
  *
- * TODO:
- * 	Use the built-in hash table structure instead of hsearch()
- * 		The problem with hsearch is that it's not safe to use more than
- * 		one per process.  That means we currently can't do more than one document
- * 		classification per query slice or we'll get the wrong results.
- *	[DONE] Implement a better scheme for detecting whether we're in a new query since
- *	we created the hash table.
- *		Right now we write a key into palloc'ed memory and check to see
- *		if it's the same value on reentry to the classification routine.
- *		This is a hack and may fail in certain circumstances.
- *		A better approach uses the gp_session_id and gp_command_count
- *		to determine if we're in the same query as the last time we were
- *		called.
+ * Implementation notes:
+ * 	The dictionary is hashed once per query and cached in fn_extra, so
+ * 	each document costs one hash probe per word. The dictionary does not
+ * 	need to be sorted; if a word occurs more than once in it, the first
+ * 	occurrence is used. The cache is validated on every call by comparing
+ * 	the dictionary argument, as passed (for a stored dictionary, its toast
+ * 	pointer), with a saved copy, so a query that passes a different
+ * 	dictionary for each row still gets the right answer.
+ * 	The resulting svec is built from the sorted (feature, count) pairs of
+ * 	the document, so no dense histogram of num_features entries is
+ * 	allocated per document.
  */
 
 /**
@@ -115,30 +132,19 @@ void gp_extract_feature_histogram_errout(char *msg);
 PG_FUNCTION_INFO_V1( gp_extract_feature_histogram );
 Datum gp_extract_feature_histogram(PG_FUNCTION_ARGS)
 {
-	SvecType *returnval;
-	char **features, **document;
-	int num_features, num_words;
+	FeatureDictionary *dict;
 
-        if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
 
         /* Error checking */
         if (PG_NARGS() != 2) 
 		gp_extract_feature_histogram_errout(
 	          "gp_extract_feature_histogram called with wrong number of arguments");
 
-	/* Retrieve the C text array equivalents from the PG text[][] inputs */
-	features = get_text_array_contents(PG_GETARG_ARRAYTYPE_P(0),&num_features);
-	document = get_text_array_contents(PG_GETARG_ARRAYTYPE_P(1),&num_words);
-
-	// elog(NOTICE,"Number of items in the feature array is: %d\n",num_features);
-	// elog(NOTICE,"Number of items in the document array is: %d\n",num_words);
-
-       	returnval = classify_document(features,num_features,document,num_words);
+	dict = get_feature_dictionary(fcinfo,
+				      (struct varlena *) PG_GETARG_POINTER(0));
 
-	pfree(features);
-	pfree(document);
-
-	PG_RETURN_POINTER(returnval);
+	PG_RETURN_POINTER(classify_document(dict, PG_GETARG_ARRAYTYPE_P(1)));
 }
 
 void gp_extract_feature_histogram_errout(char *msg) {
@@ -149,109 +155,331 @@ void gp_extract_feature_histogram_errout(char *msg) {
 		"%s\ngp_extract_feature_histogram internal error.",msg)));
 }
 
-int str_bsearch(char * word, char ** features, int num_features) 
+/**
+ * Finds the words of a text[] without copying them: the returned pointers
+ * point into the array and the words are not NUL terminated. NULL elements
+ * are returned as NULL pointers.
+ *
+ * @param array The text[] to be read
+ * @param numitems Set to the number of elements of array
+ * @param lens Set to a palloc'ed array holding the length of each word
+ * @return A palloc'ed array of pointers to the words of array
+ */
+static char **get_text_array_words(ArrayType *array, int *numitems, int **lens)
 {
-	int low = 0;
-	int high = num_features - 1;
-	int mid;
-	int cmp_result;
+	int nitems;
+	char **words;
+	char *ptr;
+	bits8 *bitmap;
+	int bitmask;
+	int i;
 
-	while (true) {
-		if (low > high) return -5;
+	if (ARR_ELEMTYPE(array) != TEXTOID)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("expected a text[] argument")));
+
+	nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	*numitems = nitems;
+	words = (char **) palloc(Max(nitems,1) * sizeof(char *));
+	*lens = (int *) palloc(Max(nitems,1) * sizeof(int));
+
+	ptr = ARR_DATA_PTR(array);
+	bitmap = ARR_NULLBITMAP(array);
+	bitmask = 1;
+
+	for (i = 0; i < nitems; i++) {
+		if (bitmap && (*bitmap & bitmask) == 0) {
+			words[i] = NULL;
+			(*lens)[i] = 0;
+		} else {
+			words[i] = VARDATA_ANY(ptr);
+			(*lens)[i] = VARSIZE_ANY_EXHDR(ptr);
+			ptr = att_addlength_pointer(ptr, -1, ptr);
+			ptr = (char *) att_align_nominal(ptr, 'i');
+		}
+		/* advance bitmap pointer if any */
+		if (bitmap) {
+			bitmask <<= 1;
+			if (bitmask == 0x100) {
+				bitmap++;
+				bitmask = 1;
+			}
+		}
+	}
+	return words;
+}
+
+/**
+ * Returns the hashed dictionary cached in fn_extra, (re)building it if this
+ * is the first call or if the dictionary differs from the cached one. The
+ * cache is keyed on the datum as passed, before detoasting: a dictionary
+ * stored out of line is compared by its toast pointer, and only detoasted
+ * when it changes.
+ */
+static FeatureDictionary *get_feature_dictionary(FunctionCallInfo fcinfo,
+		struct varlena *raw)
+{
+	FeatureDictionary *dict = (FeatureDictionary *) fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	uint32 nslots;
+	int i;
 
-		mid = low + (high - low)/2;
-		Assert(mid >= 0 && mid < num_features);
+	if (dict != NULL && VARSIZE_ANY(dict->raw) == VARSIZE_ANY(raw)
+	    && memcmp(dict->raw, raw, VARSIZE_ANY(raw)) == 0)
+		return dict;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	if (dict == NULL) {
+		dict = (FeatureDictionary *) palloc(sizeof(FeatureDictionary));
+		fcinfo->flinfo->fn_extra = dict;
+	} else {
+		pfree(dict->raw);
+		pfree(dict->dict_copy);
+		pfree(dict->slots);
+		pfree(dict->words);
+		pfree(dict->word_lens);
+	}
 
-		cmp_result = strcmp(word, features[mid]);
+	dict->raw = (struct varlena *) palloc(VARSIZE_ANY(raw));
+	memcpy(dict->raw, raw, VARSIZE_ANY(raw));
+	dict->dict_copy = (char *) PG_DETOAST_DATUM_COPY(PointerGetDatum(raw));
+	dict->words = get_text_array_words((ArrayType *) dict->dict_copy,
+					   &dict->num_features,
+					   &dict->word_lens);
+
+	/* Keep the load factor at or below one half */
+	for (nslots = 16; nslots < 2 * (uint32) dict->num_features; nslots <<= 1)
+		;
+	dict->mask = nslots - 1;
+	dict->slots = (int *) palloc0(nslots * sizeof(int));
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < dict->num_features; i++) {
+		uint32 h;
+
+		if (dict->words[i] == NULL)
+			continue;
+		/* Keep the first occurrence of a duplicated word */
+		if (lookup_feature(dict, dict->words[i], dict->word_lens[i]) >= 0)
+			continue;
+		h = DatumGetUInt32(hash_any((unsigned char *) dict->words[i],
+					    dict->word_lens[i])) & dict->mask;
+		while (dict->slots[h] != 0)
+			h = (h + 1) & dict->mask;
+		dict->slots[h] = i + 1;
+	}
+	return dict;
+}
 
-		if (cmp_result == 0) return mid;
-		if (cmp_result > 0) low = mid + 1;
-		else high = mid - 1;
+/**
+ * @return The zero-based position of word in the dictionary, or -1 if the
+ * word is not in the dictionary
+ */
+static int lookup_feature(FeatureDictionary *dict, char *word, int len)
+{
+	uint32 h = DatumGetUInt32(hash_any((unsigned char *) word, len))
+		   & dict->mask;
+
+	while (dict->slots[h] != 0) {
+		int f = dict->slots[h] - 1;
+		if (dict->word_lens[f] == len && memcmp(dict->words[f], word, len) == 0)
+			return f;
+		h = (h + 1) & dict->mask;
 	}
+	return -1;
+}
+
+/*
+ * A feature found in a document: its zero-based position in the feature
+ * vector and the amount it contributes there.
+ */
+typedef struct {
+	int32 idx;
+	float8 val;
+} FeatureHit;
+
+static int feature_hit_cmp(const void *a, const void *b)
+{
+	int32 x = ((const FeatureHit *) a)->idx;
+	int32 y = ((const FeatureHit *) b)->idx;
+	return (x > y) - (x < y);
+}
 
-	/*
+/**
+ * Sorts the hits by position, sums the hits that share a position, and
+ * builds the svec of the given dimension directly from the result.
+ */
+static SvecType *svec_from_feature_hits(FeatureHit *hits, int nhits,
+		int dimension)
+{
+	int64 *pair_idx = (int64 *) palloc(Max(nhits,1) * sizeof(int64));
+	double *pair_val = (double *) palloc(Max(nhits,1) * sizeof(double));
+	int npairs = 0;
+	SparseData sdata;
+	SvecType *result;
 	int i;
-	for (i=0; i!=num_features; i++) 
-		if (strcmp(word, features[i]) == 0)
-			return i;
-	return -5;
-	*/
+
+	qsort(hits, nhits, sizeof(FeatureHit), feature_hit_cmp);
+	for (i = 0; i < nhits; i++) {
+		if (npairs > 0 && pair_idx[npairs-1] == hits[i].idx) {
+			pair_val[npairs-1] += hits[i].val;
+		} else {
+			pair_idx[npairs] = hits[i].idx;
+			pair_val[npairs] = hits[i].val;
+			npairs++;
+		}
+	}
+
+	sdata = sorted_pairs_to_sdata(pair_idx, pair_val, npairs, dimension);
+	result = svec_from_sparsedata(sdata, true);
+
+	pfree(pair_idx);
+	pfree(pair_val);
+	freeSparseDataAndData(sdata);
+	return result;
 }
 
-SvecType *classify_document(char **features, int num_features, 
-			    char **document, int num_words) 
+/**
+ * Counts the dictionary words of a document. The matching features are
+ * collected as hits, from which the svec is built without a dense histogram.
+ */
+static SvecType *classify_document(FeatureDictionary *dict,
+		ArrayType *document)
 {
-	float8 * histogram = (float8 *)palloc0(sizeof(float8)*num_features);
-	SvecType * output_sfv;
-	int i, idx;
-
-	for (i=0; i!=num_words; i++) {
-		if (document[i] == NULL) continue;
-		idx = str_bsearch(document[i], features, num_features);
-		if (idx >= 0)
-			histogram[idx]++;
+	char **words;
+	int *lens;
+	int num_words, nhits = 0;
+	FeatureHit *hits;
+	SvecType *output_sfv;
+	int i;
+
+	if (dict->num_features == 0)
+		gp_extract_feature_histogram_errout(
+			"gp_extract_feature_histogram called with an empty dictionary");
+
+	words = get_text_array_words(document, &num_words, &lens);
+	hits = (FeatureHit *) palloc(Max(num_words,1) * sizeof(FeatureHit));
+
+	for (i = 0; i != num_words; i++) {
+		int idx;
+		if (words[i] == NULL) continue;
+		idx = lookup_feature(dict, words[i], lens[i]);
+		if (idx >= 0) {
+			hits[nhits].idx = idx;
+			hits[nhits].val = 1;
+			nhits++;
+		}
 	}
-	output_sfv = svec_from_float8arr(histogram, num_features);
+	output_sfv = svec_from_feature_hits(hits, nhits, dict->num_features);
+
+	pfree(words);
+	pfree(lens);
+	pfree(hits);
 	return output_sfv;
 }
 
 /**
- * Deconstruct a text[] into C-strings (note any NULL elements will be
- * returned as NULL pointers)
+ * MurmurHash3 (x86, 32-bit) of a byte string, used for feature hashing
+ * because, unlike hash_any(), it takes a seed. The 128-bit variant in the
+ * sketch module lives in another library; this one is pinned to the
+ * reference hash values by the svec tests.
  */
-static char ** get_text_array_contents(ArrayType *array, int *numitems)
+static uint32 murmur3_32(const char *key, int len, uint32 seed)
 {
-        int ndim = ARR_NDIM(array);
-        int * dims = ARR_DIMS(array);
-        int nitems;        
-	int16 typlen;
-        bool typbyval;
-        char typalign;
-        char ** values;
-        char * ptr;
-        bits8 * bitmap;
-        int bitmask;
-        int i;
-
-        Assert(ARR_ELEMTYPE(array) == TEXTOID);
-
-        if (ARR_ELEMTYPE(array) != TEXTOID) {
-		*numitems = 0;
-		elog(WARNING,"attempt to use a non-text[][] variable with a function that uses text[][] argumenst.\n");
-		return NULL;
+	const uint32 c1 = 0xcc9e2d51;
+	const uint32 c2 = 0x1b873593;
+	int nblocks = len / 4;
+	const unsigned char *tail = (const unsigned char *) key + nblocks * 4;
+	uint32 h = seed;
+	uint32 k;
+	int i;
+
+	for (i = 0; i < nblocks; i++) {
+		memcpy(&k, key + i * 4, sizeof(uint32));
+		k *= c1;
+		k = (k << 15) | (k >> 17);
+		k *= c2;
+		h ^= k;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	k = 0;
+	switch (len & 3) {
+		case 3: k ^= tail[2] << 16;
+			/* fall through */
+		case 2: k ^= tail[1] << 8;
+			/* fall through */
+		case 1: k ^= tail[0];
+			k *= c1;
+			k = (k << 15) | (k >> 17);
+			k *= c2;
+			h ^= k;
 	}
 
-	nitems = ArrayGetNItems(ndim, dims);
-        *numitems = nitems;
-
-        get_typlenbyvalalign(ARR_ELEMTYPE(array),&typlen, &typbyval, &typalign);
-
-        values = (char **) palloc(nitems * sizeof(char *));
-
-        ptr = ARR_DATA_PTR(array);
-        bitmap = ARR_NULLBITMAP(array);
-        bitmask = 1;
-
-        for (i = 0; i < nitems; i++) {
-                if (bitmap && (*bitmap & bitmask) == 0) {
-                        values[i] = NULL;
-                } else {
-                        values[i] = DatumGetCString(DirectFunctionCall1(textout,
-					       	PointerGetDatum(ptr)));
-                        ptr = att_addlength_pointer(ptr, typlen, ptr);
-                        ptr = (char *) att_align_nominal(ptr, typalign);
-                }
-                /* advance bitmap pointer if any */
-                if (bitmap) {
-                        bitmask <<= 1;
-                        if (bitmask == 0x100) {
-                                bitmap++;
-                                bitmask = 1;
-                        }
-                }
-        }
-        return values;
+	h ^= (uint32) len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
 }
 
+PG_FUNCTION_INFO_V1( svec_hash_features );
+/**
+ * 	svec_hash_features - builds the feature vector of a document with the
+ * 	hashing trick
+ *
+ * 	Each token is hashed to one of dim positions, and the vector holds the
+ * 	number of tokens that hashed to each position. With signed hashing, the
+ * 	top bit of the same 32-bit hash, which is masked out of the position,
+ * 	decides whether the token adds 1 or -1, so that collisions cancel out
+ * 	in expectation. No dictionary is needed, and the
+ * 	svec is built from the hashed positions without a dense array.
+ *
+ * Function Signature is:
+ * 	svec_hash_features(text[] tokens, int4 dim, int4 seed [, bool signed])
+ *
+ * Returns:
+ * 	An svec of dimension dim; NULL tokens are ignored
+ */
+Datum svec_hash_features(PG_FUNCTION_ARGS);
+Datum svec_hash_features(PG_FUNCTION_ARGS)
+{
+	ArrayType *tokens = PG_GETARG_ARRAYTYPE_P(0);
+	int32 dim = PG_GETARG_INT32(1);
+	uint32 seed = (uint32) PG_GETARG_INT32(2);
+	bool is_signed = (PG_NARGS() > 3) ? PG_GETARG_BOOL(3) : false;
+	char **words;
+	int *lens;
+	int num_words, nhits = 0;
+	FeatureHit *hits;
+	SvecType *result;
+	int i;
 
+	if (dim < 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("dimension of hashed feature vector must be positive")));
+
+	words = get_text_array_words(tokens, &num_words, &lens);
+	hits = (FeatureHit *) palloc(Max(num_words,1) * sizeof(FeatureHit));
+
+	for (i = 0; i < num_words; i++) {
+		uint32 h;
+		if (words[i] == NULL) continue;
+		h = murmur3_32(words[i], lens[i], seed);
+		/* the low 31 bits pick the position, the top bit the sign */
+		hits[nhits].idx = (h & 0x7fffffff) % (uint32) dim;
+		hits[nhits].val = (is_signed && (h & 0x80000000)) ? -1 : 1;
+		nhits++;
+	}
+	result = svec_from_feature_hits(hits, nhits, dim);
 
+	pfree(words);
+	pfree(lens);
+	pfree(hits);
+	PG_RETURN_SVECTYPE_P(result);
+}
@@ -0,0 +1,259 @@
+/**
+ * @file lsh.c
+ *
+ * @brief Locality-sensitive hashing of svecs
+ *
+ * Signatures for approximate nearest neighbour search over svecs. A vector
+ * is projected onto nbands * nbits random Gaussian directions and every
+ * projection is reduced to a small integer component:
+ *
+ * - for signed random projections ("cosine"), the sign of the projection;
+ *   vectors at angle theta agree on a component with probability
+ *   1 - theta/pi,
+ * - for p-stable hashing ("l2"), floor((projection + offset) / width) with
+ *   the offset uniform in [0, width); close vectors in Euclidean distance
+ *   are likely to fall into the same interval.
+ *
+ * The nbits components of each band are hashed to an int8 signature. Two
+ * vectors are candidate neighbours if their signatures agree in some band.
+ * The random directions are never stored: the entry of a direction at a
+ * coordinate is derived from a hash of (seed, direction, coordinate), so
+ * only the nonzero runs of an svec are visited and no state is kept between
+ * calls.
+ *
+ * For multi-probe queries, each band also yields signatures in which one of
+ * the components closest to its decision boundary is moved to the
+ * neighbouring value; probing those buckets raises recall without adding
+ * bands to the index.
+ */
+
+#include <postgres.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "catalog/pg_type.h"
+
+#include "sparse_vector.h"
+
+#define LSH_MAX_BANDS 1024
+#define LSH_MAX_BITS 64
+
+typedef enum { LSH_COSINE, LSH_L2 } LshKind;
+
+static LshKind lsh_kind_from_text(text *kind);
+static void lsh_project(SparseData sdata, uint32 seed, int nplanes,
+		double *proj);
+static int64 lsh_band_signature(int band, int64 *comps, int ncomps);
+
+/*
+ * The finalizer of the splitmix64 generator: a bijective mix of the bits of
+ * a 64-bit word.
+ */
+static inline uint64 lsh_mix64(uint64 z)
+{
+	z = (z ^ (z >> 30)) * UINT64CONST(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+/*
+ * Returns two independent standard normal deviates for the given seed, pair
+ * of directions and coordinate, using the Box-Muller transform.
+ */
+static inline void lsh_gaussian_pair(uint32 seed, uint32 pair, int64 coord,
+		double *g0, double *g1)
+{
+	uint64 h  = lsh_mix64((((uint64) seed << 32) | pair)
+			      ^ lsh_mix64((uint64) coord));
+	uint64 h2 = lsh_mix64(h + UINT64CONST(0x9e3779b97f4a7c15));
+	/* u1 is in (0,1], so that the log is finite */
+	double u1 = ((h >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double u2 = (h2 >> 11) * (1.0 / 9007199254740992.0);
+	double r  = sqrt(-2.0 * log(u1));
+
+	*g0 = r * cos(2.0 * M_PI * u2);
+	*g1 = r * sin(2.0 * M_PI * u2);
+}
+
+/*
+ * Returns the offset of a p-stable hash function, uniform in [0,1).
+ */
+static inline double lsh_offset(uint32 seed, uint32 plane)
+{
+	uint64 h = lsh_mix64((((uint64) seed << 32) | plane)
+			     ^ UINT64CONST(0x2545f4914f6cdd1d));
+	return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static LshKind lsh_kind_from_text(text *kind)
+{
+	int len = VARSIZE_ANY_EXHDR(kind);
+	char *str = VARDATA_ANY(kind);
+
+	if (len == 6 && strncmp(str, "cosine", 6) == 0)
+		return LSH_COSINE;
+	if (len == 2 && strncmp(str, "l2", 2) == 0)
+		return LSH_L2;
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("unknown LSH kind \"%.*s\"", len, str),
+		 errhint("Use \"cosine\" or \"l2\".")));
+	return LSH_COSINE; /* keep the compiler quiet */
+}
+
+/**
+ * Projects an svec onto nplanes random Gaussian directions. The directions
+ * are generated in pairs, and only the coordinates covered by nonzero runs
+ * are visited. NULL (NVP) entries are treated as zeros.
+ */
+static void lsh_project(SparseData sdata, uint32 seed, int nplanes,
+		double *proj)
+{
+	char *ix = sdata->index->data;
+	double *vals = (double *)sdata->vals->data;
+	int64 coord = 0;
+
+	memset(proj, 0, nplanes * sizeof(double));
+	for (int i = 0; i < sdata->unique_value_count; i++) {
+		int64 run_len = compword_to_int8(ix);
+		double val = vals[i];
+
+		if (val != 0. && !IS_NVP(val)) {
+			for (int p = 0; p < nplanes; p += 2) {
+				double sum0 = 0., sum1 = 0., g0, g1;
+
+				/* the value is constant along a run */
+				for (int64 c = coord; c < coord + run_len; c++) {
+					lsh_gaussian_pair(seed, p / 2, c, &g0, &g1);
+					sum0 += g0;
+					sum1 += g1;
+				}
+				proj[p] += val * sum0;
+				if (p + 1 < nplanes)
+					proj[p + 1] += val * sum1;
+			}
+		}
+		coord += run_len;
+		ix += int8compstoragesize(ix);
+	}
+}
+
+/**
+ * Hashes the components of a band to its signature.
+ */
+static int64 lsh_band_signature(int band, int64 *comps, int ncomps)
+{
+	uint64 h = lsh_mix64((uint64) band + 1);
+
+	for (int k = 0; k < ncomps; k++)
+		h = lsh_mix64(h ^ (uint64) comps[k]);
+	return (int64) h;
+}
+
+PG_FUNCTION_INFO_V1( svec_lsh_probes );
+/**
+ * svec_lsh_probes - computes the LSH signatures of an svec
+ *
+ * Arguments: the svec, the kind ("cosine" or "l2"), the number of bands,
+ * the number of components per band, the bucket width (used by "l2" only),
+ * the seed and, optionally, the number of extra probes per band.
+ *
+ * Returns nbands * (1 + nprobe) signatures, band by band: the signature of
+ * the band followed by the signatures of its nprobe nearest buckets.
+ */
+Datum svec_lsh_probes(PG_FUNCTION_ARGS)
+{
+	SvecType *svec = PG_GETARG_SVECTYPE_P(0);
+	LshKind kind = lsh_kind_from_text(PG_GETARG_TEXT_P(1));
+	int nbands = PG_GETARG_INT32(2);
+	int nbits = PG_GETARG_INT32(3);
+	float8 width = PG_GETARG_FLOAT8(4);
+	uint32 seed = (uint32) PG_GETARG_INT32(5);
+	int nprobe = (PG_NARGS() > 6) ? PG_GETARG_INT32(6) : 0;
+	SparseData sdata;
+	double *proj;
+	int64 *comps, *alts;
+	double *margins;
+	int *order;
+	int64 *sigs;
+	int nsigs = 0;
+
+	if (nbands < 1 || nbands > LSH_MAX_BANDS)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("number of bands must be between 1 and %d",
+				LSH_MAX_BANDS)));
+	if (nbits < 1 || nbits > LSH_MAX_BITS)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("number of components per band must be between 1 and %d",
+				LSH_MAX_BITS)));
+	if (nprobe < 0 || nprobe > nbits)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("number of probes must be between 0 and the number of components per band")));
+	if (kind == LSH_L2 && !(width > 0.))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("bucket width must be positive")));
+
+	sdata = sdata_from_svec(svec);
+	proj = (double *)palloc(nbands * nbits * sizeof(double));
+	lsh_project(sdata, seed, nbands * nbits, proj);
+
+	comps = (int64 *)palloc(nbits * sizeof(int64));
+	alts = (int64 *)palloc(nbits * sizeof(int64));
+	margins = (double *)palloc(nbits * sizeof(double));
+	order = (int *)palloc(nbits * sizeof(int));
+	sigs = (int64 *)palloc(nbands * (1 + nprobe) * sizeof(int64));
+
+	for (int b = 0; b < nbands; b++) {
+		for (int k = 0; k < nbits; k++) {
+			int plane = b * nbits + k;
+
+			if (kind == LSH_COSINE) {
+				comps[k] = (proj[plane] >= 0.);
+				alts[k] = 1 - comps[k];
+				margins[k] = fabs(proj[plane]);
+			} else {
+				double x = proj[plane] / width
+					   + lsh_offset(seed, plane);
+				double frac;
+
+				comps[k] = (int64) floor(x);
+				frac = x - floor(x);
+				alts[k] = (frac < 0.5) ? comps[k] - 1
+						       : comps[k] + 1;
+				margins[k] = (frac < 0.5) ? frac : 1. - frac;
+			}
+			order[k] = k;
+		}
+		sigs[nsigs++] = lsh_band_signature(b, comps, nbits);
+
+		/*
+		 * Probe the buckets across the nprobe least certain boundaries,
+		 * found by a partial selection sort on the margins.
+		 */
+		for (int j = 0; j < nprobe; j++) {
+			int best = j, k, tmp;
+			int64 saved;
+
+			for (k = j + 1; k < nbits; k++)
+				if (margins[order[k]] < margins[order[best]])
+					best = k;
+			tmp = order[j]; order[j] = order[best]; order[best] = tmp;
+
+			k = order[j];
+			saved = comps[k];
+			comps[k] = alts[k];
+			sigs[nsigs++] = lsh_band_signature(b, comps, nbits);
+			comps[k] = saved;
+		}
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)sigs, nsigs, INT8OID,
+					      sizeof(int64), true, 'd'));
+}
@@ -20,6 +20,10 @@
 
 #include "sparse_vector.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #ifndef NO_PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
@@ -40,6 +44,145 @@ void check_dimension(SvecType *svec1, SvecType *svec2, char *msg) {
 	}
 }
 
+/*
+ * Slice access to svecs
+ *
+ * Readers that only need the header of an svec, or a few of its elements,
+ * fetch just the bytes they need with PG_DETOAST_DATUM_SLICE instead of
+ * detoasting the whole value. The header is read first; it gives the sizes,
+ * and hence the offsets, of the value and index areas (see the layout of a
+ * serialized SparseData in SparseData.h). The index is much smaller than the
+ * values, so it is read in full and walked to find the runs of interest, and
+ * then only the values of those runs are fetched.
+ *
+ * This pays off for svecs stored out of line without compression (STORAGE
+ * EXTERNAL). Slicing an inline value gains nothing, and every slice of an
+ * inline compressed value decompresses all of it, so readers that take
+ * several slices detoast inline values once, with svec_slice_source(), and
+ * slice the result. Whether an out-of-line value is compressed is private
+ * to the toaster on the servers we support, so those are always sliced.
+ */
+
+/* The header fields of an svec, as read from a slice */
+typedef struct
+{
+	int32 dimension;
+	int unique_value_count;
+	int total_value_count;
+	int32 vals_offset;	/**< offset of the value area in the svec */
+	int32 vals_size;
+	int32 index_offset;	/**< offset of the index area in the svec */
+	int32 index_size;	/**< zero for an index of ones */
+} SvecSliceHeader;
+
+/**
+ * Returns the datum to take several slices of: the datum itself if it is
+ * stored out of line, else the detoasted value.
+ */
+static Datum svec_slice_source(Datum datum)
+{
+	if (VARATT_IS_EXTERNAL(DatumGetPointer(datum)))
+		return datum;
+	return PointerGetDatum(PG_DETOAST_DATUM(datum));
+}
+
+/**
+ * @param datum An svec datum, possibly toasted
+ * @param offset The offset of the slice from the start of the svec
+ * @param count The size of the slice
+ * @return A palloc'ed copy of the slice. The copy is only 4-byte aligned, so
+ * float8s must be read from it with memcpy.
+ */
+static char *svec_read_slice(Datum datum, int32 offset, int32 count)
+{
+	struct varlena *slice =
+		PG_DETOAST_DATUM_SLICE(datum,offset-VARHDRSZ,count);
+
+	if (VARSIZE_ANY_EXHDR(slice) != count)
+		ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("svec is shorter than its header indicates")));
+	return VARDATA_ANY(slice);
+}
+
+/**
+ * Reads the dimension of an svec and, if full is set, the counts and the
+ * location of its value and index areas.
+ */
+static void svec_read_slice_header(Datum datum, SvecSliceHeader *hdr,
+		bool full)
+{
+	int32 count = full ? SVECHDRSIZE - VARHDRSZ + SIZEOF_SPARSEDATAHDR
+			     + 2*sizeof(StringInfoData)
+			   : sizeof(int4);
+	char *bytes = svec_read_slice(datum,VARHDRSZ,count);
+	SparseDataStruct sdata;
+	StringInfoData vals, index;
+
+	memcpy(&hdr->dimension,bytes,sizeof(int4));
+	if (!full) return;
+
+	bytes += SVECHDRSIZE - VARHDRSZ;
+	memcpy(&sdata,bytes,sizeof(SparseDataStruct));
+	memcpy(&vals,SDATA_DATA_SINFO(bytes),sizeof(StringInfoData));
+	memcpy(&index,SDATA_INDEX_SINFO(bytes),sizeof(StringInfoData));
+
+	hdr->unique_value_count = sdata.unique_value_count;
+	hdr->total_value_count  = sdata.total_value_count;
+	hdr->vals_offset  = SVECHDRSIZE + SIZEOF_SPARSEDATAHDR
+			    + 2*sizeof(StringInfoData);
+	hdr->vals_size    = vals.maxlen;
+	hdr->index_offset = hdr->vals_offset + vals.maxlen;
+	hdr->index_size   = index.maxlen;
+}
+
+/**
+ * Reads the index of an svec; returns NULL for an index of ones.
+ */
+static char *svec_read_slice_index(Datum datum, SvecSliceHeader *hdr)
+{
+	if (hdr->index_size == 0) return NULL;
+	return svec_read_slice(datum,hdr->index_offset,hdr->index_size);
+}
+
+/**
+ * Reads the values of runs first to last of an svec into a palloc'ed,
+ * properly aligned array.
+ */
+static double *svec_read_slice_vals(Datum datum, SvecSliceHeader *hdr,
+		int first, int last)
+{
+	int32 count = (last-first+1)*sizeof(float8);
+	double *vals = (double *)palloc(count);
+
+	memcpy(vals,svec_read_slice(datum,
+			hdr->vals_offset+first*sizeof(float8),count),count);
+	return vals;
+}
+
+/**
+ * Walks the index of an svec to the run holding (one-based) position pos.
+ *
+ * @param ix Pointer into the index, at the run numbered *run; advanced to
+ * the run holding pos. NULL for an index of ones.
+ * @param run The number of the run ix points to; set to the run holding pos
+ * @param read The position of the last element of run *run; set to the
+ * position of the last element of the run holding pos
+ */
+static void svec_slice_seek(char **ix, int *run, int64 *read, int64 pos)
+{
+	if (*ix == NULL) {
+		*run += pos - *read;
+		*read = pos;
+		return;
+	}
+	while (*read < pos) {
+		*ix += int8compstoragesize(*ix);
+		*read += compword_to_int8(*ix);
+		(*run)++;
+	}
+}
+
 /**
  *  svec_dimension - returns the number of elements in an svec
  */
@@ -48,11 +191,19 @@ PG_FUNCTION_INFO_V1( svec_dimension );
 
 Datum svec_dimension(PG_FUNCTION_ARGS)
 {
-	SvecType *svec = PG_GETARG_SVECTYPE_P(0);
-	if (svec->dimension == -1) PG_RETURN_INT32(1);
-	else PG_RETURN_INT32(svec->dimension);
+	SvecSliceHeader hdr;
+
+	svec_read_slice_header(PG_GETARG_DATUM(0),&hdr,false);
+	if (hdr.dimension == -1) PG_RETURN_INT32(1);
+	else PG_RETURN_INT32(hdr.dimension);
 }
 
+/* The function applied by svec_lapply(), cached in fn_extra */
+typedef struct {
+	text *func;		/**< the name, as passed */
+	FmgrInfo flinfo;
+} LapplyCache;
+
 /**
  *  svec_lapply - applies a function to every element of an svec
  */
@@ -67,7 +218,34 @@ Datum svec_lapply(PG_FUNCTION_ARGS)
 	text *func = PG_GETARG_TEXT_P(0);
 	SvecType *svec = PG_GETARG_SVECTYPE_P(1);
 	SparseData in = sdata_from_svec(svec);
-	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(lapply(func,in),true));
+	LapplyCache *cache = (LapplyCache *)fcinfo->flinfo->fn_extra;
+
+	/*
+	 * The function is looked up once per query and kept in fn_extra,
+	 * together with its name to catch a change of the name argument.
+	 */
+	if (cache == NULL || VARSIZE(cache->func) != VARSIZE(func)
+	    || memcmp(cache->func, func, VARSIZE(func)) != 0) {
+		MemoryContext oldcontext;
+		FmgrInfo flinfo;
+
+		/* look up first, so that a failure leaves the cache intact */
+		fmgr_info_cxt(lapply_lookup(func), &flinfo,
+			      fcinfo->flinfo->fn_mcxt);
+		if (cache == NULL)
+			cache = (LapplyCache *)MemoryContextAllocZero(
+				fcinfo->flinfo->fn_mcxt, sizeof(LapplyCache));
+		else
+			pfree(cache->func);
+		cache->flinfo = flinfo;
+		oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+		cache->func = (text *)palloc(VARSIZE(func));
+		memcpy(cache->func, func, VARSIZE(func));
+		MemoryContextSwitchTo(oldcontext);
+		fcinfo->flinfo->fn_extra = cache;
+	}
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(lapply_fmgr(&cache->flinfo,in),
+						  true));
 }
 
 /**
@@ -176,18 +354,92 @@ Datum svec_proj(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1( svec_proj );
 Datum svec_proj(PG_FUNCTION_ARGS) 
 {
+	SvecSliceHeader hdr;
+	Datum datum;
+	char *ix;
+	int64 read;
+	int run = 0;
+	int idx;
+	double ret;
+
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
-	int idx = PG_GETARG_INT32(1);
+	datum = svec_slice_source(PG_GETARG_DATUM(0));
+	idx = PG_GETARG_INT32(1);
+	svec_read_slice_header(datum,&hdr,true);
 
-	SparseData in = sdata_from_svec(sv);
-	double ret = sd_proj(in,idx);
+	/* error checking */
+	if (0 >= idx || idx > hdr.total_value_count)
+		ereport(ERROR, 
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Index out of bounds.")));
+
+	/* find desired block; as is normal in SQL, we start counting from one */
+	ix = svec_read_slice_index(datum,&hdr);
+	read = compword_to_int8(ix);
+	svec_slice_seek(&ix,&run,&read,idx);
+	memcpy(&ret,svec_read_slice(datum,hdr.vals_offset+run*sizeof(float8),
+				    sizeof(float8)),sizeof(float8));
 
 	if (IS_NVP(ret)) PG_RETURN_NULL();
 
-	PG_RETURN_FLOAT8(sd_proj(in,idx));
+	PG_RETURN_FLOAT8(ret);
+}
+
+/**
+ * Extracts elements start to end of an svec, reading only the runs that
+ * overlap them. This is subarr() on a slice of the svec.
+ */
+static SparseData svec_subvec_internal(Datum datum, SvecSliceHeader *hdr,
+		int start, int end)
+{
+	SparseData ret = makeSparseData();
+	size_t wf8 = sizeof(float8);
+	char *ix, *last_ix;
+	int64 read, last_read;
+	int first_run = 0, last_run;
+	double *vals;
+
+	/* error checking */
+	if (0 >= start || start > end || end > hdr->total_value_count)
+		ereport(ERROR, 
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("Array index out of bounds.")));
+
+	/* find the start and end blocks, and fetch the values in between */
+	ix = svec_read_slice_index(datum,hdr);
+	read = compword_to_int8(ix);
+	svec_slice_seek(&ix,&first_run,&read,start);
+	last_ix = ix;
+	last_read = read;
+	last_run = first_run;
+	svec_slice_seek(&last_ix,&last_run,&last_read,end);
+	vals = svec_read_slice_vals(datum,hdr,first_run,last_run);
+
+	if (end <= read) {
+		/* the whole subarray is in the first block, we are done */
+		add_run_to_sdata((char *)(&vals[0]), end-start+1, wf8, ret);
+		pfree(vals);
+		return ret;
+	}
+	/* else start building subarray */
+	add_run_to_sdata((char *)(&vals[0]), read-start+1, wf8, ret);
+
+	for (int j=1; j<=last_run-first_run; j++) {
+		int64 esize;
+		if (ix != NULL) ix += int8compstoragesize(ix);
+		esize = compword_to_int8(ix);
+		if (read + esize > end) {
+			add_run_to_sdata((char *)(&vals[j]), end-read, wf8, ret);
+			break;
+		} 
+		add_run_to_sdata((char *)(&vals[j]), esize, wf8, ret);
+		read += esize;
+		if (read == end) break;
+	}
+	pfree(vals);
+	return ret;
 }
 
 /**
@@ -197,15 +449,24 @@ Datum svec_subvec(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1( svec_subvec );
 Datum svec_subvec(PG_FUNCTION_ARGS) 
 {
+	SvecSliceHeader hdr;
+	Datum datum;
+	SparseData ret;
+	int start, end;
+
 	if (PG_ARGISNULL(0))
 		PG_RETURN_NULL();
 
-	SvecType * sv = PG_GETARG_SVECTYPE_P(0);
-	int start = PG_GETARG_INT32(1);
-	int end   = PG_GETARG_INT32(2);
+	datum = svec_slice_source(PG_GETARG_DATUM(0));
+	start = PG_GETARG_INT32(1);
+	end   = PG_GETARG_INT32(2);
+	svec_read_slice_header(datum,&hdr,true);
 
-	SparseData in = sdata_from_svec(sv);
-	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(subarr(in,start,end),true));
+	if (start > end)
+		ret = reverse(svec_subvec_internal(datum,&hdr,end,start));
+	else
+		ret = svec_subvec_internal(datum,&hdr,start,end);
+	PG_RETURN_SVECTYPE_P(svec_from_sparsedata(ret,true));
 }
 
 /**
@@ -688,6 +949,25 @@ Datum svec_l1norm(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8(accum);
 }
 
+PG_FUNCTION_INFO_V1( svec_linfnorm );
+/**
+ *  svec_linfnorm - computes the l-infinity norm (largest absolute value) of an svec
+ */
+Datum svec_linfnorm(PG_FUNCTION_ARGS)
+{
+	SvecType *svec = PG_GETARG_SVECTYPE_P(0);
+	SparseData sdata  = sdata_from_svec(svec);
+	double *vals = (double *)sdata->vals->data;
+	double accum = 0.;
+
+	for (int i=0; i<sdata->unique_value_count; i++) {
+		if (IS_NVP(vals[i])) PG_RETURN_NULL();
+		if (fabs(vals[i]) > accum) accum = fabs(vals[i]);
+	}
+
+	PG_RETURN_FLOAT8(accum);
+}
+
 PG_FUNCTION_INFO_V1( svec_summate );
 /**
  *  svec_summate - computes the sum of all the elements in an svec
@@ -719,6 +999,211 @@ Datum svec_log(PG_FUNCTION_ARGS)
 	PG_RETURN_SVECTYPE_P(svec);
 }
 
+/*
+ * Element-wise kernels
+ *
+ * These apply a fixed function to the values of an svec in place, once per
+ * run, without the name lookup and the fmgr call per value of svec_lapply().
+ * The switch is outside the loops so that each loop is a plain pass over
+ * the vals buffer. NULLs (NVPs) are left as they are.
+ */
+enum svec_kernel_t { KERNEL_LOG1P, KERNEL_EXP, KERNEL_SQRT, KERNEL_ABS,
+		     KERNEL_SIGN, KERNEL_CLAMP, KERNEL_IDF, KERNEL_POW };
+
+/**
+ * Merges adjacent runs that hold the same value, which any kernel can
+ * produce: even one-to-one functions overflow to Inf, round distinct values
+ * to the same result, or return NaN. Returns the svec itself if there are
+ * none.
+ */
+static SvecType *svec_merge_equal_runs(SvecType *svec)
+{
+	double *vals = (double *)SVEC_VALS_PTR(svec);
+	int unique_value_count = SVEC_UNIQUE_VALCNT(svec);
+	SparseData in, out;
+	char *ix;
+	double run_val;
+	int64 run_len;
+	int i;
+
+	for (i=1; i<unique_value_count; i++)
+		if (memcmp(&vals[i-1],&vals[i],sizeof(float8)) == 0) break;
+	if (i >= unique_value_count) return svec;
+
+	in = sdata_from_svec(svec);
+	out = makeSparseData();
+	ix = in->index->data;
+	run_val = vals[0];
+	run_len = compword_to_int8(ix);
+	for (i=1; i<unique_value_count; i++) {
+		int64 len;
+		ix += int8compstoragesize(ix);
+		len = compword_to_int8(ix);
+		if (memcmp(&run_val,&vals[i],sizeof(float8)) == 0) {
+			run_len += len;
+			continue;
+		}
+		add_run_to_sdata((char *)(&run_val),run_len,sizeof(float8),out);
+		run_val = vals[i];
+		run_len = len;
+	}
+	add_run_to_sdata((char *)(&run_val),run_len,sizeof(float8),out);
+	return svec_from_sparsedata(out,true);
+}
+
+/**
+ * Applies a kernel to the values of svec, which must be a private copy.
+ *
+ * @param lo The lower bound for KERNEL_CLAMP, the number of documents for
+ * KERNEL_IDF, the exponent for KERNEL_POW
+ * @param hi The upper bound for KERNEL_CLAMP
+ */
+static SvecType *svec_apply_kernel(SvecType *svec, enum svec_kernel_t kernel,
+		float8 lo, float8 hi)
+{
+	double *vals = (double *)SVEC_VALS_PTR(svec);
+	int n = SVEC_UNIQUE_VALCNT(svec);
+
+	switch (kernel) {
+	case KERNEL_LOG1P:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i])) vals[i] = log1p(vals[i]);
+		break;
+	case KERNEL_EXP:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i])) vals[i] = exp(vals[i]);
+		break;
+	case KERNEL_SQRT:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i])) vals[i] = sqrt(vals[i]);
+		break;
+	case KERNEL_ABS:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i])) vals[i] = fabs(vals[i]);
+		break;
+	case KERNEL_SIGN:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i]))
+				vals[i] = (vals[i] > 0.) ? 1. 
+					: ((vals[i] < 0.) ? -1. : 0.);
+		break;
+	case KERNEL_CLAMP:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i]))
+				vals[i] = (vals[i] < lo) ? lo 
+					: ((vals[i] > hi) ? hi : vals[i]);
+		break;
+	case KERNEL_IDF:
+		/* terms that occur in no document get weight zero */
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i]))
+				vals[i] = (vals[i] > 0.) ? log(lo / vals[i]) : 0.;
+		break;
+	case KERNEL_POW:
+		for (int i=0; i<n; i++)
+			if (!IS_NVP(vals[i])) vals[i] = pow(vals[i],lo);
+		break;
+	}
+	return svec_merge_equal_runs(svec);
+}
+
+PG_FUNCTION_INFO_V1( svec_log1p );
+/**
+ *  svec_log1p - computes log(1 + x) of each element in an svec
+ */
+Datum svec_log1p(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_LOG1P,0,0));
+}
+
+PG_FUNCTION_INFO_V1( svec_exp );
+/**
+ *  svec_exp - computes the exponential of each element in an svec
+ */
+Datum svec_exp(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_EXP,0,0));
+}
+
+PG_FUNCTION_INFO_V1( svec_sqrt );
+/**
+ *  svec_sqrt - computes the square root of each element in an svec
+ */
+Datum svec_sqrt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_SQRT,0,0));
+}
+
+PG_FUNCTION_INFO_V1( svec_abs );
+/**
+ *  svec_abs - computes the absolute value of each element in an svec
+ */
+Datum svec_abs(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_ABS,0,0));
+}
+
+PG_FUNCTION_INFO_V1( svec_sign );
+/**
+ *  svec_sign - replaces each element in an svec by its sign (-1, 0 or 1)
+ */
+Datum svec_sign(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_SIGN,0,0));
+}
+
+PG_FUNCTION_INFO_V1( svec_clamp );
+/**
+ *  svec_clamp - limits each element in an svec to the range [lo,hi]
+ */
+Datum svec_clamp(PG_FUNCTION_ARGS)
+{
+	float8 lo = PG_GETARG_FLOAT8(1);
+	float8 hi = PG_GETARG_FLOAT8(2);
+
+	if (lo > hi)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("lower bound of svec_clamp is greater than the upper bound")));
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_CLAMP,lo,hi));
+}
+
+PG_FUNCTION_INFO_V1( svec_pow_float8 );
+/**
+ *  svec_pow_float8 - raises each element in an svec to a float8 power
+ */
+Datum svec_pow_float8(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_SVECTYPE_P(svec_apply_kernel(PG_GETARG_SVECTYPE_P_COPY(0),
+					       KERNEL_POW,PG_GETARG_FLOAT8(1),0));
+}
+
+PG_FUNCTION_INFO_V1( svec_tfidf );
+/**
+ *  svec_tfidf - weights a term-frequency svec by the inverse document
+ *  frequencies log(ndocs/df) given by a document-frequency svec
+ */
+Datum svec_tfidf(PG_FUNCTION_ARGS)
+{
+	SvecType *tf = PG_GETARG_SVECTYPE_P(0);
+	SvecType *df = PG_GETARG_SVECTYPE_P_COPY(1);
+	int64 ndocs = PG_GETARG_INT64(2);
+
+	if (ndocs < 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("number of documents must be positive")));
+	check_dimension(tf,df,"svec_tfidf");
+	PG_RETURN_SVECTYPE_P(op_svec_by_svec_internal(multiply,tf,
+			svec_apply_kernel(df,KERNEL_IDF,(float8)ndocs,0)));
+}
+
 /*
  * Cast from int2,int4,int8,float4,float8 scalar to SvecType
  */
@@ -902,6 +1387,166 @@ Datum float8arr_equals(PG_FUNCTION_ARGS) {
 	PG_RETURN_BOOL(float8arr_equals_internal(left,right));
 }
 
+/*
+ * Dense kernels for float8[]
+ *
+ * When both operands are plain float8[]s, there is nothing to gain from the
+ * RLE algebra, so the functions below work on ARR_DATA_PTR directly. The
+ * loops use AVX2 when the module is compiled for it, and otherwise several
+ * independent accumulators so the compiler can keep the FPU pipelines busy.
+ */
+
+/**
+ * @param array A float8[]
+ * @param num Set to the number of elements of array
+ * @return True if array can be processed by the dense kernels: it has no
+ * NULLs (which the SparseData path turns into NVPs) and more than one
+ * element (single-element arrays are treated as scalars).
+ */
+static inline bool float8arr_is_dense(ArrayType *array, int *num)
+{
+	*num = ArrayGetNItems(ARR_NDIM(array),ARR_DIMS(array));
+	return !ARR_HASNULL(array) && *num > 1;
+}
+
+/* Sums the elements, or their absolute values, of a dense array */
+static double dense_sum(const double *a, int n, bool absolute)
+{
+	int i = 0;
+	double accum;
+#ifdef __AVX2__
+	const __m256d signmask = _mm256_set1_pd(-0.);
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double lanes[4];
+
+	for (; i+8 <= n; i += 8) {
+		__m256d x0 = _mm256_loadu_pd(a+i);
+		__m256d x1 = _mm256_loadu_pd(a+i+4);
+		if (absolute) {
+			x0 = _mm256_andnot_pd(signmask,x0);
+			x1 = _mm256_andnot_pd(signmask,x1);
+		}
+		acc0 = _mm256_add_pd(acc0,x0);
+		acc1 = _mm256_add_pd(acc1,x1);
+	}
+	_mm256_storeu_pd(lanes,_mm256_add_pd(acc0,acc1));
+	accum = (lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+#else
+	double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+
+	if (absolute) {
+		for (; i+4 <= n; i += 4) {
+			s0 += fabs(a[i]);   s1 += fabs(a[i+1]);
+			s2 += fabs(a[i+2]); s3 += fabs(a[i+3]);
+		}
+	} else {
+		for (; i+4 <= n; i += 4) {
+			s0 += a[i];   s1 += a[i+1];
+			s2 += a[i+2]; s3 += a[i+3];
+		}
+	}
+	accum = (s0+s1)+(s2+s3);
+#endif
+	for (; i < n; i++) accum += absolute ? fabs(a[i]) : a[i];
+	return accum;
+}
+
+/* Computes the dot product of two dense arrays of length n */
+static double dense_dot(const double *a, const double *b, int n)
+{
+	int i = 0;
+	double accum;
+#ifdef __AVX2__
+	__m256d acc0 = _mm256_setzero_pd();
+	__m256d acc1 = _mm256_setzero_pd();
+	double lanes[4];
+
+	for (; i+8 <= n; i += 8) {
+		acc0 = _mm256_add_pd(acc0,_mm256_mul_pd(_mm256_loadu_pd(a+i),
+							_mm256_loadu_pd(b+i)));
+		acc1 = _mm256_add_pd(acc1,_mm256_mul_pd(_mm256_loadu_pd(a+i+4),
+							_mm256_loadu_pd(b+i+4)));
+	}
+	_mm256_storeu_pd(lanes,_mm256_add_pd(acc0,acc1));
+	accum = (lanes[0]+lanes[1])+(lanes[2]+lanes[3]);
+#else
+	double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+
+	for (; i+4 <= n; i += 4) {
+		s0 += a[i]*b[i];     s1 += a[i+1]*b[i+1];
+		s2 += a[i+2]*b[i+2]; s3 += a[i+3]*b[i+3];
+	}
+	accum = (s0+s1)+(s2+s3);
+#endif
+	for (; i < n; i++) accum += a[i]*b[i];
+	return accum;
+}
+
+/* Applies one of subtract, add, multiply or divide element by element */
+static void dense_op(enum operation_t op, const double *a, const double *b,
+		double *result, int n)
+{
+	int i = 0;
+#ifdef __AVX2__
+	for (; i+4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(a+i);
+		__m256d y = _mm256_loadu_pd(b+i);
+		switch (op) {
+		case subtract: x = _mm256_sub_pd(x,y); break;
+		case add:
+		default:       x = _mm256_add_pd(x,y); break;
+		case multiply: x = _mm256_mul_pd(x,y); break;
+		case divide:   x = _mm256_div_pd(x,y); break;
+		}
+		_mm256_storeu_pd(result+i,x);
+	}
+#endif
+	switch (op) {
+	case subtract: for (; i < n; i++) result[i] = a[i] - b[i]; break;
+	case add:
+	default:       for (; i < n; i++) result[i] = a[i] + b[i]; break;
+	case multiply: for (; i < n; i++) result[i] = a[i] * b[i]; break;
+	case divide:   for (; i < n; i++) result[i] = a[i] / b[i]; break;
+	}
+}
+
+static SparseData sdata_uncompressed_from_float8arr_internal(ArrayType *array);
+
+/**
+ * Performs one of subtract, add, multiply, or divide between two float8[]s,
+ * with the dense kernel when possible and the SparseData algebra (which
+ * handles NULLs, scalars and dimension errors) otherwise.
+ */
+static SvecType *float8arr_op_float8arr_internal(enum operation_t op,
+		ArrayType *arr1, ArrayType *arr2)
+{
+	SparseData left, right;
+	int n1, n2;
+
+	if (float8arr_is_dense(arr1,&n1) && float8arr_is_dense(arr2,&n2)
+	    && n1 == n2)
+	{
+		double *result = (double *)palloc(sizeof(float8)*n1);
+		SparseData sdata;
+		SvecType *svec;
+
+		dense_op(op,(double *)ARR_DATA_PTR(arr1),
+			 (double *)ARR_DATA_PTR(arr2),result,n1);
+		sdata = float8arr_to_sdata(result,n1);
+		svec = svec_from_sparsedata(sdata,true);
+		freeSparseDataAndData(sdata);
+		pfree(result);
+		return svec;
+	}
+
+	left  = sdata_uncompressed_from_float8arr_internal(arr1);
+	right = sdata_uncompressed_from_float8arr_internal(arr2);
+	return svec_operate_on_sdata_pair(
+		check_scalar(SDATA_IS_SCALAR(left),SDATA_IS_SCALAR(right)),
+		op,left,right);
+}
+
 /*
  * Returns a SparseData formed from a dense float8[] in uncompressed format.
  * This is useful for creating a SparseData without processing that can be
@@ -956,8 +1601,15 @@ Datum float8arr_l1norm(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1( float8arr_l1norm);
 Datum float8arr_l1norm(PG_FUNCTION_ARGS) {
 	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
-	SparseData sdata = sdata_uncompressed_from_float8arr_internal(array);
-	double result = l1norm_sdata_values_double(sdata);
+	SparseData sdata;
+	double result;
+	int num;
+
+	if (float8arr_is_dense(array,&num))
+		PG_RETURN_FLOAT8(dense_sum((double *)ARR_DATA_PTR(array),num,true));
+
+	sdata = sdata_uncompressed_from_float8arr_internal(array);
+	result = l1norm_sdata_values_double(sdata);
 	pfree(sdata);
 
 	if (IS_NVP(result)) PG_RETURN_NULL();
@@ -972,8 +1624,15 @@ Datum float8arr_summate(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1( float8arr_summate);
 Datum float8arr_summate(PG_FUNCTION_ARGS) {
 	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
-	SparseData sdata = sdata_uncompressed_from_float8arr_internal(array);
-	double result = sum_sdata_values_double(sdata);
+	SparseData sdata;
+	double result;
+	int num;
+
+	if (float8arr_is_dense(array,&num))
+		PG_RETURN_FLOAT8(dense_sum((double *)ARR_DATA_PTR(array),num,false));
+
+	sdata = sdata_uncompressed_from_float8arr_internal(array);
+	result = sum_sdata_values_double(sdata);
 	pfree(sdata);
 
 	if (IS_NVP(result)) PG_RETURN_NULL();
@@ -989,8 +1648,17 @@ Datum float8arr_l2norm(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1( float8arr_l2norm);
 Datum float8arr_l2norm(PG_FUNCTION_ARGS) {
 	ArrayType *array  = PG_GETARG_ARRAYTYPE_P(0);
-	SparseData sdata = sdata_uncompressed_from_float8arr_internal(array);
-	double result = l2norm_sdata_values_double(sdata);
+	SparseData sdata;
+	double result;
+	int num;
+
+	if (float8arr_is_dense(array,&num)) {
+		double *vals = (double *)ARR_DATA_PTR(array);
+		PG_RETURN_FLOAT8(sqrt(dense_dot(vals,vals,num)));
+	}
+
+	sdata = sdata_uncompressed_from_float8arr_internal(array);
+	result = l2norm_sdata_values_double(sdata);
 	pfree(sdata);
 
 	if (IS_NVP(result)) PG_RETURN_NULL();
@@ -1006,11 +1674,18 @@ PG_FUNCTION_INFO_V1( float8arr_dot);
 Datum float8arr_dot(PG_FUNCTION_ARGS) {
 	ArrayType *arr_left   = PG_GETARG_ARRAYTYPE_P(0);
 	ArrayType *arr_right  = PG_GETARG_ARRAYTYPE_P(1);
-	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr_left);
-	SparseData right = sdata_uncompressed_from_float8arr_internal(arr_right);
+	SparseData left, right;
 	SparseData mult_result;
 	double accum;
+	int n1, n2;
+
+	if (float8arr_is_dense(arr_left,&n1) && float8arr_is_dense(arr_right,&n2)
+	    && n1 == n2)
+		PG_RETURN_FLOAT8(dense_dot((double *)ARR_DATA_PTR(arr_left),
+					   (double *)ARR_DATA_PTR(arr_right),n1));
 
+	left  = sdata_uncompressed_from_float8arr_internal(arr_left);
+	right = sdata_uncompressed_from_float8arr_internal(arr_right);
 	mult_result = op_sdata_by_sdata(multiply,left,right);
 	accum = sum_sdata_values_double(mult_result);
 	freeSparseData(left);
@@ -1035,10 +1710,7 @@ float8arr_minus_float8arr(PG_FUNCTION_ARGS)
 {
 	ArrayType *arr1 = PG_GETARG_ARRAYTYPE_P(0);
 	ArrayType *arr2 = PG_GETARG_ARRAYTYPE_P(1);
-	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr1);
-	SparseData right = sdata_uncompressed_from_float8arr_internal(arr2);
-	int scalar_args = check_scalar(SDATA_IS_SCALAR(left),SDATA_IS_SCALAR(right));
-	PG_RETURN_SVECTYPE_P(svec_operate_on_sdata_pair(scalar_args,subtract,left,right));
+	PG_RETURN_SVECTYPE_P(float8arr_op_float8arr_internal(subtract,arr1,arr2));
 }
 PG_FUNCTION_INFO_V1( svec_minus_float8arr );
 Datum
@@ -1069,10 +1741,7 @@ float8arr_plus_float8arr(PG_FUNCTION_ARGS)
 {
 	ArrayType *arr1 = PG_GETARG_ARRAYTYPE_P(0);
 	ArrayType *arr2 = PG_GETARG_ARRAYTYPE_P(1);
-	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr1);
-	SparseData right = sdata_uncompressed_from_float8arr_internal(arr2);
-	int scalar_args = check_scalar(SDATA_IS_SCALAR(left),SDATA_IS_SCALAR(right));
-	PG_RETURN_SVECTYPE_P(svec_operate_on_sdata_pair(scalar_args,add,left,right));
+	PG_RETURN_SVECTYPE_P(float8arr_op_float8arr_internal(add,arr1,arr2));
 }
 PG_FUNCTION_INFO_V1( svec_plus_float8arr );
 Datum
@@ -1102,11 +1771,7 @@ float8arr_mult_float8arr(PG_FUNCTION_ARGS)
 {
 	ArrayType *arr1 = PG_GETARG_ARRAYTYPE_P(0);
 	ArrayType *arr2 = PG_GETARG_ARRAYTYPE_P(1);
-	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr1);
-	SparseData right = sdata_uncompressed_from_float8arr_internal(arr2);
-	int scalar_args = check_scalar(SDATA_IS_SCALAR(left),SDATA_IS_SCALAR(right));
-	SvecType *svec = svec_operate_on_sdata_pair(scalar_args,multiply,left,right);
-	PG_RETURN_SVECTYPE_P(svec);
+	PG_RETURN_SVECTYPE_P(float8arr_op_float8arr_internal(multiply,arr1,arr2));
 }
 PG_FUNCTION_INFO_V1( svec_mult_float8arr );
 Datum
@@ -1137,10 +1802,7 @@ float8arr_div_float8arr(PG_FUNCTION_ARGS)
 {
 	ArrayType *arr1 = PG_GETARG_ARRAYTYPE_P(0);
 	ArrayType *arr2 = PG_GETARG_ARRAYTYPE_P(1);
-	SparseData left  = sdata_uncompressed_from_float8arr_internal(arr1);
-	SparseData right = sdata_uncompressed_from_float8arr_internal(arr2);
-	int scalar_args = check_scalar(SDATA_IS_SCALAR(left),SDATA_IS_SCALAR(right));
-	PG_RETURN_SVECTYPE_P(svec_operate_on_sdata_pair(scalar_args,divide,left,right));
+	PG_RETURN_SVECTYPE_P(float8arr_op_float8arr_internal(divide,arr1,arr2));
 }
 PG_FUNCTION_INFO_V1( svec_div_float8arr );
 Datum
@@ -0,0 +1,256 @@
+/**
+ * @file simjoin.c
+ *
+ * @brief Prefix filtering for all-pairs cosine similarity joins over svecs
+ *
+ * For a similarity threshold t and a vector x of unit length, the prefix of
+ * x is the set of its nonzero dimensions d for which the part of x at
+ * dimensions >= d still has norm >= t. Let y be another unit vector and
+ * suppose that the prefix of x ends no later than the prefix of y. The part
+ * of x after its prefix has norm < t, so by Cauchy-Schwarz it contributes
+ * less than t to x.y, and x.y >= t implies that x and y share a nonzero
+ * dimension within the prefix of x, and hence within both prefixes. So only
+ * pairs whose prefixes intersect need to be verified (Bayardo et al.,
+ * "Scaling up all pairs similarity search", 2007).
+ *
+ * The argument holds for any order of the dimensions that is the same for
+ * all vectors. Prefixes made of rare dimensions meet less often, so the
+ * dimensions can be ordered by their document frequency (the number of
+ * vectors in which they are nonzero), rarest first, ties broken by number.
+ *
+ * svec_similarity_join() in svec.sql_in builds an inverted index of the
+ * prefixes, distributed by dimension, and verifies the pairs that meet in
+ * it with svec_dot().
+ */
+
+#include <postgres.h>
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "catalog/pg_type.h"
+
+#include "sparse_vector.h"
+
+/*
+ * The document frequencies of the last svec seen, expanded to one value per
+ * dimension and cached in fn_extra under a copy of the datum they came from,
+ * since every row of a join passes the same svec.
+ */
+typedef struct {
+	struct varlena *raw;	/**< copy of the svec datum, as passed */
+	int dimension;
+	double *df;		/**< document frequency of each dimension */
+} DocFreqCache;
+
+/* A nonzero entry of an svec, in the order of its dimension */
+typedef struct {
+	int64 dim;		/**< one-based dimension */
+	double w;		/**< squared value */
+	double df;		/**< document frequency of the dimension */
+} PrefixEntry;
+
+/**
+ * Returns the document frequencies of the svec datum raw, expanding them
+ * only if raw differs from the datum the cache was filled from. NULL (NVP)
+ * entries count as zero.
+ */
+static DocFreqCache *docfreq_cache(FunctionCallInfo fcinfo,
+		struct varlena *raw)
+{
+	DocFreqCache *cache = (DocFreqCache *)fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	SvecType *svec;
+	double *vals;
+	char *ix;
+	int64 coord = 0;
+
+	if (cache != NULL && VARSIZE_ANY(cache->raw) == VARSIZE_ANY(raw)
+	    && memcmp(cache->raw, raw, VARSIZE_ANY(raw)) == 0)
+		return cache;
+
+	if (cache == NULL)
+		cache = (DocFreqCache *)MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(DocFreqCache));
+	else {
+		pfree(cache->raw);
+		pfree(cache->df);
+		cache->raw = NULL;
+	}
+	fcinfo->flinfo->fn_extra = cache;
+
+	svec = DatumGetSvecTypeP(PointerGetDatum(raw));
+	if ((double)svec->dimension * sizeof(double) >= MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("document frequencies of dimension %d are too many to cache",
+				svec->dimension)));
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	cache->dimension = svec->dimension;
+	cache->df = (double *)palloc0(Max(svec->dimension,1) * sizeof(double));
+	vals = (double *)SVEC_VALS_PTR(svec);
+	ix = SVEC_INDEX_PTR(svec);
+	for (int r = 0; r < SVEC_UNIQUE_VALCNT(svec); r++) {
+		int64 run_len = compword_to_int8(ix);
+
+		if (!IS_NVP(vals[r]))
+			for (int64 c = coord; c < coord + run_len; c++)
+				cache->df[c] = vals[r];
+		coord += run_len;
+		ix += int8compstoragesize(ix);
+	}
+	cache->raw = (struct varlena *)palloc(VARSIZE_ANY(raw));
+	memcpy(cache->raw, raw, VARSIZE_ANY(raw));
+	MemoryContextSwitchTo(oldcontext);
+	return cache;
+}
+
+/* Orders entries by document frequency, then by dimension */
+static int prefix_entry_cmp(const void *a, const void *b)
+{
+	const PrefixEntry *x = (const PrefixEntry *)a;
+	const PrefixEntry *y = (const PrefixEntry *)b;
+
+	if (x->df != y->df) return (x->df < y->df) ? -1 : 1;
+	return (x->dim < y->dim) ? -1 : (x->dim > y->dim);
+}
+
+/**
+ * Returns the prefix of the nonzero entries of sdata in the order of the
+ * document frequencies df, and its length in *ndims.
+ */
+static int64 *prefix_dims_by_df(SparseData sdata, const double *df,
+		double sumsq, double need, int64 *ndims)
+{
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	PrefixEntry *entries;
+	int64 nnz = 0, n = 0, coord = 0;
+	double remaining = sumsq;
+	int64 *dims;
+
+	for (int i = 0; i < sdata->unique_value_count; i++) {
+		if (vals[i] != 0. && !IS_NVP(vals[i]))
+			nnz += compword_to_int8(ix);
+		ix += int8compstoragesize(ix);
+	}
+	if ((double)nnz * sizeof(PrefixEntry) >= MaxAllocSize)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("svec with %ld nonzero entries is too large to order",
+				(long)nnz)));
+	entries = (PrefixEntry *)palloc(Max(nnz,1) * sizeof(PrefixEntry));
+	ix = sdata->index->data;
+	for (int i = 0; i < sdata->unique_value_count; i++) {
+		int64 run_len = compword_to_int8(ix);
+
+		if (vals[i] != 0. && !IS_NVP(vals[i]))
+			for (int64 c = coord; c < coord + run_len; c++) {
+				entries[n].dim = c + 1;
+				entries[n].w = vals[i] * vals[i];
+				entries[n++].df = df[c];
+			}
+		coord += run_len;
+		ix += int8compstoragesize(ix);
+	}
+	qsort(entries, nnz, sizeof(PrefixEntry), prefix_entry_cmp);
+
+	dims = (int64 *)palloc(Max(nnz,1) * sizeof(int64));
+	*ndims = 0;
+	for (int64 j = 0; j < nnz && sumsq > 0. && remaining >= need; j++) {
+		dims[(*ndims)++] = entries[j].dim;
+		remaining -= entries[j].w;
+	}
+	pfree(entries);
+	return dims;
+}
+
+PG_FUNCTION_INFO_V1( svec_prefix_dims );
+/**
+ * svec_prefix_dims - returns the (one-based) dimensions in the prefix of an
+ * svec for the given cosine similarity threshold
+ *
+ * The svec need not be normalized. NULL (NVP) entries are treated as zeros;
+ * a zero svec has an empty prefix. An optional third argument, an svec of
+ * the document frequency of every dimension, orders the dimensions rarest
+ * first; otherwise they are taken in their natural order.
+ */
+Datum svec_prefix_dims(PG_FUNCTION_ARGS)
+{
+	SvecType *svec = PG_GETARG_SVECTYPE_P(0);
+	float8 threshold = PG_GETARG_FLOAT8(1);
+	SparseData sdata = sdata_from_svec(svec);
+	double *vals = (double *)sdata->vals->data;
+	char *ix = sdata->index->data;
+	int64 *dims;
+	int64 ndims = 0, capacity = 16, coord = 1;
+	double sumsq = 0., remaining, need;
+
+	if (!(threshold > 0. && threshold <= 1.))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("similarity threshold must be in (0,1]")));
+
+	for (int i = 0; i < sdata->unique_value_count; i++) {
+		if (!IS_NVP(vals[i]))
+			sumsq += vals[i] * vals[i] * compword_to_int8(ix);
+		ix += int8compstoragesize(ix);
+	}
+
+	/*
+	 * Walk the entries again, keeping the squared norm of the rest of the
+	 * svec. The bound is relaxed slightly so that rounding can only
+	 * lengthen the prefix, which keeps the join exact.
+	 */
+	need = threshold * threshold * sumsq * (1. - 1e-9);
+	if (PG_NARGS() > 2) {
+		DocFreqCache *cache = docfreq_cache(fcinfo,
+				(struct varlena *)PG_GETARG_POINTER(2));
+
+		if (cache->dimension != svec->dimension)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("svec_prefix_dims: dimension of the svec (%d) and the document frequencies (%d) are not the same",
+					svec->dimension, cache->dimension)));
+		dims = prefix_dims_by_df(sdata, cache->df, sumsq, need, &ndims);
+		PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)dims, ndims,
+				INT8OID, sizeof(int64), true, 'd'));
+	}
+
+	ix = sdata->index->data;
+	remaining = sumsq;
+	dims = (int64 *)palloc(capacity * sizeof(int64));
+
+	for (int i = 0; i < sdata->unique_value_count && sumsq > 0.
+		     && remaining >= need; i++) {
+		int64 run_len = compword_to_int8(ix);
+		double w = vals[i] * vals[i];
+
+		if (vals[i] != 0. && !IS_NVP(vals[i])) {
+			/* positions j = 0.. are in while remaining - j*w >= need */
+			int64 take = (int64) floor((remaining - need) / w) + 1;
+
+			if (take > run_len) take = run_len;
+			if (ndims + take > capacity) {
+				int64 *grown;
+
+				while (ndims + take > capacity) capacity *= 2;
+				grown = (int64 *)palloc(capacity * sizeof(int64));
+				memcpy(grown, dims, ndims * sizeof(int64));
+				pfree(dims);
+				dims = grown;
+			}
+			for (int64 j = 0; j < take; j++)
+				dims[ndims++] = coord + j;
+			remaining -= run_len * w;
+		}
+		coord += run_len;
+		ix += int8compstoragesize(ix);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)dims, ndims, INT8OID,
+					      sizeof(int64), true, 'd'));
+}
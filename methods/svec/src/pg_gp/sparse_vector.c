@@ -14,6 +14,7 @@
 #include <search.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
 
 #include "utils/array.h"
 #include "utils/builtins.h"
@@ -26,6 +27,7 @@
 #include "utils/fmgroids.h"
 #include "lib/stringinfo.h"
 #include "utils/memutils.h"
+#include "nodes/execnodes.h"
 #include "sparse_vector.h"
 
 /**
@@ -391,6 +393,303 @@ SvecType *svec_from_float8arr(float8 *array, int dimension)
 	return result;
 }
 
+/*
+ * Coordinate (COO) construction of svecs
+ *
+ * svec_from_pairs() and the svec_from_coo() aggregate collect (index, value)
+ * pairs, sort them by index and run-length encode them in one pass, so the
+ * cost is O(nnz log nnz) regardless of the dimension of the vector.
+ */
+
+/* A non-zero entry of an svec, with a zero-based index */
+typedef struct
+{
+	int64 idx;
+	float8 val;
+} SvecCooPair;
+
+/*
+ * The transition state of svec_from_coo(), packed in a bytea. An
+ * uninitialized state is an empty bytea.
+ */
+typedef struct
+{
+	int64 dimension;
+	int32 npairs;
+	int32 capacity;
+	SvecCooPair pairs[1];
+} SvecCooState;
+
+#define SVEC_COO_STATE_SZ(n) \
+	(VARHDRSZ + offsetof(SvecCooState, pairs) + (n)*sizeof(SvecCooPair))
+#define SVEC_COO_STATE_INITIALIZED(t) (VARSIZE(t) > VARHDRSZ)
+
+static int svec_coo_pair_cmp(const void *a, const void *b)
+{
+	int64 x = ((const SvecCooPair *)a)->idx;
+	int64 y = ((const SvecCooPair *)b)->idx;
+	return (x > y) - (x < y);
+}
+
+static void check_coo_dimension(int64 dimension)
+{
+	if (dimension < 1 || dimension > INT_MAX)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec dimension must be between 1 and %d", INT_MAX)));
+}
+
+/**
+ * Sorts pairs by index, combines pairs with the same index by adding their
+ * values (a NULL value, stored as NVP, makes the entry NULL), and
+ * run-length encodes the result. The pairs array is sorted in place.
+ *
+ * @param pairs The entries of the vector, with zero-based indices
+ * @param npairs The number of entries in pairs
+ * @param dimension The dimension of the vector
+ * @return An svec of the given dimension, zero where there is no entry
+ */
+static SvecType *svec_from_coo_pairs(SvecCooPair *pairs, int npairs,
+		int64 dimension)
+{
+	int64 *idx = (int64 *)palloc(sizeof(int64)*Max(npairs,1));
+	double *vals = (double *)palloc(sizeof(float8)*Max(npairs,1));
+	int nnz = 0;
+	SparseData sdata;
+	SvecType *result;
+
+	qsort(pairs, npairs, sizeof(SvecCooPair), svec_coo_pair_cmp);
+	for (int i=0; i<npairs; i++) {
+		if (nnz > 0 && idx[nnz-1] == pairs[i].idx) {
+			if (IS_NVP(vals[nnz-1]) || IS_NVP(pairs[i].val))
+				vals[nnz-1] = NVP;
+			else
+				vals[nnz-1] += pairs[i].val;
+		} else {
+			idx[nnz] = pairs[i].idx;
+			vals[nnz] = pairs[i].val;
+			nnz++;
+		}
+	}
+
+	sdata = sorted_pairs_to_sdata(idx, vals, nnz, dimension);
+	result = svec_from_sparsedata(sdata, true);
+
+	pfree(idx);
+	pfree(vals);
+	freeSparseDataAndData(sdata);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(svec_from_pairs);
+/**
+ *  svec_from_pairs - makes an svec of a given dimension from an array of
+ *  one-based indices and an array of the values at those indices. Values
+ *  given for the same index are added up.
+ */
+Datum svec_from_pairs(PG_FUNCTION_ARGS);
+Datum svec_from_pairs(PG_FUNCTION_ARGS)
+{
+	ArrayType *idx_array = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *val_array = PG_GETARG_ARRAYTYPE_P(1);
+	int64 dimension = PG_GETARG_INT32(2);
+	int npairs = ArrayGetNItems(ARR_NDIM(idx_array),ARR_DIMS(idx_array));
+	int64 *indices = (int64 *)ARR_DATA_PTR(idx_array);
+	double *values = (double *)ARR_DATA_PTR(val_array);
+	bits8 *bitmap = ARR_NULLBITMAP(val_array);
+	int bitmask = 1;
+	SvecCooPair *pairs;
+	SvecType *result;
+
+	check_coo_dimension(dimension);
+	if (ARR_ELEMTYPE(idx_array) != INT8OID
+	    || ARR_ELEMTYPE(val_array) != FLOAT8OID)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("svec_from_pairs expects an int8[] and a float8[]")));
+	if (npairs != ArrayGetNItems(ARR_NDIM(val_array),ARR_DIMS(val_array)))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("index and value arrays must have the same length")));
+	if (ARR_HASNULL(idx_array))
+		ereport(ERROR,
+			(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+			 errmsg("NULL value in the index array.")));
+
+	pairs = (SvecCooPair *)palloc(sizeof(SvecCooPair)*Max(npairs,1));
+	for (int i=0; i<npairs; i++) {
+		if (indices[i] < 1 || indices[i] > dimension)
+			ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("index %lld is out of range for dimension %lld",
+					(long long int)indices[i],(long long int)dimension)));
+		pairs[i].idx = indices[i]-1;
+		/* NULLs are stored as NVP, and take no space in the data area */
+		if (bitmap && (*bitmap & bitmask) == 0) {
+			pairs[i].val = NVP;
+		} else {
+			pairs[i].val = *values;
+			values++;
+		}
+		if (bitmap) {
+			bitmask <<= 1;
+			if (bitmask == 0x100) {
+				bitmap++;
+				bitmask = 1;
+			}
+		}
+	}
+
+	result = svec_from_coo_pairs(pairs, npairs, dimension);
+	pfree(pairs);
+	PG_RETURN_SVECTYPE_P(result);
+}
+
+PG_FUNCTION_INFO_V1(svec_coo_trans);
+/**
+ *  svec_coo_trans - transition function of the svec_from_coo() aggregate;
+ *  appends an (index, value) pair to the state. Rows with a NULL index are
+ *  ignored, and a NULL value is stored as NVP.
+ */
+Datum svec_coo_trans(PG_FUNCTION_ARGS);
+Datum svec_coo_trans(PG_FUNCTION_ARGS)
+{
+	bytea *transblob = PG_GETARG_BYTEA_P(0);
+	SvecCooState *state;
+	int64 idx, dimension;
+
+	/*
+	 * This function makes destructive updates to its arguments.
+	 * Make sure it's being called in an agg context.
+	 */
+	if (!(fcinfo->context &&
+	      (IsA(fcinfo->context, AggState)
+	#ifdef NOTGP
+	       || IsA(fcinfo->context, WindowAggState)
+	#endif
+	      )))
+		elog(ERROR, "destructive pass by reference outside agg");
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_BYTEA_P(transblob);
+	if (PG_ARGISNULL(3))
+		ereport(ERROR,
+			(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+			 errmsg("svec_from_coo called with a NULL dimension")));
+
+	idx = PG_GETARG_INT64(1);
+	dimension = PG_GETARG_INT64(3);
+	check_coo_dimension(dimension);
+	if (idx < 1 || idx > dimension)
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("index %lld is out of range for dimension %lld",
+				(long long int)idx,(long long int)dimension)));
+
+	if (!SVEC_COO_STATE_INITIALIZED(transblob)) {
+		transblob = (bytea *)palloc(SVEC_COO_STATE_SZ(16));
+		SET_VARSIZE(transblob, SVEC_COO_STATE_SZ(16));
+		state = (SvecCooState *)VARDATA(transblob);
+		state->dimension = dimension;
+		state->npairs = 0;
+		state->capacity = 16;
+	}
+	state = (SvecCooState *)VARDATA(transblob);
+	if (state->dimension != dimension)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_from_coo called with different dimensions")));
+
+	if (state->npairs == state->capacity) {
+		/*
+		 * Double the capacity. The old state was not necessarily
+		 * allocated by us, so we copy it rather than repalloc it.
+		 */
+		int32 capacity = 2*state->capacity;
+		bytea *newblob;
+
+		if (SVEC_COO_STATE_SZ((Size)capacity) > MaxAllocSize)
+			ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many entries for svec_from_coo")));
+		newblob = (bytea *)palloc(SVEC_COO_STATE_SZ(capacity));
+		memcpy(newblob, transblob, VARSIZE(transblob));
+		SET_VARSIZE(newblob, SVEC_COO_STATE_SZ(capacity));
+		transblob = newblob;
+		state = (SvecCooState *)VARDATA(transblob);
+		state->capacity = capacity;
+	}
+
+	state->pairs[state->npairs].idx = idx-1;
+	state->pairs[state->npairs].val =
+		PG_ARGISNULL(2) ? NVP : PG_GETARG_FLOAT8(2);
+	state->npairs++;
+
+	PG_RETURN_BYTEA_P(transblob);
+}
+
+PG_FUNCTION_INFO_V1(svec_coo_merge);
+/**
+ *  svec_coo_merge - combines two svec_from_coo() transition states
+ */
+Datum svec_coo_merge(PG_FUNCTION_ARGS);
+Datum svec_coo_merge(PG_FUNCTION_ARGS)
+{
+	bytea *blob1 = PG_GETARG_BYTEA_P(0);
+	bytea *blob2 = PG_GETARG_BYTEA_P(1);
+	SvecCooState *state1, *state2, *state;
+	bytea *out;
+	int32 npairs;
+
+	if (!SVEC_COO_STATE_INITIALIZED(blob1))
+		PG_RETURN_BYTEA_P(blob2);
+	if (!SVEC_COO_STATE_INITIALIZED(blob2))
+		PG_RETURN_BYTEA_P(blob1);
+
+	state1 = (SvecCooState *)VARDATA(blob1);
+	state2 = (SvecCooState *)VARDATA(blob2);
+	if (state1->dimension != state2->dimension)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("svec_from_coo called with different dimensions")));
+
+	npairs = state1->npairs + state2->npairs;
+	out = (bytea *)palloc(SVEC_COO_STATE_SZ(npairs));
+	SET_VARSIZE(out, SVEC_COO_STATE_SZ(npairs));
+	state = (SvecCooState *)VARDATA(out);
+	state->dimension = state1->dimension;
+	state->npairs = npairs;
+	state->capacity = npairs;
+	memcpy(state->pairs, state1->pairs, state1->npairs*sizeof(SvecCooPair));
+	memcpy(state->pairs + state1->npairs, state2->pairs,
+	       state2->npairs*sizeof(SvecCooPair));
+
+	PG_RETURN_BYTEA_P(out);
+}
+
+PG_FUNCTION_INFO_V1(svec_coo_final);
+/**
+ *  svec_coo_final - final function of the svec_from_coo() aggregate; returns
+ *  NULL if no row had a non-NULL index
+ */
+Datum svec_coo_final(PG_FUNCTION_ARGS);
+Datum svec_coo_final(PG_FUNCTION_ARGS)
+{
+	bytea *transblob = PG_GETARG_BYTEA_P(0);
+	SvecCooState *state;
+
+	if (!SVEC_COO_STATE_INITIALIZED(transblob))
+		PG_RETURN_NULL();
+
+	/*
+	 * svec_from_coo_pairs() sorts the pairs in place, which leaves a valid
+	 * state behind in case the aggregate continues.
+	 */
+	state = (SvecCooState *)VARDATA(transblob);
+	PG_RETURN_SVECTYPE_P(svec_from_coo_pairs(state->pairs, state->npairs,
+						 state->dimension));
+}
+
 /**
  * Makes an empty svec with sufficient memory allocated for the input number
  */
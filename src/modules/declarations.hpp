@@ -24,6 +24,16 @@
  * name implementing the UDF.
  */
 
+// kmeans/kmeans.hpp
+DECLARE_UDF_EXT(kmeans_step_transition, kmeans, KMeans::transition)
+DECLARE_UDF_EXT(kmeans_step_merge_states, kmeans, KMeans::mergeStates)
+DECLARE_UDF_EXT(kmeans_step_final, kmeans, KMeans::final)
+DECLARE_UDF_EXT(internal_kmeans_init_state, kmeans, KMeans::initState)
+DECLARE_UDF_EXT(internal_kmeans_rebase, kmeans, KMeans::rebase)
+DECLARE_UDF_EXT(internal_kmeans_step_distance, kmeans, KMeans::distance)
+DECLARE_UDF_EXT(internal_kmeans_unpruned_fraction, kmeans, KMeans::unprunedFraction)
+DECLARE_UDF_EXT(internal_kmeans_centroids, kmeans, KMeans::centroids)
+
 // prob/student.hpp
 DECLARE_UDF(prob, student_t_cdf)
 
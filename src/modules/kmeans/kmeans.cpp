@@ -0,0 +1,472 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file kmeans.cpp
+ *
+ * @brief k-Means clustering functions
+ *
+ * One iteration of Lloyd's algorithm is a single aggregate over the points:
+ * the transition step assigns each point to its closest centroid and adds it
+ * to the sum of that cluster, and the final step turns the sums into the new
+ * centroids. The points are only read, never written.
+ *
+ * Most points do not change clusters from one iteration to the next. Each
+ * point carries its closest centroid and a lower bound on its distance to the
+ * second closest centroid, and the state records how far every centroid has
+ * moved since these bounds were computed, so that the transition step can
+ * usually keep the point in its cluster without computing the distances to
+ * all centroids (Hamerly's variant of the triangle-inequality pruning).
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#include <modules/kmeans/kmeans.hpp>
+#include <utils/Reference.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace madlib {
+
+using utils::Reference;
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Inter- and intra-iteration state for k-means clustering
+ *
+ * State encapsulates the transition state during the k-means aggregate
+ * function. To the database, the state is exposed as a single
+ * DOUBLE PRECISION array, to the C++ code it is a proper object containing
+ * scalars, vectors, and matrices.
+ *
+ * Note: We assume that the DOUBLE PRECISION array is initialized by the
+ * database with length at least 8, and all elements are 0.
+ *
+ * @internal Array layout (iteration refers to one aggregate-function call):
+ * Inter-iteration components (updated in final function):
+ * - 0: numCentroids (number of centroids)
+ * - 1: dimension (dimension of the points)
+ * - 2: iteration (current iteration)
+ * - 3: maxDisplacement (largest element of displacement)
+ * - 4: centroids (matrix with one centroid per column)
+ * - 4 + numCentroids * dimension: references (matrix with the centroids the
+ *   bounds of the points refer to, one per column)
+ * - 4 + 2 * numCentroids * dimension: displacement (distance of each centroid
+ *   to its reference)
+ * - 4 + 2 * numCentroids * dimension + numCentroids: halfSeparation (half the
+ *   distance of each centroid to the closest other centroid)
+ *
+ * Intra-iteration components (updated in transition step):
+ * - 4 + 2 * numCentroids * dimension + 2 * numCentroids: numRows (number of
+ *   rows already processed in this iteration)
+ * - 5 + 2 * numCentroids * dimension + 2 * numCentroids: numUnpruned (number
+ *   of rows whose bounds did not settle their closest centroid)
+ * - 6 + 2 * numCentroids * dimension + 2 * numCentroids: cost (sum of the
+ *   squared distances between the points and their closest centroids)
+ * - 7 + 2 * numCentroids * dimension + 2 * numCentroids: counts (number of
+ *   points closest to each centroid)
+ * - 7 + 2 * numCentroids * dimension + 3 * numCentroids: sums (matrix with the
+ *   sum of the points closest to each centroid, one per column)
+ */
+class KMeans::State {
+public:
+    State(AnyValue inArg)
+        : mStorage(inArg.copyIfImmutable()),
+          numCentroids(&mStorage[0]),
+          dimension(&mStorage[1]),
+          iteration(&mStorage[2]),
+          maxDisplacement(&mStorage[3]),
+          centroids(TransparentHandle::create(&mStorage[4]),
+                    dimension, numCentroids),
+          references(TransparentHandle::create(
+                        &mStorage[4 + numCentroids * dimension]),
+                     dimension, numCentroids),
+          displacement(TransparentHandle::create(
+                          &mStorage[4 + 2 * numCentroids * dimension]),
+                       numCentroids),
+          halfSeparation(TransparentHandle::create(
+                            &mStorage[4 + 2 * numCentroids * dimension
+                                      + numCentroids]),
+                         numCentroids),
+
+          numRows(&mStorage[4 + 2 * numCentroids * dimension
+                            + 2 * numCentroids]),
+          numUnpruned(&mStorage[5 + 2 * numCentroids * dimension
+                                + 2 * numCentroids]),
+          cost(&mStorage[6 + 2 * numCentroids * dimension
+                         + 2 * numCentroids]),
+          counts(TransparentHandle::create(
+                    &mStorage[7 + 2 * numCentroids * dimension
+                              + 2 * numCentroids]),
+                 numCentroids),
+          sums(TransparentHandle::create(
+                  &mStorage[7 + 2 * numCentroids * dimension
+                            + 3 * numCentroids]),
+               dimension, numCentroids)
+        { }
+
+    /**
+     * We define this function so that we can use State in the
+     * argument list and as a return type.
+     */
+    inline operator AnyValue() const {
+        return mStorage;
+    }
+
+    /**
+     * @brief Initialize the k-means state.
+     *
+     * This function is only called for the first row of an iteration, and
+     * when creating the state that holds the initial centroids.
+     */
+    inline void initialize(AllocatorSPtr inAllocator,
+        const uint32_t inNumCentroids, const uint32_t inDimension) {
+
+        const uint32_t kd = inNumCentroids * inDimension;
+
+        mStorage.rebind(inAllocator,
+            boost::extents[ arraySize(inNumCentroids, inDimension) ]);
+        numCentroids.rebind(&mStorage[0]) = inNumCentroids;
+        dimension.rebind(&mStorage[1]) = inDimension;
+        iteration.rebind(&mStorage[2]) = 0;
+        maxDisplacement.rebind(&mStorage[3]) = 0;
+        centroids.rebind(TransparentHandle::create(&mStorage[4]),
+                         inDimension, inNumCentroids).zeros();
+        references.rebind(TransparentHandle::create(&mStorage[4 + kd]),
+                          inDimension, inNumCentroids).zeros();
+        displacement.rebind(TransparentHandle::create(&mStorage[4 + 2 * kd]),
+                            inNumCentroids).zeros();
+        halfSeparation.rebind(TransparentHandle::create(
+                                  &mStorage[4 + 2 * kd + inNumCentroids]),
+                              inNumCentroids).zeros();
+
+        numRows.rebind(&mStorage[4 + 2 * kd + 2 * inNumCentroids]);
+        numUnpruned.rebind(&mStorage[5 + 2 * kd + 2 * inNumCentroids]);
+        cost.rebind(&mStorage[6 + 2 * kd + 2 * inNumCentroids]);
+        counts.rebind(TransparentHandle::create(
+                          &mStorage[7 + 2 * kd + 2 * inNumCentroids]),
+                      inNumCentroids);
+        sums.rebind(TransparentHandle::create(
+                        &mStorage[7 + 2 * kd + 3 * inNumCentroids]),
+                    inDimension, inNumCentroids);
+        reset();
+    }
+
+    /**
+     * @brief We need to support assigning the previous state
+     */
+    State &operator=(const State &inOtherState) {
+        mStorage = inOtherState.mStorage;
+        return *this;
+    }
+
+    /**
+     * @brief Merge with another State object by adding the intra-iteration fields
+     */
+    State &operator+=(const State &inOtherState) {
+        if (mStorage.size() != inOtherState.mStorage.size() ||
+            numCentroids != inOtherState.numCentroids ||
+            dimension != inOtherState.dimension)
+            throw std::logic_error("Internal error: Incompatible transition states");
+
+        numRows += inOtherState.numRows;
+        numUnpruned += inOtherState.numUnpruned;
+        cost += inOtherState.cost;
+        counts += inOtherState.counts;
+        sums += inOtherState.sums;
+        return *this;
+    }
+
+    /**
+     * @brief Reset the intra-iteration fields.
+     */
+    inline void reset() {
+        numRows = 0;
+        numUnpruned = 0;
+        cost = 0;
+        counts.zeros();
+        sums.zeros();
+    }
+
+    /**
+     * @brief Number of elements of a state without centroids
+     */
+    static const uint32_t kMinArraySize = 7;
+
+private:
+    static inline uint32_t arraySize(const uint32_t inNumCentroids,
+        const uint32_t inDimension) {
+        return kMinArraySize + 3 * inNumCentroids * inDimension
+            + 3 * inNumCentroids;
+    }
+
+    Array<double> mStorage;
+
+public:
+    Reference<double, uint32_t> numCentroids;
+    Reference<double, uint32_t> dimension;
+    Reference<double, uint32_t> iteration;
+    Reference<double> maxDisplacement;
+    DoubleMat centroids;
+    DoubleMat references;
+    DoubleCol displacement;
+    DoubleCol halfSeparation;
+
+    Reference<double, uint64_t> numRows;
+    Reference<double, uint64_t> numUnpruned;
+    Reference<double> cost;
+    DoubleCol counts;
+    DoubleMat sums;
+};
+
+/**
+ * @brief Squared Euclidean distance between two points of the given dimension
+ */
+static inline double squaredDistance(const double *inX, const double *inY,
+    uint32_t inDimension) {
+
+    double dist = 0.;
+    for (uint32_t i = 0; i < inDimension; i++)
+        dist += (inX[i] - inY[i]) * (inX[i] - inY[i]);
+    return dist;
+}
+
+/**
+ * @brief Set halfSeparation to half the distance of every centroid to the
+ *     closest other centroid
+ *
+ * A point whose distance to its centroid is at most this value cannot be
+ * closer to any other centroid. With a single centroid, the value is infinite.
+ */
+static void updateSeparation(KMeans::State &ioState) {
+    uint32_t numCentroids = ioState.numCentroids;
+    uint32_t dimension = ioState.dimension;
+
+    ioState.halfSeparation.fill(std::numeric_limits<double>::infinity());
+    for (uint32_t c = 0; c < numCentroids; c++)
+        for (uint32_t o = c + 1; o < numCentroids; o++) {
+            double half = std::sqrt(squaredDistance(
+                ioState.centroids.colptr(c), ioState.centroids.colptr(o),
+                dimension)) / 2.;
+            if (half < ioState.halfSeparation(c))
+                ioState.halfSeparation(c) = half;
+            if (half < ioState.halfSeparation(o))
+                ioState.halfSeparation(o) = half;
+        }
+}
+
+/**
+ * @brief Perform the k-means transition step
+ *
+ * Besides the point, the transition step takes the centroid (1-based) the
+ * point was closest to when its bounds were last refreshed, and the distance
+ * to the second closest centroid at that time (lower bound). The state knows
+ * how far every centroid has moved since, so, following Hamerly, the point
+ * stays with its centroid a without looking at the other centroids if
+ *
+ *     ||x - a|| <= max(lower - maxDisplacement, halfSeparation(a))
+ *
+ * Only the remaining points are compared to all centroids (ties go to the
+ * centroid that comes first). A centroid index of 0 means the point has no
+ * bounds yet. The exact distance to the closest centroid is needed for the
+ * cost anyway, so it serves as the (tightest) upper bound.
+ *
+ * The bounds are not written back: the caller refreshes them when too many
+ * points (see unprunedFraction()) are no longer settled by them.
+ */
+AnyValue KMeans::transition(AbstractDBInterface &db, AnyValue args) {
+    AnyValue::iterator arg(args);
+
+    // Initialize Arguments from SQL call
+    State state = *arg++;
+    DoubleCol_const x = *arg++;
+    int32_t centroid = *arg++;
+    double lower = *arg++;
+    if (state.numRows == 0) {
+        const State previousState = *arg;
+
+        state.initialize(db.allocator(AbstractAllocator::kAggregate),
+            previousState.numCentroids, previousState.dimension);
+        state = previousState;
+        state.reset();
+    }
+
+    uint32_t numCentroids = state.numCentroids;
+    uint32_t dimension = state.dimension;
+    if (x.n_elem != dimension)
+        throw std::invalid_argument("Dimensions of point and centroids do not "
+            "match");
+
+    // Now do the transition step
+    uint32_t closest = 0;
+    double minDist = std::numeric_limits<double>::infinity();
+    bool settled = false;
+    if (centroid >= 1 && static_cast<uint32_t>(centroid) <= numCentroids) {
+        closest = centroid - 1;
+        minDist = squaredDistance(x.memptr(), state.centroids.colptr(closest),
+            dimension);
+        settled = std::sqrt(minDist) <= std::max(
+            lower - state.maxDisplacement,
+            static_cast<double>(state.halfSeparation(closest)));
+    }
+    if (!settled) {
+        for (uint32_t c = 0; c < numCentroids; c++) {
+            double dist = squaredDistance(x.memptr(),
+                state.centroids.colptr(c), dimension);
+            if (dist < minDist || (dist == minDist && c < closest)) {
+                minDist = dist;
+                closest = c;
+            }
+        }
+        state.numUnpruned++;
+    }
+
+    state.numRows++;
+    state.cost += minDist;
+    state.counts(closest) += 1;
+    state.sums.col(closest) += x;
+    return state;
+}
+
+/**
+ * @brief Perform the perliminary aggregation function: Merge transition states
+ */
+AnyValue KMeans::mergeStates(AbstractDBInterface &db, AnyValue args) {
+    State stateLeft = args[0].copyIfImmutable();
+    const State stateRight = args[1];
+
+    // We first handle the trivial case where this function is called with one
+    // of the states being the initial state
+    if (stateLeft.numRows == 0)
+        return stateRight;
+    else if (stateRight.numRows == 0)
+        return stateLeft;
+
+    // Merge states together and return
+    stateLeft += stateRight;
+    return stateLeft;
+}
+
+/**
+ * @brief Perform the k-means final step
+ *
+ * Every centroid moves to the mean of the points closest to it. A centroid
+ * without points keeps its position.
+ */
+AnyValue KMeans::final(AbstractDBInterface &db, AnyValue args) {
+    // Argument from SQL call
+    State state = args[0].copyIfImmutable();
+
+    state.maxDisplacement = 0;
+    for (uint32_t c = 0; c < state.numCentroids; c++) {
+        if (state.counts(c) > 0)
+            state.centroids.col(c) = state.sums.col(c) / state.counts(c);
+        state.displacement(c) = std::sqrt(squaredDistance(
+            state.centroids.colptr(c), state.references.colptr(c),
+            state.dimension));
+        if (state.displacement(c) > state.maxDisplacement)
+            state.maxDisplacement = state.displacement(c);
+    }
+    updateSeparation(state);
+    state.iteration++;
+    return state;
+}
+
+/**
+ * @brief Return a state holding the given centroids
+ *
+ * The first argument contains the coordinates of all centroids, one centroid
+ * after the other, the second argument is the number of centroids.
+ */
+AnyValue KMeans::initState(AbstractDBInterface &db, AnyValue args) {
+    DoubleCol_const coords = args[0];
+    int32_t numCentroids = args[1];
+
+    if (numCentroids <= 0 || coords.n_elem == 0 ||
+        coords.n_elem % numCentroids != 0)
+        throw std::invalid_argument("Number of coordinates is not a multiple "
+            "of the number of centroids");
+
+    // initialize() binds the state to new memory, so an empty state will do
+    // as a starting point
+    Array<double> empty(db.allocator(), boost::extents[ State::kMinArraySize ]);
+    std::fill(empty.data(), empty.data() + State::kMinArraySize, 0.);
+
+    State state = empty;
+    state.initialize(db.allocator(), numCentroids,
+        coords.n_elem / numCentroids);
+    std::copy(coords.memptr(), coords.memptr() + coords.n_elem,
+        state.centroids.memptr());
+    std::copy(coords.memptr(), coords.memptr() + coords.n_elem,
+        state.references.memptr());
+    updateSeparation(state);
+    return state;
+}
+
+/**
+ * @brief Return the state with the bounds of the points referring to its
+ *     current centroids
+ *
+ * To be called whenever the bounds of the points are recomputed from the
+ * centroids of the state.
+ */
+AnyValue KMeans::rebase(AbstractDBInterface &db, AnyValue args) {
+    State state = args[0].copyIfImmutable();
+
+    std::copy(state.centroids.memptr(),
+        state.centroids.memptr() + state.centroids.n_elem,
+        state.references.memptr());
+    state.displacement.zeros();
+    state.maxDisplacement = 0;
+    return state;
+}
+
+/**
+ * @brief Return the relative difference in cost between two states
+ */
+AnyValue KMeans::distance(AbstractDBInterface &db, AnyValue args) {
+    const State stateLeft = args[0];
+    const State stateRight = args[1];
+
+    double maxCost = std::max<double>(stateLeft.cost, stateRight.cost);
+    if (maxCost == 0.)
+        return 0.;
+    return std::abs(stateLeft.cost - stateRight.cost) / maxCost;
+}
+
+/**
+ * @brief Return the fraction of points in the last iteration that had to be
+ *     compared to all centroids
+ */
+AnyValue KMeans::unprunedFraction(AbstractDBInterface &db, AnyValue args) {
+    const State state = args[0];
+
+    if (state.numRows == 0)
+        return 0.;
+    return static_cast<double>(state.numUnpruned) / state.numRows;
+}
+
+/**
+ * @brief Return the coordinates of all centroids, one centroid after the other
+ *
+ * Extracting the centroids in a single call means that the (possibly large)
+ * state is read only once.
+ */
+AnyValue KMeans::centroids(AbstractDBInterface &db, AnyValue args) {
+    const State state = args[0];
+
+    // For efficiency reasons, we want to return this by reference, so we need
+    // to bind to db memory
+    DoubleCol coords(db.allocator(), state.numCentroids * state.dimension);
+    std::copy(state.centroids.memptr(),
+        state.centroids.memptr() + coords.n_elem, coords.memptr());
+    return coords;
+}
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
@@ -0,0 +1,41 @@
+/* ----------------------------------------------------------------------- *//**
+ *
+ * @file kmeans.hpp
+ *
+ *//* ----------------------------------------------------------------------- */
+
+#ifndef MADLIB_KMEANS_KMEANS_H
+#define MADLIB_KMEANS_KMEANS_H
+
+#include <modules/common.hpp>
+
+namespace madlib {
+
+namespace modules {
+
+namespace kmeans {
+
+/**
+ * @brief Functions for k-means clustering, using Lloyd's algorithm
+ */
+struct KMeans {
+    class State;
+
+    static AnyValue transition(AbstractDBInterface &db, AnyValue args);
+    static AnyValue mergeStates(AbstractDBInterface &db, AnyValue args);
+    static AnyValue final(AbstractDBInterface &db, AnyValue args);
+
+    static AnyValue initState(AbstractDBInterface &db, AnyValue args);
+    static AnyValue rebase(AbstractDBInterface &db, AnyValue args);
+    static AnyValue distance(AbstractDBInterface &db, AnyValue args);
+    static AnyValue unprunedFraction(AbstractDBInterface &db, AnyValue args);
+    static AnyValue centroids(AbstractDBInterface &db, AnyValue args);
+};
+
+} // namespace kmeans
+
+} // namespace modules
+
+} // namespace madlib
+
+#endif
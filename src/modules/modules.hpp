@@ -9,6 +9,7 @@
 #ifndef MADLIB_MODULES_MODULES_HPP
 #define MADLIB_MODULES_MODULES_HPP
 
+#include <modules/kmeans/kmeans.hpp>
 #include <modules/prob/student.hpp>
 #include <modules/regress/linear.hpp>
 #include <modules/regress/logistic.hpp>